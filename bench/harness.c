@@ -0,0 +1,229 @@
+// File: harness.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+ * Benchmark harness: runs each workload as
+ *
+ *   lispy prelude workload.lspy
+ *
+ * several times with its output discarded, and reports the median and p99
+ * wall time, the median count of user-space instructions (where the kernel
+ * allows perf counters) and the peak RSS. With -o the results are also
+ * written as JSON for regression tracking.
+ */
+
+/* Measurements of one workload */
+typedef struct {
+  char* name;
+  int failed;           // A run exited abnormally
+  double* secs;         // Wall time of every run
+  long long* instrs;    // Instructions of every run, -1 if not counted
+  long max_rss;         // Peak RSS over all runs, in KB
+} bench;
+
+/**
+ * Start counting the user-space instructions of a process, from its exec on.
+ * @param pid The process, stopped before its exec.
+ * @return The counter, or -1 if perf counters are not available.
+ */
+static int counter_open(pid_t pid) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+/**
+ * Run a command once.
+ * @param argv The command, NULL-terminated.
+ * @param secs Receives the wall time.
+ * @param instrs Receives the instruction count, or -1.
+ * @param rss Receives the peak RSS in KB.
+ * @return 0 if the command exited with status 0.
+ */
+static int run_once(char** argv, double* secs, long long* instrs, long* rss) {
+  /* The child waits on the pipe until its counter is set up */
+  int go[2];
+  if (pipe(go) != 0) return -1;
+
+  pid_t pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    char c;
+    close(go[1]);
+    if (read(go[0], &c, 1) != 1) _exit(127);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+
+  close(go[0]);
+  int counter = counter_open(pid);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (write(go[1], "x", 1) != 1) return -1;
+  close(go[1]);
+
+  int status;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  *secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  *rss = ru.ru_maxrss;
+  *instrs = -1;
+  if (counter >= 0) {
+    long long n;
+    if (read(counter, &n, sizeof(n)) == sizeof(n)) *instrs = n;
+    close(counter);
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static int cmp_llong(const void* a, const void* b) {
+  long long x = *(const long long*)a, y = *(const long long*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Get the index of a percentile in n sorted samples (nearest rank).
+ */
+static int rank(int n, double p) {
+  int i = (int)ceil(p * n) - 1;
+  return i < 0 ? 0 : i;
+}
+
+/**
+ * Get the name of a workload: its file name without directory or extension.
+ * @return A new string.
+ */
+static char* workload_name(char* path) {
+  char* base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  size_t len = strcspn(base, ".");
+  char* name = malloc(len + 1);
+  memcpy(name, base, len);
+  name[len] = '\0';
+  return name;
+}
+
+static void usage(void) {
+  fputs("Usage: bench-harness [-n runs] [-w warmup] [-o out.json] "
+        "lispy prelude workload...\n", stderr);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  int runs = 10;
+  int warmup = 1;
+  char* json = NULL;
+
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (i + 1 >= argc) usage();
+    if (strcmp(argv[i], "-n") == 0) runs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-w") == 0) warmup = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0) json = argv[++i];
+    else usage();
+  }
+  if (argc - i < 3 || runs < 1 || warmup < 0) usage();
+
+  char* lispy = argv[i];
+  char* prelude = argv[i + 1];
+  int count = argc - i - 2;
+  bench* benches = calloc(count, sizeof(bench));
+
+  printf("%-12s %10s %10s %16s %10s\n", "workload", "median", "p99", "instructions", "peak RSS");
+  for (int w = 0; w < count; w++) {
+    bench* b = &benches[w];
+    char* path = argv[i + 2 + w];
+    char* cmd[] = { lispy, prelude, path, NULL };
+    b->name = workload_name(path);
+    b->secs = malloc(sizeof(double) * runs);
+    b->instrs = malloc(sizeof(long long) * runs);
+
+    for (int r = -warmup; r < runs; r++) {
+      double secs = 0;
+      long long instrs = -1;
+      long rss = 0;
+      if (run_once(cmd, &secs, &instrs, &rss) != 0) b->failed = 1;
+      if (r < 0) continue;
+      b->secs[r] = secs;
+      b->instrs[r] = instrs;
+      if (rss > b->max_rss) b->max_rss = rss;
+    }
+    qsort(b->secs, runs, sizeof(double), cmp_double);
+    qsort(b->instrs, runs, sizeof(long long), cmp_llong);
+
+    char instrs[32] = "-";
+    if (b->instrs[0] >= 0) snprintf(instrs, sizeof(instrs), "%lli", b->instrs[rank(runs, 0.5)]);
+    printf("%-12s %8.3f s %8.3f s %16s %7li KB%s\n", b->name,
+           b->secs[rank(runs, 0.5)], b->secs[rank(runs, 0.99)],
+           instrs, b->max_rss, b->failed ? "  FAILED" : "");
+    fflush(stdout);
+  }
+
+  int failed = 0;
+  for (int w = 0; w < count; w++) failed |= benches[w].failed;
+
+  if (json) {
+    FILE* f = fopen(json, "w");
+    if (!f) {
+      fprintf(stderr, "Could not write \"%s\".\n", json);
+      return 1;
+    }
+    fprintf(f, "{\n  \"runs\": %i,\n  \"warmup\": %i,\n  \"workloads\": [\n", runs, warmup);
+    for (int w = 0; w < count; w++) {
+      bench* b = &benches[w];
+      fprintf(f, "    {\"name\": \"%s\", \"median_s\": %.6f, \"p99_s\": %.6f, ",
+              b->name, b->secs[rank(runs, 0.5)], b->secs[rank(runs, 0.99)]);
+      if (b->instrs[0] >= 0) fprintf(f, "\"instructions\": %lli, ", b->instrs[rank(runs, 0.5)]);
+      else fprintf(f, "\"instructions\": null, ");
+      fprintf(f, "\"max_rss_kb\": %li, \"ok\": %s}%s\n",
+              b->max_rss, b->failed ? "false" : "true", w + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+  }
+
+  for (int w = 0; w < count; w++) {
+    free(benches[w].name);
+    free(benches[w].secs);
+    free(benches[w].instrs);
+  }
+  free(benches);
+  return failed;
+}
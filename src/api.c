@@ -0,0 +1,372 @@
+// File: api.c
+#include "lisp.h"
+#include "lispy.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Every entry point makes its context current for the duration of the
+ * call and restores the previous one afterwards, so calls nest freely.
+ */
+
+/**
+ * Create an interpreter context.
+ * @return The new context.
+ */
+lispy* lispy_new(void) {
+  return lctx_new();
+}
+
+/**
+ * Create an interpreter context whose values and environments are
+ * allocated with the given functions instead of malloc, realloc and free.
+ * Every block is freed with the functions of the context it was
+ * allocated in.
+ * @param alloc Allocates a block, like malloc.
+ * @param realloc Resizes a block, like realloc.
+ * @param free Frees a block, like free.
+ * @return The new context.
+ */
+lispy* lispy_new_with_allocator(void* (*alloc)(size_t size),
+                                void* (*realloc)(void* ptr, size_t size),
+                                void (*free)(void* ptr)) {
+  return lctx_new_with(alloc, realloc, free);
+}
+
+/**
+ * Delete a context and everything it owns.
+ * @param c The context.
+ */
+void lispy_free(lispy* c) {
+  lctx_del(c);
+}
+
+/**
+ * Get the context the calling thread is evaluating in, e.g. from a builtin.
+ * @return The context, or NULL outside of any call.
+ */
+lispy* lispy_current(void) {
+  return lctx_current();
+}
+
+/**
+ * Evaluate every expression in a string.
+ * @param c The context.
+ * @param src The source text.
+ * @return The value of the last expression, or the first error.
+ */
+lispy_val* lispy_eval(lispy* c, const char* src) {
+  lctx* prev = lctx_begin(c);
+  lval* x;
+
+  mpc_result_t r;
+  if (mpc_parse("<eval>", src, c->lispy, &r)) {
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    x = lval_sexpr();
+    while (expr->count && x->type != LVAL_ERR) {
+      lval_del(x);
+      x = lval_eval(c->env, lval_pop(expr, 0));
+    }
+    lval_del(expr);
+  } else {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    x = lval_err("%s", err_msg);
+    free(err_msg);
+  }
+
+  lctx_end(c, prev);
+  return x;
+}
+
+/**
+ * Load and evaluate a file.
+ * @param c The context.
+ * @param path The file path.
+ * @return An empty list, or an error if the file could not be parsed.
+ */
+lispy_val* lispy_load(lispy* c, const char* path) {
+  return lctx_load(c, (char*)path);
+}
+
+/**
+ * Call a function by name.
+ * @param c The context.
+ * @param name Name the function is defined under.
+ * @param argc Number of arguments.
+ * @param argv The arguments; the call consumes them.
+ * @return The result, or an error.
+ */
+lispy_val* lispy_call(lispy* c, const char* name, int argc, lispy_val** argv) {
+  lctx* prev = lctx_begin(c);
+
+  lval* args = lval_sexpr();
+  for (int i = 0; i < argc; i++) {
+    args = lval_add(args, argv[i]);
+  }
+
+  lval* k = lval_sym((char*)name);
+  lval* f = lenv_get(c->env, k);
+  lval_del(k);
+
+  lval* x;
+  if (f->type == LVAL_FUN) {
+    x = lval_call(c->env, f, args);
+    lval_del(f);
+  } else if (f->type == LVAL_ERR) {
+    lval_del(args);
+    x = f;
+  } else {
+    x = lval_err("'%s' is a %s, not a Function.", name, ltype_name(f->type));
+    lval_del(args);
+    lval_del(f);
+  }
+
+  lctx_end(c, prev);
+  return x;
+}
+
+/**
+ * Get a copy of a global variable.
+ * @param c The context.
+ * @param name The variable name.
+ * @return The value, or an error if it is unbound.
+ */
+lispy_val* lispy_get(lispy* c, const char* name) {
+  lctx* prev = lctx_enter(c);
+  lval* k = lval_sym((char*)name);
+  lval* x = lenv_get(c->env, k);
+  lval_del(k);
+  lctx_enter(prev);
+  return x;
+}
+
+/**
+ * Define a global variable.
+ * @param c The context.
+ * @param name The variable name.
+ * @param v The value; consumed.
+ */
+void lispy_def(lispy* c, const char* name, lispy_val* v) {
+  lctx* prev = lctx_enter(c);
+  lval* k = lval_sym((char*)name);
+  lenv_def(c->env, k, v);
+  lval_del(k);
+  lval_del(v);
+  lctx_enter(prev);
+}
+
+/**
+ * Add a native builtin function.
+ * @param c The context.
+ * @param name The name to define it under.
+ * @param fn The function.
+ */
+void lispy_register(lispy* c, const char* name, lispy_builtin fn) {
+  lispy_register_fast(c, name, fn, NULL);
+}
+
+/**
+ * Add a native builtin function with a fast path for two number arguments.
+ * @param c The context.
+ * @param name The name to define it under.
+ * @param fn The generic function, used whenever the fast path declines.
+ * @param fast The fast path, or NULL.
+ */
+void lispy_register_fast(lispy* c, const char* name, lispy_builtin fn, lispy_fast fast) {
+  lctx* prev = lctx_enter(c);
+  lval* f = lval_builtin(fn);
+  f->fast = fast;
+  lctx_enter(prev);
+  lispy_def(c, name, f);
+}
+
+/**
+ * Bound the evaluation done from now on, e.g. before each request.
+ * When a limit is reached the evaluation in progress returns an error, and
+ * so does any further evaluation until the limits are set again.
+ * @param c The context.
+ * @param steps Evaluation steps allowed, or 0 for no limit.
+ * @param ms Milliseconds allowed, or 0 for no limit.
+ */
+void lispy_limit(lispy* c, long steps, long ms) {
+  lctx_limit(c, steps, ms);
+}
+
+/**
+ * Bound the memory used by values and environments. When evaluation takes
+ * the context over the quota it returns an error, and so does any further
+ * evaluation until the quota is set again.
+ * @param c The context.
+ * @param bytes Bytes allowed in use, or 0 for no limit.
+ */
+void lispy_quota(lispy* c, long bytes) {
+  lctx_quota(c, bytes);
+}
+
+/**
+ * Get the memory used by the values and environments of a context.
+ * @param c The context.
+ * @return The number of bytes in use.
+ */
+long lispy_memory(lispy* c) {
+  return __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Create a number.
+ */
+lispy_val* lispy_num(lispy* c, long x) {
+  lctx* prev = lctx_enter(c);
+  lval* v = lval_num(x);
+  lctx_enter(prev);
+  return v;
+}
+
+/**
+ * Create a string from a NUL-terminated C string.
+ */
+lispy_val* lispy_str(lispy* c, const char* s) {
+  return lispy_str_n(c, s, strlen(s));
+}
+
+/**
+ * Create a string from bytes, which may include NULs.
+ */
+lispy_val* lispy_str_n(lispy* c, const char* s, size_t n) {
+  lctx* prev = lctx_enter(c);
+  lval* v = lval_str_n((char*)s, n);
+  lctx_enter(prev);
+  return v;
+}
+
+/**
+ * Create an error with a message.
+ */
+lispy_val* lispy_error(lispy* c, const char* msg) {
+  lctx* prev = lctx_enter(c);
+  lval* v = lval_err("%s", msg);
+  lctx_enter(prev);
+  return v;
+}
+
+/**
+ * Create an empty list (Q-expression).
+ */
+lispy_val* lispy_list(lispy* c) {
+  lctx* prev = lctx_enter(c);
+  lval* v = lval_qexpr();
+  lctx_enter(prev);
+  return v;
+}
+
+/**
+ * Append a value to a list.
+ * @param c The context.
+ * @param list The list.
+ * @param v The value; consumed.
+ * @return The list.
+ */
+lispy_val* lispy_push(lispy* c, lispy_val* list, lispy_val* v) {
+  lctx* prev = lctx_enter(c);
+  lval_add(list, v);
+  lctx_enter(prev);
+  return list;
+}
+
+/**
+ * Create a deep copy of a value.
+ */
+lispy_val* lispy_copy(lispy* c, lispy_val* v) {
+  lctx* prev = lctx_enter(c);
+  lval* x = lval_copy(v);
+  lctx_enter(prev);
+  return x;
+}
+
+/**
+ * Free a value owned by the caller.
+ */
+void lispy_val_free(lispy* c, lispy_val* v) {
+  lctx* prev = lctx_enter(c);
+  lval_del(v);
+  lctx_enter(prev);
+}
+
+/**
+ * Get the type of a value.
+ * @return One of the LISPY_* types.
+ */
+int lispy_type(lispy_val* v) {
+  switch (v->type) {
+    case LVAL_ERR: return LISPY_ERR;
+    case LVAL_NUM: return LISPY_NUM;
+    case LVAL_SYM: return LISPY_SYM;
+    case LVAL_STR: return LISPY_STR;
+    case LVAL_FUN: return LISPY_FUN;
+    case LVAL_SEXPR: return LISPY_SEXPR;
+    case LVAL_QEXPR: return LISPY_QEXPR;
+    default: return LISPY_OTHER;
+  }
+}
+
+/**
+ * Get the value of a number.
+ * @return The number, or 0 for other types.
+ */
+long lispy_to_num(lispy_val* v) {
+  return v->type == LVAL_NUM ? v->num : 0;
+}
+
+/**
+ * Get the text of a string, symbol or error message.
+ * @param v The value.
+ * @param len Set to the length in bytes, if not NULL.
+ * @return The text, owned by the value, or NULL for other types.
+ */
+const char* lispy_to_str(lispy_val* v, size_t* len) {
+  const char* s;
+  switch (v->type) {
+    case LVAL_STR:
+      if (len) *len = v->len;
+      return v->str;
+    case LVAL_SYM: s = v->sym; break;
+    case LVAL_ERR: s = v->err; break;
+    default: return NULL;
+  }
+  if (len) *len = strlen(s);
+  return s;
+}
+
+/**
+ * Get the number of elements of a list or S-expression.
+ * @return The count, or 0 for other types.
+ */
+int lispy_count(lispy_val* v) {
+  return v->type == LVAL_SEXPR || v->type == LVAL_QEXPR ? v->count : 0;
+}
+
+/**
+ * Get an element of a list or S-expression.
+ * @return The element, owned by the list, or NULL if out of range.
+ */
+lispy_val* lispy_item(lispy_val* v, int i) {
+  return i >= 0 && i < lispy_count(v) ? v->cell[i] : NULL;
+}
+
+/**
+ * Render a value as print would show it.
+ * @return A NUL-terminated string to be released with free().
+ */
+char* lispy_to_string(lispy_val* v) {
+  lbuf b;
+  lbuf_init_grow(&b, 64);
+  lval_write(&b, v);
+  char* s = malloc(b.len + 1);
+  memcpy(s, b.data, b.len);
+  s[b.len] = '\0';
+  lfree(b.data);
+  return s;
+}
@@ -4,28 +4,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-/* Assertion Macros for Builtins */
-#define LASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { \
-    lval* err = lval_err(fmt, ##__VA_ARGS__); \
-    lval_del(args); \
-    return err; \
-  }
-
-#define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
-    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
-
-#define LASSERT_NUM(func, args, num) \
-  LASSERT(args, args->count == num, \
-    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-    func, args->count, num)
-
-#define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, args->cell[index]->count != 0, \
-    "Function '%s' passed {} for argument %i.", func, index)
-
 /**
  * Builtin: Create a lambda function.
  */
@@ -43,7 +21,39 @@ lval* builtin_lambda(lenv* e, lval* a) {
   lval* formals = lval_pop(a, 0);
   lval* body = lval_pop(a, 0);
   lval_del(a);
-  return lval_lambda(formals, body);
+  return lval_optimize(e, lval_close(lval_lambda(formals, body), e));
+}
+
+/**
+ * Builtin: Define a global function, (fun {name formals...} {body}).
+ * Under lexical scope the function closes over the environment fun is
+ * called in, not over fun's own arguments.
+ */
+lval* builtin_fun(lenv* e, lval* a) {
+  LASSERT_NUM("fun", a, 2);
+  LASSERT_TYPE("fun", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("fun", a, 1, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count > 0,
+          "Function 'fun' passed {} for name.");
+  LASSERT(a, !lenv_root(e)->frozen,
+          "Function 'fun' cannot define globals inside pmap, pfilter or preduce.");
+
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+            "Cannot define non-symbol. Got %s, Expected %s.",
+            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  lval* formals = lval_pop(a, 0);
+  lval* body = lval_pop(a, 0);
+  lval* name = lval_pop(formals, 0);
+  lval* f = lval_optimize(e, lval_close(lval_lambda(formals, body), e));
+  ljit_attach(f, e, name->sym);
+  lenv_def(e, name, f);
+  lval_del(name);
+  lval_del(f);
+  lval_del(a);
+  return lval_sexpr();
 }
 
 /**
@@ -144,6 +154,16 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
   return x;
 }
 
+/* Fast paths of the arithmetic builtins */
+static int fast_add(long x, long y, long* r) { *r = x + y; return 1; }
+static int fast_sub(long x, long y, long* r) { *r = x - y; return 1; }
+static int fast_mul(long x, long y, long* r) { *r = x * y; return 1; }
+static int fast_div(long x, long y, long* r) {
+  if (y == 0) return 0;
+  *r = x / y;
+  return 1;
+}
+
 lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
 lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
 lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
@@ -162,6 +182,8 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
             func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
   }
 
+  LASSERT(a, strcmp(func, "def") != 0 || !lenv_root(e)->frozen,
+          "Function 'def' cannot define globals inside pmap, pfilter or preduce.");
   LASSERT(a, (syms->count == a->count - 1),
           "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.",
           func, syms->count, a->count - 1);
@@ -198,6 +220,14 @@ lval* builtin_ord(lenv* e, lval* a, char* op) {
   return lval_num(r);
 }
 
+/* Fast paths of the comparison builtins */
+static int fast_gt(long x, long y, long* r) { *r = x > y; return 1; }
+static int fast_lt(long x, long y, long* r) { *r = x < y; return 1; }
+static int fast_ge(long x, long y, long* r) { *r = x >= y; return 1; }
+static int fast_le(long x, long y, long* r) { *r = x <= y; return 1; }
+static int fast_eq(long x, long y, long* r) { *r = x == y; return 1; }
+static int fast_ne(long x, long y, long* r) { *r = x != y; return 1; }
+
 lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">"); }
 lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<"); }
 lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">="); }
@@ -248,7 +278,7 @@ lval* builtin_load(lenv* e, lval* a) {
   LASSERT_TYPE("load", a, 0, LVAL_STR);
 
   mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+  if (mpc_parse_contents(a->cell[0]->str, lctx_current()->lispy, &r)) {
     lval* expr = lval_read(r.output);
     mpc_ast_delete(r.output);
 
@@ -274,15 +304,36 @@ lval* builtin_load(lenv* e, lval* a) {
  * Builtin: Print arguments.
  */
 lval* builtin_print(lenv* e, lval* a) {
+  lbuf* out = lbuf_stdout();
   for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]);
-    putchar(' ');
+    lval_write(out, a->cell[i]);
+    lbuf_putc(out, ' ');
   }
-  putchar('\n');
+  lbuf_putc(out, '\n');
+  lbuf_flush(out);
   lval_del(a);
   return lval_sexpr();
 }
 
+/**
+ * Builtin: Render a value as the string print would show.
+ * Measures the output first so the result is built in one allocation.
+ */
+lval* builtin_to_string(lenv* e, lval* a) {
+  LASSERT_NUM("to-string", a, 1);
+
+  lbuf b;
+  lbuf_init(&b, NULL, 0, NULL);
+  lval_write(&b, a->cell[0]);
+
+  lval* x = lval_str_alloc(b.len);
+  lbuf_init(&b, x->str, b.len, NULL);
+  lval_write(&b, a->cell[0]);
+
+  lval_del(a);
+  return x;
+}
+
 /**
  * Builtin: Create an error from a string.
  */
@@ -309,6 +360,25 @@ static void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
   lval_del(v);
 }
 
+/**
+ * Add a builtin function with a fast path for two Number arguments.
+ * @param e The environment.
+ * @param name The symbol name.
+ * @param func The generic builtin, used whenever the fast path declines.
+ * @param fast The fast path.
+ * @param fold Whether the fast path also applies, left to right, to calls
+ *             with more Number arguments.
+ */
+static void lenv_add_fast(lenv* e, char* name, lbuiltin func, lfast fast, int fold) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  v->fast = fast;
+  v->fold = fold;
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
 /**
  * Add all builtin functions to the environment.
  * @param e The environment.
@@ -316,8 +386,10 @@ static void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
 void lenv_add_builtins(lenv* e) {
   /* Variable Functions */
   lenv_add_builtin(e, "\\", builtin_lambda);
+  lenv_add_builtin(e, "fun", builtin_fun);
   lenv_add_builtin(e, "def", builtin_def);
   lenv_add_builtin(e, "=", builtin_put);
+  lenv_add_builtin(e, "lexical", builtin_lexical);
 
   /* List Functions */
   lenv_add_builtin(e, "list", builtin_list);
@@ -327,22 +399,77 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "join", builtin_join);
 
   /* Mathematical Functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_fast(e, "+", builtin_add, fast_add, 1);
+  lenv_add_fast(e, "-", builtin_sub, fast_sub, 1);
+  lenv_add_fast(e, "*", builtin_mul, fast_mul, 1);
+  lenv_add_fast(e, "/", builtin_div, fast_div, 1);
 
   /* Comparison Functions */
   lenv_add_builtin(e, "if", builtin_if);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
-  lenv_add_builtin(e, ">", builtin_gt);
-  lenv_add_builtin(e, "<", builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_fast(e, "==", builtin_eq, fast_eq, 0);
+  lenv_add_fast(e, "!=", builtin_ne, fast_ne, 0);
+  lenv_add_fast(e, ">", builtin_gt, fast_gt, 0);
+  lenv_add_fast(e, "<", builtin_lt, fast_lt, 0);
+  lenv_add_fast(e, ">=", builtin_ge, fast_ge, 0);
+  lenv_add_fast(e, "<=", builtin_le, fast_le, 0);
 
   /* String Functions */
   lenv_add_builtin(e, "load", builtin_load);
   lenv_add_builtin(e, "error", builtin_error);
   lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "to-string", builtin_to_string);
+  lenv_add_builtin(e, "str-len", builtin_str_len);
+  lenv_add_builtin(e, "str-cat", builtin_str_cat);
+  lenv_add_builtin(e, "substr", builtin_substr);
+  lenv_add_builtin(e, "str-split", builtin_str_split);
+  lenv_add_builtin(e, "str-join", builtin_str_join);
+  lenv_add_builtin(e, "str->num", builtin_str_to_num);
+  lenv_add_builtin(e, "num->str", builtin_num_to_str);
+
+  /* Rope and String Builder Functions */
+  lenv_add_builtin(e, "rope", builtin_rope);
+  lenv_add_builtin(e, "rope-slice", builtin_rope_slice);
+  lenv_add_builtin(e, "rope-len", builtin_rope_len);
+  lenv_add_builtin(e, "rope->str", builtin_rope_to_str);
+  lenv_add_builtin(e, "string-builder", builtin_string_builder);
+  lenv_add_builtin(e, "append!", builtin_append);
+
+  /* File Functions */
+  lenv_add_builtin(e, "open", builtin_open);
+  lenv_add_builtin(e, "read-line", builtin_read_line);
+  lenv_add_builtin(e, "read-all", builtin_read_all);
+  lenv_add_builtin(e, "write", builtin_write);
+  lenv_add_builtin(e, "close", builtin_close);
+  lenv_add_builtin(e, "for-each-line", builtin_for_each_line);
+
+  /* Regular Expression Functions */
+  lenv_add_builtin(e, "re-compile", builtin_re_compile);
+  lenv_add_builtin(e, "re-match", builtin_re_match);
+  lenv_add_builtin(e, "re-find-all", builtin_re_find_all);
+  lenv_add_builtin(e, "re-split", builtin_re_split);
+
+  /* Parallel Functions */
+  lenv_add_builtin(e, "pmap", builtin_pmap);
+  lenv_add_builtin(e, "pfilter", builtin_pfilter);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+
+  /* Task Functions */
+  lenv_add_builtin(e, "spawn", builtin_spawn);
+  lenv_add_builtin(e, "await", builtin_await);
+  lenv_add_builtin(e, "yield", builtin_yield);
+
+  /* Sequence Functions */
+  lenv_add_builtin(e, "range", builtin_range);
+  lenv_add_builtin(e, "iterate", builtin_iterate);
+  lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+  lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+  lenv_add_builtin(e, "take", builtin_take);
+  lenv_add_builtin(e, "realize", builtin_realize);
+
+  /* Introspection Functions */
+  lenv_add_builtin(e, "stats", builtin_stats);
+
+  /* Limit Functions */
+  lenv_add_builtin(e, "limit", builtin_limit);
+  lenv_add_builtin(e, "quota", builtin_quota);
 }
\ No newline at end of file
@@ -0,0 +1,262 @@
+// File: compile.c
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+
+/*
+ * Ahead-of-time compilation of Lisp files to C (--compile). The output
+ * holds, for every top-level form, a C function constructing the form as
+ * the reader would, so the program needs no parsing when it runs, and a
+ * main that evaluates the forms in order with the runtime (liblispy.a).
+ *
+ * Functions defined with fun or define whose bodies are in the subset
+ * the JIT compiles (see jit.c) are also translated to C functions, which
+ * the program installs as the function's compiled code right after
+ * evaluating its definition. To know what the globals such a body uses
+ * are bound to, the compiler evaluates the definitions it meets, and defs
+ * whose values are not calls, in a context of its own; nothing else in
+ * the files is evaluated. A program only uses a translation if the
+ * function translates the same way when it runs, and falls back to the
+ * interpreter as the JIT does.
+ */
+
+/**
+ * Build an S-expression or Q-expression from its elements, giving the
+ * head symbol a cache as lval_read does. Called by compiled programs.
+ * @param type LVAL_SEXPR or LVAL_QEXPR.
+ * @param n The number of elements that follow.
+ * @return The expression.
+ */
+lval* lcomp_list(int type, int n, ...) {
+  lval* x = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+  va_list ap;
+  va_start(ap, n);
+  for (int i = 0; i < n; i++) x = lval_add(x, va_arg(ap, lval*));
+  va_end(ap);
+  if (x->count > 0 && x->cell[0]->type == LVAL_SYM) x->cell[0]->cache = lcache_new();
+  return x;
+}
+
+/**
+ * Run a compiled program: evaluate its forms in order in a new context,
+ * printing errors as load does. Called by the main of compiled programs.
+ * @param forms The forms.
+ * @param count Their number.
+ * @return The exit status.
+ */
+int lcomp_run(const lcomp_form* forms, int count) {
+  lctx* c = lctx_new();
+  lctx_enter(c);
+  for (int i = 0; i < count; i++) {
+    lctx_begin(c);
+    lval* x = lval_eval(c->env, forms[i].build());
+    if (x->type == LVAL_ERR) lval_println(x);
+    lval_del(x);
+    if (forms[i].name) {
+      ljit_preload(c->env, forms[i].name, forms[i].id, forms[i].fn, forms[i].hash);
+    }
+    lctx_end(c, c);
+  }
+  lpool_shutdown();
+  lctx_del(c);
+  lregex_cache_clear();
+  return 0;
+}
+
+/**
+ * Write bytes as a C string literal.
+ */
+static void lcomp_string(lbuf* out, const char* s, size_t n) {
+  char esc[8];
+  lbuf_putc(out, '"');
+  for (size_t i = 0; i < n; i++) {
+    unsigned char ch = s[i];
+    if (ch >= ' ' && ch <= '~' && ch != '"' && ch != '\\' && ch != '?') {
+      lbuf_putc(out, ch);
+    } else {
+      snprintf(esc, sizeof(esc), "\\%03o", ch);
+      lbuf_puts(out, esc);
+    }
+  }
+  lbuf_putc(out, '"');
+}
+
+/**
+ * Write a C expression constructing a value the reader produced.
+ */
+static void lcomp_value(lbuf* out, lval* v) {
+  char num[64];
+  switch (v->type) {
+    case LVAL_NUM:
+      if (v->num == LONG_MIN) snprintf(num, sizeof(num), "N(-%ldL - 1)", LONG_MAX);
+      else snprintf(num, sizeof(num), "N(%ldL)", v->num);
+      lbuf_puts(out, num);
+      break;
+    case LVAL_SYM:
+      lbuf_puts(out, "Y(");
+      lcomp_string(out, v->sym, strlen(v->sym));
+      lbuf_putc(out, ')');
+      break;
+    case LVAL_STR:
+      lbuf_puts(out, "lval_str_n(");
+      lcomp_string(out, v->str, v->len);
+      snprintf(num, sizeof(num), ", %lu)", (unsigned long)v->len);
+      lbuf_puts(out, num);
+      break;
+    case LVAL_ERR:
+      lbuf_puts(out, "lval_err(\"%s\", ");
+      lcomp_string(out, v->err, strlen(v->err));
+      lbuf_putc(out, ')');
+      break;
+    default:
+      snprintf(num, sizeof(num), "%s(%i", v->type == LVAL_QEXPR ? "Q" : "S", v->count);
+      lbuf_puts(out, num);
+      for (int i = 0; i < v->count; i++) {
+        lbuf_puts(out, ", ");
+        lcomp_value(out, v->cell[i]);
+      }
+      lbuf_putc(out, ')');
+      break;
+  }
+}
+
+/**
+ * Find the function a top-level form defines, (fun {name ...} {...}) or
+ * (define (name ...) ...).
+ * @return The name, or NULL.
+ */
+static char* lcomp_defines(lval* v) {
+  if (v->type != LVAL_SEXPR || v->count < 3 || v->cell[0]->type != LVAL_SYM) return NULL;
+  char* head = v->cell[0]->sym;
+  lval* sig = v->cell[1];
+  if ((strcmp(head, "fun") == 0 && sig->type == LVAL_QEXPR) ||
+      (strcmp(head, "define") == 0 && sig->type == LVAL_SEXPR)) {
+    if (sig->count > 0 && sig->cell[0]->type == LVAL_SYM) return sig->cell[0]->sym;
+  }
+  return NULL;
+}
+
+/**
+ * Check whether a top-level form only defines globals, without calling
+ * anything to compute their values.
+ */
+static int lcomp_defines_only(lval* v) {
+  if (v->type != LVAL_SEXPR || v->count < 3 || v->cell[0]->type != LVAL_SYM) return 0;
+  char* head = v->cell[0]->sym;
+  if (strcmp(head, "def") != 0 && strcmp(head, "=") != 0 && strcmp(head, "define") != 0) return 0;
+  for (int i = 2; i < v->count; i++) {
+    if (v->cell[i]->type == LVAL_SEXPR) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Compile Lisp files into one C program.
+ * @param c The context to evaluate definitions in.
+ * @param files The files, in the order they are loaded.
+ * @param count Their number.
+ * @param path The C file to write.
+ * @return The exit status: 0, or 1 if a file could not be read or written.
+ */
+int lcomp_compile(lctx* c, char** files, int count, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "Could not open %s for writing\n", path);
+    return 1;
+  }
+
+  char buf[LBUF_SIZE];
+  lbuf out;
+  lbuf_init(&out, buf, sizeof(buf), f);
+  lbuf table;
+  lbuf_init_grow(&table, 4096);
+
+  lbuf_puts(&out, "/* Compiled by lispy from");
+  for (int i = 0; i < count; i++) {
+    lbuf_putc(&out, ' ');
+    lbuf_puts(&out, files[i]);
+  }
+  lbuf_puts(&out, " */\n#include \"lisp.h\"\n\n"
+                  "typedef long L;\ntypedef unsigned long U;\n\n"
+                  "#define N lval_num\n#define Y lval_sym\n"
+                  "#define S(...) lcomp_list(LVAL_SEXPR, __VA_ARGS__)\n"
+                  "#define Q(...) lcomp_list(LVAL_QEXPR, __VA_ARGS__)\n\n");
+
+  lctx* prev = lctx_enter(c);
+  int status = 0;
+  int forms = 0;
+  char line[512];
+  for (int i = 0; i < count && status == 0; i++) {
+    mpc_result_t r;
+    if (!mpc_parse_contents(files[i], c->lispy, &r)) {
+      mpc_err_print_to(r.error, stderr);
+      mpc_err_delete(r.error);
+      status = 1;
+      break;
+    }
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    for (int k = 0; k < expr->count; k++, forms++) {
+      lval* v = expr->cell[k];
+      char* name = lcomp_defines(v);
+      if (name || lcomp_defines_only(v)) lval_del(lval_eval(c->env, lval_copy(v)));
+
+      /* Name the translation after the function, keeping C identifiers */
+      unsigned long hash;
+      char id[96];
+      int native = 0;
+      if (name) {
+        size_t n = snprintf(id, sizeof(id), "lc_");
+        for (char* s = name; *s && n < 64; s++) {
+          id[n++] = (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') ||
+                    (*s >= '0' && *s <= '9') ? *s : '_';
+        }
+        snprintf(id + n, sizeof(id) - n, "_%i", forms);
+        native = ljit_emit_c(c->env, name, id, &out, &hash) == 0;
+        if (native) lbuf_putc(&out, '\n');
+      }
+
+      snprintf(line, sizeof(line), "static lval* lc_form_%i(void) {\n  return ", forms);
+      lbuf_puts(&out, line);
+      lcomp_value(&out, v);
+      lbuf_puts(&out, ";\n}\n\n");
+
+      if (native) {
+        snprintf(line, sizeof(line), "  { lc_form_%i, ", forms);
+        lbuf_puts(&table, line);
+        lcomp_string(&table, name, strlen(name));
+        snprintf(line, sizeof(line), ", \"%s\", %s_entry, %luUL },\n", id, id, hash);
+        lbuf_puts(&table, line);
+      } else {
+        snprintf(line, sizeof(line), "  { lc_form_%i, NULL, NULL, NULL, 0 },\n", forms);
+        lbuf_puts(&table, line);
+      }
+    }
+    lval_del(expr);
+  }
+  lctx_enter(prev);
+
+  /* C has no empty arrays */
+  if (forms == 0) {
+    lbuf_puts(&out, "static lval* lc_form_0(void) {\n  return S(0);\n}\n\n");
+    lbuf_puts(&table, "  { lc_form_0, NULL, NULL, NULL, 0 },\n");
+  }
+
+  lbuf_puts(&out, "static const lcomp_form lc_forms[] = {\n");
+  lbuf_write(&out, table.data, table.len);
+  lbuf_puts(&out, "};\n\nint main(void) {\n"
+                  "  return lcomp_run(lc_forms, sizeof(lc_forms) / sizeof(lc_forms[0]));\n}\n");
+  lbuf_flush(&out);
+  lfree(table.data);
+
+  if (fclose(f) != 0 && status == 0) {
+    fprintf(stderr, "Could not write %s\n", path);
+    status = 1;
+  }
+  if (status) remove(path);
+  return status;
+}
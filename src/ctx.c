@@ -0,0 +1,520 @@
+// File: ctx.c
+#define _POSIX_C_SOURCE 200809L
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Evaluation steps between readings of the clock for deadlines */
+#define LCTX_CLOCK_EVERY 256
+
+/* Size of the header lalloc puts before each block, keeping alignment */
+#define LALLOC_HEADER 16
+
+/* Header of a block from lalloc */
+typedef struct {
+  size_t size;    // Bytes requested
+  lctx* ctx;      // Context whose allocator and count it belongs to, or NULL
+} lalloc_header;
+
+/* Bytes set aside to give back when an allocation fails */
+#define LALLOC_RESERVE (1 << 20)
+
+/* Memory set aside for the process, NULL while it is spent */
+static void* lalloc_reserve;
+
+/* Context the calling thread is evaluating in */
+static __thread lctx* ctx_current;
+
+static int lalloc_refill(void);
+
+/* Steps the calling thread has taken, to space out clock readings */
+static __thread unsigned ctx_ticks;
+
+/**
+ * Create an interpreter context with its own parsers and root environment.
+ * @return The new context.
+ */
+lctx* lctx_new(void) {
+  return lctx_new_with(malloc, realloc, free);
+}
+
+/**
+ * Create an interpreter context whose values and environments are
+ * allocated with the given functions.
+ * @param alloc Allocates a block, like malloc.
+ * @param re Resizes a block from alloc, like realloc.
+ * @param release Frees a block from alloc, like free.
+ * @return The new context.
+ */
+lctx* lctx_new_with(void* (*alloc)(size_t), void* (*re)(void*, size_t), void (*release)(void*)) {
+  lctx* c = malloc(sizeof(lctx));
+  c->alloc = alloc;
+  c->realloc = re;
+  c->free = release;
+  c->bytes = 0;
+  c->quota = 0;
+  c->out_of_memory = 0;
+  c->alloc_failed = 0;
+  c->nesting = 0;
+  c->sched = NULL;
+  c->lexical = 0;
+  c->specials_rebound = 0;
+  c->rebinds = 0;
+  c->jit = 0;
+  c->limited = 0;
+  c->has_fuel = 0;
+  c->fuel = 0;
+  c->deadline = 0;
+  c->expired = 0;
+
+  lalloc_refill();
+
+  /* Create Parsers */
+  c->number = mpc_new("number");
+  c->symbol = mpc_new("symbol");
+  c->string = mpc_new("string");
+  c->comment = mpc_new("comment");
+  c->sexpr = mpc_new("sexpr");
+  c->qexpr = mpc_new("qexpr");
+  c->expr = mpc_new("expr");
+  c->lispy = mpc_new("lispy");
+
+  /* Define Language Grammar */
+  mpca_lang(MPCA_LANG_DEFAULT,
+            "number  : /-?[0-9]+/ ; "
+            "symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; "
+            "string  : /\"(\\\\.|[^\"])*\"/ ; "
+            "comment : /;[^\\r\\n]*/ ; "
+            "sexpr   : '(' <expr>* ')' ; "
+            "qexpr   : '{' <expr>* '}' ; "
+            "expr    : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; "
+            "lispy   : /^/ <expr>* /$/ ;",
+            c->number, c->symbol, c->string, c->comment,
+            c->sexpr, c->qexpr, c->expr, c->lispy);
+
+  /* Create Environment */
+  lctx* prev = lctx_enter(c);
+  c->env = lenv_new();
+  lenv_add_builtins(c->env);
+  lctx_enter(prev);
+  return c;
+}
+
+/**
+ * Delete a context along with its environment and parsers.
+ * Tasks still pending are run to completion first.
+ * Values created in the context must be deleted first.
+ * @param c The context.
+ */
+void lctx_del(lctx* c) {
+  lctx* prev = lctx_enter(c);
+  if (c->sched) {
+    lsched_run(c->sched);
+    lsched_del(c->sched);
+  }
+  lenv_del(c->env);
+  lctx_enter(prev == c ? NULL : prev);
+
+  mpc_cleanup(8, c->number, c->symbol, c->string, c->comment,
+              c->sexpr, c->qexpr, c->expr, c->lispy);
+  free(c);
+}
+
+/**
+ * Get the context the calling thread is evaluating in.
+ * @return The context, or NULL outside of any context.
+ */
+lctx* lctx_current(void) {
+  return ctx_current;
+}
+
+/**
+ * Make a context current for the calling thread.
+ * @param c The context, or NULL.
+ * @return The previously current context, to be restored afterwards.
+ */
+lctx* lctx_enter(lctx* c) {
+  lctx* prev = ctx_current;
+  ctx_current = c;
+  return prev;
+}
+
+/**
+ * Start a top-level evaluation in a context, making it current. The
+ * outermost one clears a failed allocation (see lalloc), since the
+ * evaluation that hit it has unwound.
+ * @param c The context.
+ * @return The previously current context, to be passed to lctx_end.
+ */
+lctx* lctx_begin(lctx* c) {
+  if (c->nesting++ == 0 && c->alloc_failed && lalloc_refill()) {
+    c->alloc_failed = 0;
+    lctx_relimit(c);
+  }
+  return lctx_enter(c);
+}
+
+/**
+ * Finish a top-level evaluation started with lctx_begin.
+ * @param c The context.
+ * @param prev The context current before.
+ */
+void lctx_end(lctx* c, lctx* prev) {
+  c->nesting--;
+  lctx_enter(prev);
+}
+
+/**
+ * Set memory aside again if it has been spent.
+ * @return 1 if memory is set aside, 0 if the system refused it.
+ */
+static int lalloc_refill(void) {
+  if (__atomic_load_n(&lalloc_reserve, __ATOMIC_ACQUIRE)) return 1;
+  void* reserve = malloc(LALLOC_RESERVE);
+  if (!reserve) return 0;
+  void* expected = NULL;
+  if (!__atomic_compare_exchange_n(&lalloc_reserve, &expected, reserve, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(reserve);
+  }
+  return 1;
+}
+
+/**
+ * Mark a context as having had an allocation refused, so that every
+ * further evaluation step fails until the next top-level evaluation.
+ */
+static void lalloc_mark(lctx* c) {
+  __atomic_store_n(&c->alloc_failed, 1, __ATOMIC_RELAXED);
+  c->limited = 1;
+}
+
+/**
+ * Handle an allocation the system could not satisfy. The memory set aside
+ * is given back so the allocation can be retried, and the current context
+ * is marked so that every further evaluation step fails: the evaluation in
+ * progress unwinds with an error, freeing what it built, and the next
+ * top-level evaluation (lctx_begin) starts afresh. The process only stops
+ * when the reserve is already spent or the retry fails as well.
+ * @param c The context the block belongs to, or NULL.
+ * @param old Block being resized, or NULL to allocate a new one.
+ * @param size Number of bytes, header included.
+ * @return The block.
+ */
+static lalloc_header* lalloc_retry(lctx* c, lalloc_header* old, size_t size) {
+  void* reserve = __atomic_exchange_n(&lalloc_reserve, NULL, __ATOMIC_ACQ_REL);
+  lalloc_header* h = NULL;
+  if (reserve) {
+    free(reserve);
+    if (c) h = old ? c->realloc(old, size) : c->alloc(size);
+    else h = old ? realloc(old, size) : malloc(size);
+  }
+  if (!h) {
+    fprintf(stderr, "Out of memory allocating %zu bytes.\n", size - LALLOC_HEADER);
+    abort();
+  }
+  if (ctx_current) lalloc_mark(ctx_current);
+  return h;
+}
+
+/**
+ * Allocate memory for the current context, counting it against its quota.
+ * Every block starts with a header holding its size and the context, so
+ * lfree gives it back to the allocator it came from and to the count it
+ * was added to, whichever context is current then.
+ * @param size Number of bytes.
+ * @return The memory.
+ */
+void* lalloc(size_t size) {
+  lctx* c = ctx_current;
+  lalloc_header* h = c ? c->alloc(size + LALLOC_HEADER) : malloc(size + LALLOC_HEADER);
+  if (!h) h = lalloc_retry(c, NULL, size + LALLOC_HEADER);
+  h->size = size;
+  h->ctx = c;
+  if (c) __atomic_add_fetch(&c->bytes, size, __ATOMIC_RELAXED);
+  return (char*)h + LALLOC_HEADER;
+}
+
+/**
+ * Resize memory from lalloc, within the context it was allocated in.
+ * @param ptr The memory, or NULL.
+ * @param size New number of bytes.
+ * @return The memory, possibly moved.
+ */
+void* lrealloc(void* ptr, size_t size) {
+  if (!ptr) return lalloc(size);
+  lalloc_header* h = (lalloc_header*)((char*)ptr - LALLOC_HEADER);
+  lctx* c = h->ctx;
+  size_t old = h->size;
+  lalloc_header* n = c ? c->realloc(h, size + LALLOC_HEADER) : realloc(h, size + LALLOC_HEADER);
+  h = n ? n : lalloc_retry(c, h, size + LALLOC_HEADER);
+  h->size = size;
+  if (c) __atomic_add_fetch(&c->bytes, (long)size - (long)old, __ATOMIC_RELAXED);
+  return (char*)h + LALLOC_HEADER;
+}
+
+/**
+ * Resize memory from lalloc, or allocate it if ptr is NULL, failing
+ * softly: for buffers that grow with the data, where a single request may
+ * be too large to ever satisfy.
+ * @param ptr The block, or NULL.
+ * @param size New size in bytes.
+ * @return The block, or NULL if the system refused, leaving ptr as it
+ *         was and the current context failing its evaluation.
+ */
+void* lrealloc_try(void* ptr, size_t size) {
+  lalloc_header* h = ptr ? (lalloc_header*)((char*)ptr - LALLOC_HEADER) : NULL;
+  lctx* c = h ? h->ctx : ctx_current;
+  size_t old = h ? h->size : 0;
+  lalloc_header* n = c ? c->realloc(h, size + LALLOC_HEADER) : realloc(h, size + LALLOC_HEADER);
+  if (!n) {
+    if (ctx_current) lalloc_mark(ctx_current);
+    return NULL;
+  }
+  n->size = size;
+  n->ctx = c;
+  if (c) __atomic_add_fetch(&c->bytes, (long)size - (long)old, __ATOMIC_RELAXED);
+  return (char*)n + LALLOC_HEADER;
+}
+
+/**
+ * Free memory from lalloc, in the context it was allocated in.
+ * @param ptr The memory, or NULL.
+ */
+void lfree(void* ptr) {
+  if (!ptr) return;
+  lalloc_header* h = (lalloc_header*)((char*)ptr - LALLOC_HEADER);
+  lctx* c = h->ctx;
+  if (c) {
+    __atomic_sub_fetch(&c->bytes, h->size, __ATOMIC_RELAXED);
+    c->free(h);
+  } else {
+    free(h);
+  }
+}
+
+/**
+ * Copy a NUL-terminated string into memory from lalloc.
+ * @param s The string.
+ * @return The copy.
+ */
+char* lstrdup(const char* s) {
+  size_t n = strlen(s) + 1;
+  return memcpy(lalloc(n), s, n);
+}
+
+/**
+ * Parse and evaluate a string in a context.
+ * The whole input is evaluated as one S-expression, as typed at the REPL.
+ * @param c The context.
+ * @param name Name of the input used in parse errors.
+ * @param input The source text.
+ * @return The result, or an error.
+ */
+lval* lctx_eval_string(lctx* c, char* name, char* input) {
+  lctx* prev = lctx_begin(c);
+  lval* x;
+
+  mpc_result_t r;
+  if (mpc_parse(name, input, c->lispy, &r)) {
+    x = lval_eval(c->env, lval_read(r.output));
+    mpc_ast_delete(r.output);
+  } else {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    x = lval_err("%s", err_msg);
+    free(err_msg);
+  }
+
+  lctx_end(c, prev);
+  return x;
+}
+
+/**
+ * Load and evaluate a file in a context.
+ * @param c The context.
+ * @param path The file path.
+ * @return An empty S-expression, or an error if the file could not be parsed.
+ */
+lval* lctx_load(lctx* c, char* path) {
+  lctx* prev = lctx_begin(c);
+  lval* x = builtin_load(c->env, lval_add(lval_sexpr(), lval_str(path)));
+  lctx_end(c, prev);
+  return x;
+}
+
+/**
+ * Read the monotonic clock.
+ * @return The time in seconds.
+ */
+static double lctx_clock(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Work out whether evaluation steps in a context need checking.
+ * @param c The context.
+ */
+void lctx_relimit(lctx* c) {
+  c->limited = c->has_fuel || c->deadline || c->quota || c->alloc_failed;
+}
+
+/**
+ * Limit the evaluation done in a context from now on.
+ * Once a limit is reached every further step fails, so the evaluation in
+ * progress unwinds with an error, until the limits are set again.
+ * @param c The context.
+ * @param steps Evaluation steps allowed, or 0 for no limit.
+ * @param ms Milliseconds allowed, or 0 for no limit.
+ */
+void lctx_limit(lctx* c, long steps, long ms) {
+  c->has_fuel = steps > 0;
+  c->fuel = steps;
+  c->deadline = ms > 0 ? lctx_clock() + ms / 1000.0 : 0;
+  c->expired = 0;
+  lctx_relimit(c);
+}
+
+/**
+ * Limit the memory the values and environments of a context may use.
+ * The quota is checked on every evaluation step; once it is exceeded every
+ * further step fails, so the evaluation in progress unwinds with an error
+ * and frees what it built, until the quota is set again.
+ * @param c The context.
+ * @param bytes Bytes allowed in use, or 0 for no limit.
+ */
+void lctx_quota(lctx* c, long bytes) {
+  c->quota = bytes > 0 ? bytes : 0;
+  c->out_of_memory = 0;
+  lctx_relimit(c);
+}
+
+/**
+ * Take one evaluation step in the current context.
+ * Called by lval_eval and lval_call; costs a branch when no limit is set.
+ * @return NULL to go on, or an error once a limit has been reached.
+ */
+lval* lctx_check(void) {
+  lctx* c = ctx_current;
+  if (!c || !c->limited) return NULL;
+
+  if (__atomic_load_n(&c->alloc_failed, __ATOMIC_RELAXED)) {
+    return lval_err("Evaluation ran out of memory.");
+  }
+
+  /* Pool workers share the context, so the fuel is taken atomically */
+  if (c->has_fuel && __atomic_sub_fetch(&c->fuel, 1, __ATOMIC_RELAXED) < 0) {
+    return lval_err("Evaluation ran out of fuel.");
+  }
+  if (c->quota) {
+    if (!c->out_of_memory && __atomic_load_n(&c->bytes, __ATOMIC_RELAXED) > c->quota) {
+      c->out_of_memory = 1;
+    }
+    if (c->out_of_memory) {
+      return lval_err("Evaluation exceeded its memory quota.");
+    }
+  }
+  if (c->deadline) {
+    if (!__atomic_load_n(&c->expired, __ATOMIC_RELAXED)
+        && ++ctx_ticks % LCTX_CLOCK_EVERY == 0 && lctx_clock() >= c->deadline) {
+      __atomic_store_n(&c->expired, 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&c->expired, __ATOMIC_RELAXED)) {
+      return lval_err("Evaluation exceeded its deadline.");
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Builtin: Evaluate a Q-expression with at most a number of steps and
+ * milliseconds (0 for no limit). Limits in force outside still apply, and
+ * the steps taken count against them. Must not be used inside a parallel
+ * function, since the limits belong to the whole context.
+ */
+lval* builtin_limit(lenv* e, lval* a) {
+  LASSERT_NUM("limit", a, 3);
+  LASSERT_TYPE("limit", a, 0, LVAL_NUM);
+  LASSERT_TYPE("limit", a, 1, LVAL_NUM);
+  LASSERT_TYPE("limit", a, 2, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->num >= 0 && a->cell[1]->num >= 0,
+    "Function 'limit' passed a negative limit.");
+
+  lctx* c = lctx_current();
+  long steps = a->cell[0]->num;
+  long ms = a->cell[1]->num;
+
+  /* Tighten the limits in force */
+  int has_fuel = c->has_fuel;
+  long fuel = c->fuel;
+  double deadline = c->deadline;
+  if (steps > 0 && (!c->has_fuel || steps < c->fuel)) {
+    c->has_fuel = 1;
+    c->fuel = steps;
+  }
+  if (ms > 0) {
+    double d = lctx_clock() + ms / 1000.0;
+    if (!c->deadline || d < c->deadline) c->deadline = d;
+  }
+  lctx_relimit(c);
+  long start = c->fuel;
+
+  lval* x = builtin_eval(e, lval_add(lval_sexpr(), lval_pop(a, 2)));
+  lval_del(a);
+
+  /* Restore the outer limits, charging them for the steps taken */
+  if (has_fuel) {
+    c->fuel = fuel - (start - (c->fuel > 0 ? c->fuel : 0));
+  }
+  c->has_fuel = has_fuel;
+  c->deadline = deadline;
+  c->expired = deadline && lctx_clock() >= deadline;
+  lctx_relimit(c);
+  return x;
+}
+
+/**
+ * Builtin: Evaluate a Q-expression allowing at most a number of bytes more
+ * to be in use than before. Quotas in force outside still apply.
+ */
+lval* builtin_quota(lenv* e, lval* a) {
+  LASSERT_NUM("quota", a, 2);
+  LASSERT_TYPE("quota", a, 0, LVAL_NUM);
+  LASSERT_TYPE("quota", a, 1, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->num > 0, "Function 'quota' passed a non-positive quota.");
+
+  lctx* c = lctx_current();
+  long quota = c->quota;
+  long bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED) + a->cell[0]->num;
+  if (!c->quota || bytes < c->quota) c->quota = bytes;
+  c->limited = 1;
+
+  lval* x = builtin_eval(e, lval_add(lval_sexpr(), lval_pop(a, 1)));
+  lval_del(a);
+
+  /* Restore the outer quota, which fails only if it is exceeded itself */
+  c->quota = quota;
+  c->out_of_memory = quota && __atomic_load_n(&c->bytes, __ATOMIC_RELAXED) > quota;
+  lctx_relimit(c);
+  return x;
+}
+
+/**
+ * Builtin: Choose the scoping of lambdas created from now on: 1 makes them
+ * close over the scope they are created in, 0 resolves their free symbols
+ * in the caller's scope as before. Returns the previous setting.
+ */
+lval* builtin_lexical(lenv* e, lval* a) {
+  LASSERT_NUM("lexical", a, 1);
+  LASSERT_TYPE("lexical", a, 0, LVAL_NUM);
+
+  lctx* c = lctx_current();
+  lval* x = lval_num(c->lexical);
+  c->lexical = a->cell[0]->num != 0;
+  lval_del(a);
+  return x;
+}
@@ -3,14 +3,56 @@
 #include <stdlib.h>
 
 /**
- * Call a function (builtin or lambda) with arguments.
+ * Call the fast path of a builtin on the Number arguments held in an
+ * S-expression, reusing the first argument's lval for the result. Two
+ * arguments always qualify; more only if the builtin folds them.
+ * @param f The builtin.
+ * @param a The S-expression holding the arguments.
+ * @param i Index of the first argument in a; the rest follow it.
+ * @return The result, or NULL (with a untouched) if the fast path declined.
+ */
+static lval* lval_call_fast(lval* f, lval* a, int i) {
+  int n = a->count - i;
+  if (n < 2 || (n > 2 && !f->fold)) return NULL;
+  for (int k = i; k < a->count; k++) {
+    if (a->cell[k]->type != LVAL_NUM) return NULL;
+  }
+  long r = a->cell[i]->num;
+  for (int k = i + 1; k < a->count; k++) {
+    if (!f->fast(r, a->cell[k]->num, &r)) return NULL;
+  }
+  LSTAT_ADD(fast_hits, 1);
+  lval* x = lval_take(a, i);
+  x->num = r;
+  return x;
+}
+
+/**
+ * Apply a function (builtin or lambda) to arguments.
  * @param e The environment.
  * @param f The function lval.
  * @param a The arguments S-expr.
  * @return The result of the call.
  */
-lval* lval_call(lenv* e, lval* f, lval* a) {
-  if (f->builtin) return f->builtin(e, a);
+static lval* lval_apply(lenv* e, lval* f, lval* a) {
+  LSTAT_ADD(calls, 1);
+  lval* err = lctx_check();
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+  if (f->builtin) {
+    if (f->fast) {
+      lval* x = lval_call_fast(f, a, 0);
+      if (x) return x;
+      LSTAT_ADD(fast_misses, 1);
+    }
+    return f->builtin(e, a);
+  }
+  if (f->jit) {
+    lval* x = ljit_call(e, f, a);
+    if (x) return x;
+  }
 
   int given = a->count;
   int total = f->formals->count;
@@ -56,13 +98,63 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   }
 
   if (f->formals->count == 0) {
-    f->env->par = e;
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    /* f is always the caller's private copy, so linking its environment
+       to the caller's (or, for a closure, to its defining scope) is not
+       visible to any other thread */
+    if (f->lexical) lenv_link(f->env, f->closure ? f->closure : lenv_root(e));
+    else f->env->par = e;
+    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(lopt_body(e, f))));
   } else {
     return lval_copy(f);
   }
 }
 
+/**
+ * Call a function, recording the call on the profiler's shadow stack
+ * while the profiler runs.
+ * @param e The environment.
+ * @param f The function lval.
+ * @param a The arguments S-expr.
+ * @param name Interned name of the call site, or NULL for [lambda].
+ * @return The result of the call.
+ */
+static lval* lval_call_named(lenv* e, lval* f, lval* a, const char* name) {
+  if (!lprof_on) return lval_apply(e, f, a);
+  lprof_push(name);
+  lval* x = lval_apply(e, f, a);
+  lprof_pop();
+  return x;
+}
+
+/**
+ * Call a function (builtin or lambda) with arguments. Calls made from C,
+ * such as those of map or pmap, show as [lambda] in profiles.
+ * @param e The environment.
+ * @param f The function lval.
+ * @param a The arguments S-expr.
+ * @return The result of the call.
+ */
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  return lval_call_named(e, f, a, NULL);
+}
+
+/**
+ * Get the profiler name of a call site: its head symbol, interned the
+ * first time the site is profiled and kept in the symbol's cache.
+ * @param head The head of the S-expression, before evaluation.
+ * @return The interned name, or NULL if the head is not a symbol.
+ */
+static const char* lval_site_name(lval* head) {
+  if (head->type != LVAL_SYM) return NULL;
+  if (!head->cache) return lprof_intern(head->sym);
+  const char* name = __atomic_load_n(&head->cache->name, __ATOMIC_ACQUIRE);
+  if (!name) {
+    name = lprof_intern(head->sym);
+    __atomic_store_n(&head->cache->name, name, __ATOMIC_RELEASE);
+  }
+  return name;
+}
+
 /**
  * Evaluate an S-expression.
  * @param e The environment.
@@ -70,6 +162,15 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
  * @return The evaluation result.
  */
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  /* Special forms decide themselves what to evaluate */
+  if (v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+    lspecial form = lspecial_get(e, v->cell[0]->sym);
+    if (form) return form(e, v);
+  }
+
+  /* Name the call after its head symbol for the profiler */
+  const char* name = lprof_on && v->count > 1 ? lval_site_name(v->cell[0]) : NULL;
+
   for (int i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
   }
@@ -80,7 +181,19 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   if (v->count == 0) return v;
   if (v->count == 1) return lval_eval(e, lval_take(v, 0));
 
-  lval* f = lval_pop(v, 0);
+  /* Fast-call builtins take their arguments straight from the slots;
+     when they decline, lval_call tries again and counts the miss. While
+     profiling, every call goes through lval_call_named to be recorded. */
+  lval* f = v->cell[0];
+  if (f->type == LVAL_FUN && f->builtin && f->fast && !lprof_on) {
+    lval* x = lval_call_fast(f, v, 1);
+    if (x) {
+      LSTAT_ADD(calls, 1);
+      return x;
+    }
+  }
+
+  f = lval_pop(v, 0);
   if (f->type != LVAL_FUN) {
     lval* err = lval_err("S-Expression starts with incorrect type. Got %s, Expected %s.",
                           ltype_name(f->type), ltype_name(LVAL_FUN));
@@ -89,7 +202,7 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
     return err;
   }
 
-  lval* result = lval_call(e, f, v);
+  lval* result = lval_call_named(e, f, v, name);
   lval_del(f);
   return result;
 }
@@ -101,6 +214,11 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
  * @return The evaluation result.
  */
 lval* lval_eval(lenv* e, lval* v) {
+  lval* err = lctx_check();
+  if (err) {
+    lval_del(v);
+    return err;
+  }
   if (v->type == LVAL_SYM) {
     lval* x = lenv_get(e, v);
     lval_del(v);
@@ -0,0 +1,264 @@
+// File: file.c
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of the blocks read from and written to files */
+#define LFILE_BLOCK (1 << 20)
+
+/**
+ * Open a file.
+ * @param path The path.
+ * @param mode "r", "w" or "a".
+ * @return The handle, or NULL if the file could not be opened.
+ */
+lfile* lfile_open(char* path, char* mode) {
+  FILE* fp = fopen(path, mode);
+  if (!fp) return NULL;
+
+  lfile* f = lalloc(sizeof(lfile));
+  f->refs = 1;
+  f->fp = fp;
+  f->path = lstrdup(path);
+  f->writing = mode[0] != 'r';
+  f->buf = NULL;
+  f->cap = 0;
+  f->pos = 0;
+  f->end = 0;
+  f->eof = 0;
+
+  /* Reads go straight into our own block buffer */
+  if (!f->writing) setvbuf(fp, NULL, _IONBF, 0);
+  return f;
+}
+
+/**
+ * Flush and close a file. The handle stays valid until released.
+ * @param f The handle.
+ */
+void lfile_close(lfile* f) {
+  if (!f->fp) return;
+  if (f->writing) lbuf_flush(&f->out);
+  fclose(f->fp);
+  f->fp = NULL;
+  lfree(f->buf);
+  f->buf = NULL;
+}
+
+/**
+ * Drop a reference to a file, closing it when unused.
+ * @param f The handle.
+ */
+void lfile_release(lfile* f) {
+  if (LREF_DEC(f) > 0) return;
+  lfile_close(f);
+  lfree(f->path);
+  lfree(f);
+}
+
+/**
+ * Read the next block of a file into the read buffer.
+ * Unread bytes are moved to the front first; the buffer doubles when a
+ * single line does not fit.
+ * @param f The handle.
+ * @return Number of bytes read, 0 at end of file.
+ */
+static size_t lfile_fill(lfile* f) {
+  if (f->pos > 0) {
+    memmove(f->buf, f->buf + f->pos, f->end - f->pos);
+    f->end -= f->pos;
+    f->pos = 0;
+  }
+  if (f->end == f->cap) {
+    size_t cap = f->cap ? f->cap * 2 : LFILE_BLOCK;
+    char* buf = lrealloc_try(f->buf, cap);
+    if (!buf) {
+      /* The evaluation fails; stop reading as if at the end */
+      f->eof = 1;
+      return 0;
+    }
+    f->buf = buf;
+    f->cap = cap;
+  }
+
+  size_t n = fread(f->buf + f->end, 1, f->cap - f->end, f->fp);
+  if (n == 0) f->eof = 1;
+  f->end += n;
+  return n;
+}
+
+/**
+ * Read the next line of a file.
+ * @param f The handle (open for reading).
+ * @return The line without its newline, or NULL at end of file.
+ */
+lval* lfile_read_line(lfile* f) {
+  /* Bytes after pos already searched for a newline */
+  size_t scanned = 0;
+  for (;;) {
+    size_t avail = f->end - f->pos;
+    char* nl = avail > scanned
+      ? memchr(f->buf + f->pos + scanned, '\n', avail - scanned)
+      : NULL;
+    if (nl) {
+      lval* line = lval_str_n(f->buf + f->pos, nl - (f->buf + f->pos));
+      f->pos = nl - f->buf + 1;
+      return line;
+    }
+    if (f->eof) break;
+
+    scanned = avail;
+    lfile_fill(f);
+  }
+
+  if (f->pos == f->end) return NULL;
+  lval* line = lval_str_n(f->buf + f->pos, f->end - f->pos);
+  f->pos = f->end;
+  return line;
+}
+
+/**
+ * Check that argument 0 is an open file in the expected direction.
+ */
+#define LASSERT_FILE(func, args, reading) \
+  LASSERT_TYPE(func, args, 0, LVAL_FILE); \
+  LASSERT(args, args->cell[0]->file->fp, \
+    "Function '%s' passed closed file \"%s\".", func, args->cell[0]->file->path); \
+  LASSERT(args, args->cell[0]->file->writing != reading, \
+    "Function '%s' passed file \"%s\" not open for %s.", func, \
+    args->cell[0]->file->path, reading ? "reading" : "writing")
+
+/**
+ * Builtin: Open a file for reading ("r", default), writing ("w") or appending ("a").
+ */
+lval* builtin_open(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function 'open' passed incorrect number of arguments. Got %i, Expected 1 or 2.",
+          a->count);
+  LASSERT_TYPE("open", a, 0, LVAL_STR);
+  if (a->count == 2) LASSERT_TYPE("open", a, 1, LVAL_STR);
+
+  char* mode = a->count == 2 ? a->cell[1]->str : "r";
+  LASSERT(a, strcmp(mode, "r") == 0 || strcmp(mode, "w") == 0 || strcmp(mode, "a") == 0,
+          "Function 'open' passed invalid mode \"%s\". Expected \"r\", \"w\" or \"a\".", mode);
+
+  lfile* f = lfile_open(a->cell[0]->str, mode);
+  LASSERT(a, f, "Could not open file \"%s\".", a->cell[0]->str);
+  if (f->writing) {
+    f->buf = lalloc(LFILE_BLOCK);
+    f->cap = LFILE_BLOCK;
+    lbuf_init(&f->out, f->buf, f->cap, f->fp);
+  }
+
+  lval_del(a);
+  return lval_file(f);
+}
+
+/**
+ * Builtin: Read the next line of a file, or {} at end of file.
+ */
+lval* builtin_read_line(lenv* e, lval* a) {
+  LASSERT_NUM("read-line", a, 1);
+  LASSERT_FILE("read-line", a, 1);
+
+  lval* line = lfile_read_line(a->cell[0]->file);
+  lval_del(a);
+  return line ? line : lval_qexpr();
+}
+
+/**
+ * Builtin: Read the rest of a file into a single string.
+ */
+lval* builtin_read_all(lenv* e, lval* a) {
+  LASSERT_NUM("read-all", a, 1);
+  LASSERT_FILE("read-all", a, 1);
+
+  lfile* f = a->cell[0]->file;
+  while (!f->eof) lfile_fill(f);
+  LASSERT(a, !lctx_current()->alloc_failed,
+          "Function 'read-all' ran out of memory reading file \"%s\".", f->path);
+
+  lval* x = lval_str_n(f->buf + f->pos, f->end - f->pos);
+  f->pos = f->end;
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Write values to a file.
+ * Strings are written as raw text, anything else as print shows it.
+ */
+lval* builtin_write(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "Function 'write' passed no arguments.");
+  LASSERT_FILE("write", a, 0);
+
+  lbuf* out = &a->cell[0]->file->out;
+  for (int i = 1; i < a->count; i++) {
+    lval_write_text(out, a->cell[i]);
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/**
+ * Builtin: Close a file.
+ */
+lval* builtin_close(lenv* e, lval* a) {
+  LASSERT_NUM("close", a, 1);
+  LASSERT_TYPE("close", a, 0, LVAL_FILE);
+
+  lfile_close(a->cell[0]->file);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/**
+ * Builtin: Call a function on every line of a file.
+ * Lines are streamed through the read buffer one at a time, so memory use
+ * does not depend on the size of the file. Stops at the first error, or
+ * with an error if the function closes the file.
+ */
+lval* builtin_for_each_line(lenv* e, lval* a) {
+  LASSERT_NUM("for-each-line", a, 2);
+  LASSERT(a, a->cell[0]->type == LVAL_STR || a->cell[0]->type == LVAL_FILE,
+          "Function 'for-each-line' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_FILE));
+  LASSERT_TYPE("for-each-line", a, 1, LVAL_FUN);
+
+  lfile* f;
+  if (a->cell[0]->type == LVAL_STR) {
+    f = lfile_open(a->cell[0]->str, "r");
+    LASSERT(a, f, "Could not open file \"%s\".", a->cell[0]->str);
+  } else {
+    LASSERT_FILE("for-each-line", a, 1);
+    f = a->cell[0]->file;
+    LREF_INC(f);
+  }
+
+  lval* fn = a->cell[1];
+  lval* result = lval_sexpr();
+  lval* line;
+  while ((line = lfile_read_line(f))) {
+    lval* g = lval_copy(fn);
+    lval* x = lval_call(e, g, lval_add(lval_sexpr(), line));
+    lval_del(g);
+    if (x->type == LVAL_ERR) {
+      lval_del(result);
+      result = x;
+      break;
+    }
+    lval_del(x);
+
+    /* The function may have closed the file, freeing the read buffer */
+    if (!f->fp) {
+      lval_del(result);
+      result = lval_err("Function 'for-each-line' had file \"%s\" closed while reading it.", f->path);
+      break;
+    }
+  }
+
+  lfile_release(f);
+  lval_del(a);
+  return result;
+}
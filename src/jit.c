@@ -0,0 +1,690 @@
+// File: jit.c
+#define _GNU_SOURCE
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
+
+/*
+ * Tiered compilation of hot functions (--jit). A function defined at top
+ * level with fun or define counts its calls; on the LJIT_THRESHOLD-th it
+ * is translated to C, compiled with the system compiler ($LISPY_CC, or
+ * cc) into a shared object and loaded with dlopen. Later calls whose
+ * arguments are all Numbers run the compiled code; any other call, and
+ * any call while evaluation limits are set, is interpreted as before.
+ *
+ * Only bodies built from Number literals, the formals, Numbers bound to
+ * globals, + - * / and the comparisons, if, select, cond, do and calls of
+ * the function itself are compiled; anything else marks the function as
+ * not compilable. Globals other than builtins and the function itself
+ * are only relied on by lexical functions. Such code has no effects, so
+ * where the compiled code cannot produce the interpreter's result (a cond
+ * with no true clause) it gives up and the call is simply interpreted
+ * from the start.
+ *
+ * The compiled code assumes the globals it uses keep the values they had
+ * when it was compiled. Each call checks them first and falls back to the
+ * interpreter once one has been redefined. Under dynamic scope the body
+ * sees the caller's bindings, so a call also falls back when one of the
+ * caller's scopes binds a name the code relies on, such as + or the
+ * function's own name.
+ */
+
+/* Calls before a function is compiled */
+#define LJIT_THRESHOLD 100
+
+/* Most words $LISPY_CC may have */
+#define LJIT_CC_WORDS 32
+
+/* Compilation states */
+enum { LJIT_COUNTING, LJIT_COMPILING, LJIT_COMPILED, LJIT_FAILED };
+
+/* Type of a guard on a name standing for a special form */
+#define LJIT_SPECIAL -1
+
+/* Results of compiled code besides success (0) */
+enum { LJIT_DIV_ZERO = 1, LJIT_NO_SELECTION, LJIT_DEOPT };
+
+/**
+ * Create compilation state for a function, counting its calls.
+ * @param name The global the function is defined as.
+ * @return The state, held once.
+ */
+static ljit* ljit_new(char* name) {
+  ljit* j = calloc(1, sizeof(ljit));
+  j->refs = 1;
+  j->state = LJIT_COUNTING;
+  j->name = strdup(name);
+  return j;
+}
+
+/**
+ * Drop the globals compiled code was assumed to rely on.
+ */
+static void ljit_forget(ljit* j) {
+  for (int i = 0; i < j->nguards; i++) free(j->guards[i].sym);
+  free(j->guards);
+  j->guards = NULL;
+  j->nguards = 0;
+}
+
+/**
+ * Attach compilation state to a function being defined as a global, when
+ * the current context compiles hot functions.
+ * @param f The lambda.
+ * @param e The environment it is defined in.
+ * @param name The global it is defined as.
+ */
+void ljit_attach(lval* f, lenv* e, char* name) {
+  lctx* c = lctx_current();
+  if (!c || !c->jit || e->par || f->builtin) return;
+  f->jit = ljit_new(name);
+}
+
+/**
+ * Release a hold on compilation state, unloading its code when none is left.
+ * @param j The state.
+ */
+void ljit_release(ljit* j) {
+  if (LREF_DEC(j) != 0) return;
+  if (j->lib) dlclose(j->lib);
+  ljit_forget(j);
+  free(j->name);
+  free(j);
+}
+
+/* Translation of one function to C */
+typedef struct {
+  ljit* j;
+  const char* id;       // Name of the C function
+  lval* formals;
+  lenv* root;
+  int lexical;          // Free symbols resolve in the root environment
+  lbuf out;             // Statements of the function body
+  int temps;            // Temporaries used
+  int depth;            // Indentation
+} ljit_gen;
+
+/**
+ * Append a formatted, indented line of C.
+ */
+static void ljit_emit(ljit_gen* g, const char* fmt, ...) {
+  char line[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  for (int i = 0; i < g->depth + 1; i++) lbuf_puts(&g->out, "  ");
+  lbuf_puts(&g->out, line);
+  lbuf_putc(&g->out, '\n');
+}
+
+/**
+ * Find a formal by name.
+ * @return Its index, or -1.
+ */
+static int ljit_formal(ljit_gen* g, char* sym) {
+  for (int i = 0; i < g->formals->count; i++) {
+    if (strcmp(g->formals->cell[i]->sym, sym) == 0) return i;
+  }
+  return -1;
+}
+
+/**
+ * Record that the compiled code relies on a global keeping its value.
+ * @param g The translation.
+ * @param sym The global.
+ * @param v Its value now.
+ */
+static void ljit_assume(ljit_gen* g, char* sym, lval* v) {
+  ljit* j = g->j;
+  for (int i = 0; i < j->nguards; i++) {
+    if (strcmp(j->guards[i].sym, sym) == 0) return;
+  }
+  j->guards = realloc(j->guards, sizeof(ljit_guard) * (j->nguards + 1));
+  ljit_guard* gd = &j->guards[j->nguards++];
+  gd->sym = strdup(sym);
+  gd->type = v->type;
+  gd->num = v->type == LVAL_NUM ? v->num : 0;
+  gd->builtin = v->type == LVAL_FUN ? v->builtin : NULL;
+}
+
+/**
+ * Record that the compiled code relies on a name standing for the
+ * special form it was translated as.
+ */
+static void ljit_assume_special(ljit_gen* g, char* sym) {
+  ljit* j = g->j;
+  for (int i = 0; i < j->nguards; i++) {
+    if (strcmp(j->guards[i].sym, sym) == 0) return;
+  }
+  j->guards = realloc(j->guards, sizeof(ljit_guard) * (j->nguards + 1));
+  ljit_guard* gd = &j->guards[j->nguards++];
+  gd->sym = strdup(sym);
+  gd->type = LJIT_SPECIAL;
+  gd->num = 0;
+  gd->builtin = NULL;
+}
+
+/**
+ * Find the value of a global in a root environment.
+ * @return The value (not a copy), or NULL.
+ */
+static lval* ljit_lookup(lenv* root, char* sym) {
+  for (int i = 0; i < root->count; i++) {
+    if (strcmp(root->syms[i], sym) == 0) return root->vals[i];
+  }
+  return NULL;
+}
+
+/* Builtins that are compiled, with the C operator they become */
+static const struct {
+  lbuiltin builtin;
+  char* op;
+  int arith;            // Takes any number of arguments
+} ljit_ops[] = {
+  { builtin_add, "+", 1 }, { builtin_sub, "-", 1 },
+  { builtin_mul, "*", 1 }, { builtin_div, "/", 1 },
+  { builtin_eq, "==", 0 }, { builtin_ne, "!=", 0 },
+  { builtin_lt, "<", 0 }, { builtin_gt, ">", 0 },
+  { builtin_le, "<=", 0 }, { builtin_ge, ">=", 0 },
+};
+
+static int ljit_expr(ljit_gen* g, lval* v);
+
+/**
+ * Translate code given as a Q-expression, a branch or clause body.
+ */
+static int ljit_code(ljit_gen* g, lval* v) {
+  if (v->type != LVAL_QEXPR) return ljit_expr(g, v);
+  v->type = LVAL_SEXPR;
+  int t = ljit_expr(g, v);
+  v->type = LVAL_QEXPR;
+  return t;
+}
+
+/**
+ * Translate a call of an arithmetic builtin.
+ */
+static int ljit_arith(ljit_gen* g, lval* v, char op) {
+  if (v->count < 2) return -1;
+  int x = ljit_expr(g, v->cell[1]);
+  if (x < 0) return -1;
+  int r = g->temps++;
+  if (v->count == 2) {
+    ljit_emit(g, "t%i = %st%i;", r, op == '-' ? "(L)-(U)" : "", x);
+    return r;
+  }
+  ljit_emit(g, "t%i = t%i;", r, x);
+  for (int i = 2; i < v->count; i++) {
+    int y = ljit_expr(g, v->cell[i]);
+    if (y < 0) return -1;
+    if (op == '/') {
+      ljit_emit(g, "if (t%i == 0) return %i;", y, LJIT_DIV_ZERO);
+      ljit_emit(g, "t%i = t%i == -1 ? (L)-(U)t%i : t%i / t%i;", r, y, r, r, y);
+    } else {
+      ljit_emit(g, "t%i = (L)((U)t%i %c (U)t%i);", r, r, op, y);
+    }
+  }
+  return r;
+}
+
+/**
+ * Translate a conditional: the first clause whose test is true gives the
+ * result. Clauses are {test expr} (select) or (test expr...) (cond).
+ */
+static int ljit_clauses(ljit_gen* g, lval* v, int select) {
+  int r = g->temps++;
+  int opened = 0;
+  for (int i = 1; i < v->count; i++) {
+    lval* c = v->cell[i];
+    if ((c->type != LVAL_SEXPR && c->type != LVAL_QEXPR) || c->count == 0) return -1;
+    if (select && c->count != 2) return -1;
+    int t = ljit_expr(g, c->cell[0]);
+    if (t < 0) return -1;
+    ljit_emit(g, "if (t%i) {", t);
+    g->depth++;
+    int x = t;
+    for (int k = 1; k < c->count; k++) {
+      x = ljit_expr(g, c->cell[k]);
+      if (x < 0) return -1;
+    }
+    ljit_emit(g, "t%i = t%i;", r, x);
+    g->depth--;
+    ljit_emit(g, "} else {");
+    g->depth++;
+    opened++;
+  }
+  ljit_emit(g, "return %i;", select ? LJIT_NO_SELECTION : LJIT_DEOPT);
+  while (opened--) {
+    g->depth--;
+    ljit_emit(g, "}");
+  }
+  return r;
+}
+
+/**
+ * Translate an expression to statements leaving its value in a temporary.
+ * @param g The translation.
+ * @param v The expression.
+ * @return The temporary, or -1 if the expression is outside what is
+ *         compiled.
+ */
+static int ljit_expr(ljit_gen* g, lval* v) {
+  if (v->type == LVAL_NUM) {
+    int r = g->temps++;
+    if (v->num == LONG_MIN) ljit_emit(g, "t%i = -%ldL - 1;", r, LONG_MAX);
+    else ljit_emit(g, "t%i = %ldL;", r, v->num);
+    return r;
+  }
+
+  if (v->type == LVAL_SYM) {
+    int r = g->temps++;
+    int k = ljit_formal(g, v->sym);
+    if (k >= 0) {
+      ljit_emit(g, "t%i = a%i;", r, k);
+      return r;
+    }
+    /* Under dynamic scope a free symbol may name a caller's local */
+    if (!g->lexical) return -1;
+    lval* x = ljit_lookup(g->root, v->sym);
+    if (!x || x->type != LVAL_NUM) return -1;
+    ljit_assume(g, v->sym, x);
+    if (x->num == LONG_MIN) ljit_emit(g, "t%i = -%ldL - 1;", r, LONG_MAX);
+    else ljit_emit(g, "t%i = %ldL;", r, x->num);
+    return r;
+  }
+
+  if (v->type != LVAL_SEXPR || v->count == 0) return -1;
+  if (v->count == 1) return ljit_expr(g, v->cell[0]);
+  if (v->cell[0]->type != LVAL_SYM) return -1;
+
+  char* h = v->cell[0]->sym;
+  if (ljit_formal(g, h) >= 0) return -1;
+
+  /* Special forms */
+  if (lspecial_find(h)) ljit_assume_special(g, h);
+  if (strcmp(h, "if") == 0) {
+    if (v->count != 4) return -1;
+    int t = ljit_expr(g, v->cell[1]);
+    if (t < 0) return -1;
+    int r = g->temps++;
+    ljit_emit(g, "if (t%i) {", t);
+    g->depth++;
+    int x = ljit_code(g, v->cell[2]);
+    if (x < 0) return -1;
+    ljit_emit(g, "t%i = t%i;", r, x);
+    g->depth--;
+    ljit_emit(g, "} else {");
+    g->depth++;
+    int y = ljit_code(g, v->cell[3]);
+    if (y < 0) return -1;
+    ljit_emit(g, "t%i = t%i;", r, y);
+    g->depth--;
+    ljit_emit(g, "}");
+    return r;
+  }
+  if (strcmp(h, "select") == 0) return ljit_clauses(g, v, 1);
+  if (strcmp(h, "cond") == 0) return ljit_clauses(g, v, 0);
+  if (strcmp(h, "do") == 0 || strcmp(h, "begin") == 0) {
+    int x = -1;
+    for (int i = 1; i < v->count; i++) {
+      x = ljit_expr(g, v->cell[i]);
+      if (x < 0) return -1;
+    }
+    return x;
+  }
+  if (lspecial_find(h)) return -1;
+
+  /* Calls of the function itself */
+  if (strcmp(h, g->j->name) == 0) {
+    if (v->count - 1 != g->formals->count) return -1;
+    lval* self = ljit_lookup(g->root, h);
+    if (!self || self->type != LVAL_FUN || self->builtin || self->jit != g->j) return -1;
+    ljit_assume(g, h, self);
+    int args[v->count - 1];
+    for (int i = 1; i < v->count; i++) {
+      args[i - 1] = ljit_expr(g, v->cell[i]);
+      if (args[i - 1] < 0) return -1;
+    }
+    int r = g->temps++;
+    char call[256] = "";
+    size_t n = 0;
+    for (int i = 0; i < v->count - 1; i++) {
+      n += snprintf(call + n, sizeof(call) - n, "t%i, ", args[i]);
+      if (n >= sizeof(call)) return -1;
+    }
+    ljit_emit(g, "if ((s = %s(%s&t%i)) != 0) return s;", g->id, call, r);
+    return r;
+  }
+
+  /* Builtins */
+  lval* f = ljit_lookup(g->root, h);
+  if (!f || f->type != LVAL_FUN || !f->builtin) return -1;
+  for (size_t i = 0; i < sizeof(ljit_ops) / sizeof(ljit_ops[0]); i++) {
+    if (f->builtin != ljit_ops[i].builtin) continue;
+    ljit_assume(g, h, f);
+    if (ljit_ops[i].arith) return ljit_arith(g, v, ljit_ops[i].op[0]);
+    if (v->count != 3) return -1;
+    int x = ljit_expr(g, v->cell[1]);
+    if (x < 0) return -1;
+    int y = ljit_expr(g, v->cell[2]);
+    if (y < 0) return -1;
+    int r = g->temps++;
+    ljit_emit(g, "t%i = t%i %s t%i;", r, x, ljit_ops[i].op, y);
+    return r;
+  }
+  return -1;
+}
+
+/**
+ * Translate a function to C: a static function named id, and id_entry
+ * calling it with the arguments in an array. The code relies on the
+ * typedefs L and U (long and unsigned long).
+ * @param j The function's compilation state; receives its guards.
+ * @param f The function.
+ * @param root The root environment its globals are found in.
+ * @param id The name of the C function.
+ * @param out Receives the C source, appended.
+ * @return 0, or -1 if the function is outside what is compiled.
+ */
+static int ljit_translate(ljit* j, lval* f, lenv* root, const char* id, lbuf* out) {
+  ljit_gen g = { j, id, f->formals, root, f->lexical && !f->closure, { 0 }, 0, 0 };
+  lbuf_init_grow(&g.out, 1024);
+  /* The body as written: the guards then cover the builtins it calls,
+     folded or not */
+  lval* body = f->orig ? f->orig->body : f->body;
+
+  int r = -1;
+  if (f->formals->count > 0 && body->type == LVAL_QEXPR) {
+    r = 0;
+    for (int i = 0; i < f->formals->count; i++) {
+      if (strcmp(f->formals->cell[i]->sym, "&") == 0) r = -1;
+    }
+    if (r == 0) r = ljit_code(&g, body);
+  }
+  if (r < 0) {
+    lfree(g.out.data);
+    return -1;
+  }
+
+  char line[256];
+  snprintf(line, sizeof(line), "/* %s */\nstatic int %s(", j->name, id);
+  lbuf_puts(out, line);
+  for (int i = 0; i < f->formals->count; i++) {
+    snprintf(line, sizeof(line), "L a%i, ", i);
+    lbuf_puts(out, line);
+  }
+  lbuf_puts(out, "L* out) {\n  int s;\n  (void)s;\n");
+  for (int i = 0; i < g.temps; i++) {
+    snprintf(line, sizeof(line), "  L t%i;\n", i);
+    lbuf_puts(out, line);
+  }
+  lbuf_write(out, g.out.data, g.out.len);
+  snprintf(line, sizeof(line), "  *out = t%i;\n  return 0;\n}\n\n", r);
+  lbuf_puts(out, line);
+  snprintf(line, sizeof(line), "int %s_entry(const L* args, L* out) {\n  return %s(", id, id);
+  lbuf_puts(out, line);
+  for (int i = 0; i < f->formals->count; i++) {
+    snprintf(line, sizeof(line), "args[%i], ", i);
+    lbuf_puts(out, line);
+  }
+  lbuf_puts(out, "out);\n}\n");
+  lfree(g.out.data);
+  return 0;
+}
+
+/**
+ * Run the C compiler on a file, without a shell, discarding its output.
+ * $LISPY_CC is split into words at spaces, so it may carry flags.
+ * @param c_path The C file.
+ * @param so_path The shared object to write.
+ * @return 1 if the compiler succeeded, 0 otherwise.
+ */
+static int ljit_cc(const char* c_path, const char* so_path) {
+  const char* cc = getenv("LISPY_CC");
+  char words[512];
+  snprintf(words, sizeof(words), "%s", cc && *cc ? cc : "cc");
+
+  char* argv[LJIT_CC_WORDS + 8];
+  int argc = 0;
+  char* save;
+  for (char* w = strtok_r(words, " \t", &save); w && argc < LJIT_CC_WORDS;
+       w = strtok_r(NULL, " \t", &save)) {
+    argv[argc++] = w;
+  }
+  if (argc == 0) return 0;
+  char* args[] = { "-O2", "-shared", "-fPIC", "-o", (char*)so_path, (char*)c_path, NULL };
+  memcpy(argv + argc, args, sizeof(args));
+
+  pid_t pid = fork();
+  if (pid < 0) return 0;
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) return 0;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Compile C source into a shared object and load it.
+ * @param src The source.
+ * @param lib Receives the loaded object.
+ * @return Its entry point, or NULL if compiling or loading failed.
+ */
+static ljit_fn ljit_build(char* src, void** lib) {
+  /* A private directory, so no other user can replace the files */
+  const char* tmp = getenv("TMPDIR");
+  char dir[512], c_path[540], so_path[540];
+  snprintf(dir, sizeof(dir), "%s/lispy-jit-XXXXXX", tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir)) return NULL;
+  snprintf(c_path, sizeof(c_path), "%s/fn.c", dir);
+  snprintf(so_path, sizeof(so_path), "%s/fn.so", dir);
+
+  int fd = open(c_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  size_t len = strlen(src);
+  int ok = fd >= 0 && write(fd, src, len) == (ssize_t)len;
+  if (fd >= 0) close(fd);
+  ok = ok && ljit_cc(c_path, so_path);
+  unlink(c_path);
+
+  ljit_fn fn = NULL;
+  *lib = ok ? dlopen(so_path, RTLD_NOW | RTLD_LOCAL) : NULL;
+  if (*lib) {
+    *(void**)&fn = dlsym(*lib, "lispy_jit_entry");
+    if (!fn) {
+      dlclose(*lib);
+      *lib = NULL;
+    }
+  }
+  unlink(so_path);
+  rmdir(dir);
+  return fn;
+}
+
+/**
+ * Compile a function, leaving its state LJIT_COMPILED or LJIT_FAILED.
+ */
+static void ljit_compile(ljit* j, lval* f, lenv* root) {
+  lbuf src;
+  ljit_fn fn = NULL;
+  lbuf_init_grow(&src, 4096);
+  lbuf_puts(&src, "typedef long L;\ntypedef unsigned long U;\n\n");
+  if (ljit_translate(j, f, root, "lispy_jit", &src) == 0) {
+    lbuf_putc(&src, '\0');
+    fn = ljit_build(src.data, &j->lib);
+  }
+  lfree(src.data);
+  j->fn = fn;
+  __atomic_store_n(&j->state, fn ? LJIT_COMPILED : LJIT_FAILED, __ATOMIC_RELEASE);
+}
+
+/**
+ * Check that the globals compiled code relies on still hold their values.
+ */
+static int ljit_guards_hold(ljit* j, lenv* root) {
+  for (int i = 0; i < j->nguards; i++) {
+    ljit_guard* gd = &j->guards[i];
+    if (gd->type == LJIT_SPECIAL) {
+      if (!lspecial_get(root, gd->sym)) return 0;
+      continue;
+    }
+    lval* v = ljit_lookup(root, gd->sym);
+    if (!v || v->type != gd->type) return 0;
+    if (gd->type == LVAL_NUM && v->num != gd->num) return 0;
+    if (gd->type == LVAL_FUN && (gd->builtin ? v->builtin != gd->builtin : v->builtin || v->jit != j)) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Hash translated code, so code compiled ahead of time can be matched
+ * against the translation of the function it is installed for.
+ */
+static unsigned long ljit_hash(const char* s, size_t n) {
+  unsigned long h = 14695981039346656037UL;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+/**
+ * Translate a global function to C ahead of time (see ljit_translate).
+ * @param root The root environment it is defined in.
+ * @param name The global.
+ * @param id The name of the C function.
+ * @param out Receives the C source, appended.
+ * @param hash Receives the hash to pass to ljit_preload.
+ * @return 0, or -1 if the function is outside what is compiled.
+ */
+int ljit_emit_c(lenv* root, char* name, const char* id, lbuf* out, unsigned long* hash) {
+  lval* f = ljit_lookup(root, name);
+  if (!f || f->type != LVAL_FUN || f->builtin) return -1;
+
+  /* Calls of the function itself are recognised by its state */
+  ljit* prev = f->jit;
+  ljit* j = ljit_new(name);
+  f->jit = j;
+  lbuf code;
+  lbuf_init_grow(&code, 1024);
+  int r = ljit_translate(j, f, root, id, &code);
+  if (r == 0) {
+    *hash = ljit_hash(code.data, code.len);
+    lbuf_write(out, code.data, code.len);
+  }
+  lfree(code.data);
+  f->jit = prev;
+  ljit_release(j);
+  return r;
+}
+
+/**
+ * Install code compiled ahead of time for a global function that has just
+ * been defined. The function is translated again, and the code is only
+ * used if the translation is the one it was compiled from.
+ * @param e The environment it is defined in.
+ * @param name The global.
+ * @param id The name of the C function.
+ * @param fn Its entry point (id_entry).
+ * @param hash The hash ljit_emit_c gave.
+ */
+void ljit_preload(lenv* e, char* name, const char* id, ljit_fn fn, unsigned long hash) {
+  lenv* root = lenv_root(e);
+  lval* f = ljit_lookup(root, name);
+  if (!f || f->type != LVAL_FUN || f->builtin) return;
+
+  if (f->jit) ljit_release(f->jit);
+  ljit* j = ljit_new(name);
+  f->jit = j;
+  lbuf code;
+  lbuf_init_grow(&code, 1024);
+  if (ljit_translate(j, f, root, id, &code) == 0 && ljit_hash(code.data, code.len) == hash) {
+    j->fn = fn;
+    j->state = LJIT_COMPILED;
+  } else {
+    ljit_forget(j);
+    lctx* c = lctx_current();
+    j->state = c && c->jit ? LJIT_COUNTING : LJIT_FAILED;
+  }
+  lfree(code.data);
+}
+
+/**
+ * Check whether a scope between a caller and the root binds one of the
+ * globals compiled code relies on, as under dynamic scope the body would
+ * see that binding instead.
+ * @param j The compilation state.
+ * @param e The caller's environment.
+ */
+static int ljit_shadowed(ljit* j, lenv* e) {
+  for (; e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      for (int k = 0; k < j->nguards; k++) {
+        if (strcmp(e->syms[i], j->guards[k].sym) == 0) return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Run a call of a function with compilation state in compiled code,
+ * compiling it first if it has just become hot.
+ * @param e The caller's environment.
+ * @param f The function.
+ * @param a The arguments; consumed only if a result is returned.
+ * @return The result, or NULL if the call must be interpreted.
+ */
+lval* ljit_call(lenv* e, lval* f, lval* a) {
+  ljit* j = f->jit;
+  lctx* c = lctx_current();
+  if ((c && c->limited) || a->count != f->formals->count) return NULL;
+
+  int state = __atomic_load_n(&j->state, __ATOMIC_ACQUIRE);
+  if (state == LJIT_COUNTING) {
+    if (__atomic_add_fetch(&j->calls, 1, __ATOMIC_RELAXED) < LJIT_THRESHOLD) return NULL;
+    if (!__atomic_compare_exchange_n(&j->state, &state, LJIT_COMPILING, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return NULL;
+    }
+    ljit_compile(j, f, lenv_root(e));
+    state = j->state;
+  }
+  if (state != LJIT_COMPILED) return NULL;
+
+  long args[a->count];
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_NUM) return NULL;
+    args[i] = a->cell[i]->num;
+  }
+  if (!ljit_guards_hold(j, lenv_root(e))) return NULL;
+  if (!f->lexical && ljit_shadowed(j, e)) return NULL;
+
+  long out;
+  switch (j->fn(args, &out)) {
+    case 0: break;
+    case LJIT_DIV_ZERO: lval_del(a); return lval_err("Division By Zero.");
+    case LJIT_NO_SELECTION: lval_del(a); return lval_err("No Selection Found");
+    default: return NULL;
+  }
+  lval_del(a);
+  return lval_num(out);
+}
@@ -0,0 +1,172 @@
+// File: lbuf.c
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Initialise an output buffer.
+ * With a sink the buffer is flushed to it whenever it fills up. Without a
+ * sink, writes past the capacity are dropped but still counted, so a buffer
+ * with no memory at all measures how long the output would be.
+ * @param b The buffer.
+ * @param data Backing memory (may be NULL when only counting).
+ * @param cap Size of the backing memory.
+ * @param sink Stream to flush to, or NULL for an in-memory buffer.
+ */
+void lbuf_init(lbuf* b, char* data, size_t cap, FILE* sink) {
+  b->data = data;
+  b->len = 0;
+  b->cap = data ? cap : 0;
+  b->sink = sink;
+  b->grow = 0;
+}
+
+/**
+ * Initialise an in-memory buffer that owns its memory and grows on demand.
+ * Capacity doubles when full, so appends are amortized O(1). If the
+ * memory cannot be had, appends are dropped and the evaluation in the
+ * current context fails (lrealloc_try).
+ * The memory is allocated in the current context (lalloc); free it with
+ * lfree(b->data) when done.
+ * @param b The buffer.
+ * @param cap Initial capacity.
+ */
+void lbuf_init_grow(lbuf* b, size_t cap) {
+  lbuf_init(b, lalloc(cap ? cap : 1), cap ? cap : 1, NULL);
+  b->grow = 1;
+}
+
+/**
+ * Write buffered bytes to the sink and empty the buffer.
+ * In-memory buffers are left untouched.
+ * @param b The buffer.
+ */
+void lbuf_flush(lbuf* b) {
+  if (!b->sink) return;
+  if (b->len) fwrite(b->data, 1, b->len, b->sink);
+  b->len = 0;
+}
+
+/**
+ * Append raw bytes to a buffer.
+ * @param b The buffer.
+ * @param s The bytes.
+ * @param n Number of bytes.
+ */
+void lbuf_write(lbuf* b, const char* s, size_t n) {
+  if (b->sink) {
+    if (b->len + n > b->cap) lbuf_flush(b);
+    if (n > b->cap) {
+      fwrite(s, 1, n, b->sink);
+      return;
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    return;
+  }
+
+  if (b->grow && b->len + n > b->cap) {
+    size_t cap = b->cap * 2;
+    if (cap < b->len + n) cap = b->len + n;
+    char* data = lrealloc_try(b->data, cap);
+    /* The evaluation fails; drop the bytes rather than stopping */
+    if (!data) return;
+    b->data = data;
+    b->cap = cap;
+  }
+
+  if (b->len < b->cap) {
+    size_t room = b->cap - b->len;
+    memcpy(b->data + b->len, s, n < room ? n : room);
+  }
+  b->len += n;
+}
+
+/**
+ * Append a single character to a buffer.
+ * @param b The buffer.
+ * @param c The character.
+ */
+void lbuf_putc(lbuf* b, char c) {
+  if (b->len < b->cap) {
+    b->data[b->len++] = c;
+    return;
+  }
+  lbuf_write(b, &c, 1);
+}
+
+/**
+ * Append a NUL-terminated string to a buffer.
+ * @param b The buffer.
+ * @param s The string.
+ */
+void lbuf_puts(lbuf* b, const char* s) {
+  lbuf_write(b, s, strlen(s));
+}
+
+/**
+ * Append the decimal representation of a number to a buffer.
+ * @param b The buffer.
+ * @param x The number.
+ */
+void lbuf_num(lbuf* b, long x) {
+  char digits[24];
+  int i = sizeof(digits);
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+
+  do {
+    digits[--i] = '0' + (u % 10);
+    u /= 10;
+  } while (u);
+  if (x < 0) digits[--i] = '-';
+
+  lbuf_write(b, digits + i, sizeof(digits) - i);
+}
+
+/**
+ * Append bytes to a buffer using C escape sequences.
+ * Uses the same escapes as mpcf_escape, without allocating.
+ * @param b The buffer.
+ * @param s The bytes to escape.
+ * @param n Number of bytes.
+ */
+void lbuf_escape(lbuf* b, const char* s, size_t n) {
+  size_t run = 0;
+  for (size_t i = 0; i < n; i++) {
+    char esc;
+    switch (s[i]) {
+      case '\a': esc = 'a'; break;
+      case '\b': esc = 'b'; break;
+      case '\f': esc = 'f'; break;
+      case '\n': esc = 'n'; break;
+      case '\r': esc = 'r'; break;
+      case '\t': esc = 't'; break;
+      case '\v': esc = 'v'; break;
+      case '\\': esc = '\\'; break;
+      case '\'': esc = '\''; break;
+      case '\"': esc = '\"'; break;
+      case '\0': esc = '0'; break;
+      default: continue;
+    }
+    /* Copy the unescaped run before this character in one go */
+    lbuf_write(b, s + run, i - run);
+    lbuf_putc(b, '\\');
+    lbuf_putc(b, esc);
+    run = i + 1;
+  }
+  lbuf_write(b, s + run, n - run);
+}
+
+/**
+ * Get the calling thread's buffer for standard output.
+ * Each thread renders into its own buffer and hands whole chunks to stdio,
+ * so prints from pool workers do not interleave mid-value.
+ * @return The stdout buffer.
+ */
+lbuf* lbuf_stdout(void) {
+  static __thread char mem[LBUF_SIZE];
+  static __thread lbuf out;
+  if (!out.sink) lbuf_init(&out, mem, sizeof(mem), stdout);
+  return &out;
+}
@@ -8,26 +8,189 @@
  * @return Pointer to the new lenv.
  */
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lalloc(sizeof(lenv));
   e->par = NULL;
+  e->refs = 1;
+  e->owned = 1;
+  e->holds_par = 0;
   e->count = 0;
+  e->cap = 0;
+  e->frame = 0;
+  e->specials = 0;
+  e->frozen = 0;
+  e->id = 0;
   e->syms = NULL;
   e->vals = NULL;
   return e;
 }
 
 /**
- * Delete an environment and free its resources.
- * @param e The lenv to delete.
+ * Set up a stack frame as an empty environment.
+ * Delete it with lenv_del when the scope ends.
+ * @param f The frame.
+ * @param par The enclosing environment.
+ * @return The frame's environment.
  */
-void lenv_del(lenv* e) {
+lenv* lframe_init(lframe* f, lenv* par) {
+  lenv* e = &f->env;
+  e->par = par;
+  e->refs = 1;
+  e->owned = 1;
+  e->holds_par = 0;
+  e->count = 0;
+  e->cap = LFRAME_SLOTS;
+  e->frame = 1;
+  e->specials = 0;
+  e->frozen = 0;
+  e->id = 0;
+  e->syms = f->syms;
+  e->vals = f->vals;
+  return e;
+}
+
+/**
+ * Check whether the bindings of an environment are still held in its frame.
+ */
+static int lenv_inline(lenv* e) {
+  return e->frame && e->syms == ((lframe*)e)->syms;
+}
+
+/**
+ * Make room for one more binding, doubling the arrays when full.
+ * @param e The environment.
+ */
+static void lenv_grow(lenv* e) {
+  if (e->count < e->cap) return;
+  int cap = e->cap ? e->cap * 2 : 4;
+  if (lenv_inline(e)) {
+    char** syms = lalloc(sizeof(char*) * cap);
+    lval** vals = lalloc(sizeof(lval*) * cap);
+    memcpy(syms, e->syms, sizeof(char*) * e->count);
+    memcpy(vals, e->vals, sizeof(lval*) * e->count);
+    e->syms = syms;
+    e->vals = vals;
+  } else {
+    e->syms = lrealloc(e->syms, sizeof(char*) * cap);
+    e->vals = lrealloc(e->vals, sizeof(lval*) * cap);
+  }
+  e->cap = cap;
+}
+
+/*
+ * Under lexical scope an environment can outlive the scope or function
+ * call it was made for: the lambdas created in it keep it, and it keeps
+ * its parent. Environments are therefore reference counted. The owner
+ * (the function holding the bindings, or the let form) gives up its
+ * reference with lenv_del; closures and child scopes hold theirs with
+ * lenv_retain and lenv_release. Root environments live as long as their
+ * context and are not counted.
+ *
+ * A lambda stored in the scope it closes over, as with letrec or a local
+ * recursive function, keeps that scope alive through a cycle. Once the
+ * owner is gone such references are discounted, so the scope is freed
+ * when only its own bindings still refer to it. Longer cycles, through
+ * another scope, are not detected.
+ */
+
+/**
+ * Count the references to an environment held by lambdas in a value.
+ */
+static int lval_refs_to(lval* v, lenv* e) {
+  int n = 0;
+  switch (v->type) {
+    case LVAL_FUN:
+      if (v->builtin) break;
+      n = v->closure == e;
+      for (int i = 0; i < v->env->count; i++) n += lval_refs_to(v->env->vals[i], e);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) n += lval_refs_to(v->cell[i], e);
+      break;
+  }
+  return n;
+}
+
+/**
+ * Free an environment no one refers to any more.
+ */
+static void lenv_free(lenv* e) {
+  /* Releases by the lambdas being deleted below are ignored */
+  e->refs = -1;
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
+    lfree(e->syms[i]);
     lval_del(e->vals[i]);
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  if (e->holds_par) lenv_release(e->par);
+  if (lenv_inline(e)) return;
+  lfree(e->syms);
+  lfree(e->vals);
+  if (!e->frame) lfree(e);
+}
+
+/**
+ * Take a counted reference to an environment for a lambda closing over it.
+ * @param e The environment.
+ * @return e, or NULL if it is a root environment.
+ */
+lenv* lenv_retain(lenv* e) {
+  if (!e->par) return NULL;
+  LREF_INC(e);
+  return e;
+}
+
+/**
+ * Give up a reference taken with lenv_retain.
+ * @param e The environment.
+ */
+void lenv_release(lenv* e) {
+  int refs = LREF_DEC(e);
+  if (refs < 0) return;
+  if (refs > 0) {
+    int self = 0;
+    if (e->owned) return;
+    for (int i = 0; i < e->count; i++) self += lval_refs_to(e->vals[i], e);
+    if (refs != self) return;
+  }
+  lenv_free(e);
+}
+
+/**
+ * Delete an environment on behalf of its owner. It is freed unless lambdas
+ * or child scopes still refer to it.
+ * @param e The lenv to delete.
+ */
+void lenv_del(lenv* e) {
+  if (e->refs == 1) {
+    lenv_free(e);
+    return;
+  }
+  e->owned = 0;
+  lenv_release(e);
+}
+
+/**
+ * Set the parent of an environment, keeping the parent alive as long as
+ * the environment.
+ * @param e The environment.
+ * @param par The new parent.
+ */
+void lenv_link(lenv* e, lenv* par) {
+  if (e->holds_par) lenv_release(e->par);
+  e->holds_par = lenv_retain(par) != NULL;
+  e->par = par;
+}
+
+/**
+ * Get the root of an environment chain.
+ * @param e The environment.
+ * @return The outermost environment.
+ */
+lenv* lenv_root(lenv* e) {
+  while (e->par) {
+    e = e->par;
+  }
+  return e;
 }
 
 /**
@@ -36,19 +199,151 @@ void lenv_del(lenv* e) {
  * @return Pointer to the copied lenv.
  */
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  lenv* n = lalloc(sizeof(lenv));
   n->par = e->par;
+  n->refs = 1;
+  n->owned = 1;
+  n->holds_par = e->holds_par;
+  if (n->holds_par) LREF_INC(n->par);
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
+  n->cap = e->count;
+  n->frame = 0;
+  n->specials = e->specials;
+  n->frozen = 0;
+  n->id = 0;
+  n->syms = lalloc(sizeof(char*) * n->count);
+  n->vals = lalloc(sizeof(lval*) * n->count);
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+    n->syms[i] = lalloc(strlen(e->syms[i]) + 1);
     strcpy(n->syms[i], e->syms[i]);
     n->vals[i] = lval_copy(e->vals[i]);
   }
   return n;
 }
 
+/**
+ * Flatten an environment chain into a single standalone environment.
+ * Inner bindings shadow outer ones, as they would in lenv_get.
+ * @param e The innermost environment.
+ * @return A new root environment holding copies of every visible binding.
+ */
+lenv* lenv_freeze(lenv* e) {
+  lenv* n = lenv_new();
+  for (; e; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      int shadowed = 0;
+      for (int j = 0; j < n->count && !shadowed; j++) {
+        shadowed = strcmp(n->syms[j], e->syms[i]) == 0;
+      }
+      if (shadowed) continue;
+
+      lenv_grow(n);
+      n->vals[n->count] = lval_copy(e->vals[i]);
+      n->syms[n->count] = lstrdup(e->syms[i]);
+      n->count++;
+    }
+  }
+  return n;
+}
+
+/* Source of root environment ids; 0 means none yet */
+static unsigned long lenv_ids;
+
+/**
+ * Create an empty inline cache.
+ * @return The cache, held once.
+ */
+lcache* lcache_new(void) {
+  lcache* c = lalloc(sizeof(lcache));
+  c->refs = 1;
+  c->slot = 0;
+  c->name = NULL;
+  return c;
+}
+
+/**
+ * Release a hold on an inline cache, freeing it when none is left.
+ * @param c The cache.
+ */
+void lcache_release(lcache* c) {
+  if (LREF_DEC(c) == 0) lfree(c);
+}
+
+/**
+ * Get the id of a root environment, giving it one on first use.
+ * Ids are never reused, so a cached id cannot match a later root that
+ * happens to share the address of a deleted one.
+ */
+static unsigned long lenv_id(lenv* e) {
+  unsigned long id = __atomic_load_n(&e->id, __ATOMIC_RELAXED);
+  if (id) return id;
+  unsigned long next = __atomic_add_fetch(&lenv_ids, 1, __ATOMIC_RELAXED);
+  __atomic_compare_exchange_n(&e->id, &id, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  return __atomic_load_n(&e->id, __ATOMIC_RELAXED);
+}
+
+/**
+ * Look a call site's head symbol up in a root environment through its
+ * inline cache. Bindings are never removed from an environment and keep
+ * their index when rebound, so an index found once in a root stays right
+ * for as long as the root exists; def only adds to the end.
+ * @param e The root environment.
+ * @param k The symbol, with a cache.
+ * @return Copy of the bound value, or NULL if unbound.
+ */
+static lval* lenv_get_cached(lenv* e, lval* k) {
+  unsigned long id = lenv_id(e);
+  unsigned long slot = __atomic_load_n(&k->cache->slot, __ATOMIC_RELAXED);
+  if (slot >> LCACHE_INDEX_BITS == id) {
+    LSTAT_ADD(cache_hits, 1);
+    return lval_copy(e->vals[slot & ((1UL << LCACHE_INDEX_BITS) - 1)]);
+  }
+  LSTAT_ADD(cache_misses, 1);
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) {
+      if (i < 1L << LCACHE_INDEX_BITS) {
+        __atomic_store_n(&k->cache->slot, id << LCACHE_INDEX_BITS | i, __ATOMIC_RELAXED);
+      }
+      return lval_copy(e->vals[i]);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Note that a name is being bound again at the root of the current
+ * context. Optimized function bodies (see opt.c) rely on builtins and
+ * special forms keeping their meaning, so rebinding one of those moves
+ * the context's rebinds on.
+ * @param sym The name.
+ * @param old The value it was bound to.
+ */
+static void lenv_rebound(char* sym, lval* old) {
+  lctx* c = lctx_current();
+  if (!c) return;
+  int special = lspecial_find(sym) != NULL;
+  if (special) lspecial_rebound(sym);
+  if (special || (old->type == LVAL_FUN && old->builtin)) {
+    __atomic_add_fetch(&c->rebinds, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Check whether a scope below the root binds the name of a special form.
+ * Scopes count such bindings, so only those that have one are searched.
+ * @param e The innermost environment.
+ * @param sym The name.
+ */
+int lenv_shadowed(lenv* e, char* sym) {
+  for (; e->par; e = e->par) {
+    if (!e->specials) continue;
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], sym) == 0) return 1;
+    }
+  }
+  return 0;
+}
+
 /**
  * Get the value bound to a symbol in the environment or its parents.
  * @param e The environment.
@@ -56,16 +351,21 @@ lenv* lenv_copy(lenv* e) {
  * @return Copy of the bound value or error if unbound.
  */
 lval* lenv_get(lenv* e, lval* k) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+  LSTAT_ADD(lookups, 1);
+  for (; e; e = e->par) {
+    LSTAT_ADD(lookup_depth, 1);
+    if (!e->par && k->cache) {
+      lval* x = lenv_get_cached(e, k);
+      if (x) return x;
+      break;
+    }
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) {
+        return lval_copy(e->vals[i]);
+      }
     }
   }
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
-  }
+  return lval_err("Unbound Symbol '%s'", k->sym);
 }
 
 /**
@@ -77,17 +377,40 @@ lval* lenv_get(lenv* e, lval* k) {
 void lenv_put(lenv* e, lval* k, lval* v) {
   for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->sym) == 0) {
+      if (!e->par) lenv_rebound(k->sym, e->vals[i]);
       lval_del(e->vals[i]);
       e->vals[i] = lval_copy(v);
       return;
     }
   }
+  lenv_grow(e);
+  e->vals[e->count] = lval_copy(v);
+  e->syms[e->count] = lstrdup(k->sym);
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  if (lspecial_find(k->sym)) e->specials++;
+}
+
+/**
+ * Bind a value to a symbol in the local environment, taking ownership of
+ * the value instead of copying it.
+ * @param e The environment.
+ * @param sym The symbol name.
+ * @param v The value; consumed.
+ */
+void lenv_bind(lenv* e, char* sym, lval* v) {
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], sym) == 0) {
+      if (!e->par) lenv_rebound(sym, e->vals[i]);
+      lval_del(e->vals[i]);
+      e->vals[i] = v;
+      return;
+    }
+  }
+  lenv_grow(e);
+  e->vals[e->count] = v;
+  e->syms[e->count] = lstrdup(sym);
+  e->count++;
+  if (lspecial_find(sym)) e->specials++;
 }
 
 /**
@@ -97,8 +420,5 @@ void lenv_put(lenv* e, lval* k, lval* v) {
  * @param v The value lval.
  */
 void lenv_def(lenv* e, lval* k, lval* v) {
-  while (e->par) {
-    e = e->par;
-  }
-  lenv_put(e, k, v);
+  lenv_put(lenv_root(e), k, v);
 }
\ No newline at end of file
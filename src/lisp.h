@@ -3,6 +3,8 @@
 #define LISP_H
 
 #include "mpc.h"
+#include <ucontext.h>
+#include <pthread.h>
 
 #ifdef _WIN32
 char* readline(char* prompt);
@@ -13,63 +15,391 @@ void add_history(char* unused);
 #endif
 
 /* Enum for Lisp Value Types */
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_REGEX, LVAL_ROPE, LVAL_SBUF, LVAL_FILE, LVAL_TASK, LVAL_SEQ };
 
 /* Forward Declarations */
 struct lval;
 struct lenv;
+struct lregex;
+struct lrope;
+struct lsbuf;
+struct lfile;
+struct ltask;
+struct lseq;
+struct lsched;
+struct lctx;
+struct lcache;
+struct ljit;
+struct lorig;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lregex lregex;
+typedef struct lrope lrope;
+typedef struct lsbuf lsbuf;
+typedef struct lfile lfile;
+typedef struct ltask ltask;
+typedef struct lseq lseq;
+typedef struct lsched lsched;
+typedef struct lctx lctx;
+typedef struct lcache lcache;
+typedef struct ljit ljit;
+typedef struct lorig lorig;
 
 /* Type for builtin functions */
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Type for special forms: receive the whole unevaluated S-expression */
+typedef lval*(*lspecial)(lenv*, lval*);
+
+/* Type for fast-call builtins: two numbers in, one number out.
+   Returns 0 to decline, leaving the generic builtin to handle (and
+   report) the call. */
+typedef int(*lfast)(long, long, long*);
+
 /* Lisp Value Structure */
 struct lval {
   int type;
 
-  /* Basic Types */
-  long num;
-  char* err;
-  char* sym;
-  char* str;
+  /* Payload of the type; only the members of the current type are set */
+  union {
+    /* Basic Types */
+    long num;
+    char* err;
+    struct {
+      char* sym;
+      lcache* cache;  // Inline cache of a symbol heading an expression, or NULL
+    };
+    struct {
+      char* str;      // String bytes, always NUL-terminated at len
+      size_t len;     // String length (may include NUL bytes)
+    };
+    lregex* regex;
+    lrope* rope;
+    lsbuf* sbuf;
+    lfile* file;
+    ltask* task;
+    lseq* seq;
+
+    /* Function */
+    struct {
+      lbuiltin builtin;
+      lfast fast;     // Optional fast path of a builtin for two Numbers
+      int fold;       // The fast path also folds over more Numbers, left to right
+      lenv* env;
+      lval* formals;
+      lval* body;
+      int lexical;    // Lambda closes over the scope it was created in
+      lenv* closure;  // That scope (counted), NULL for the root
+      ljit* jit;      // Compilation state of a global function, or NULL
+      lorig* orig;    // Body as written, if the optimizer rewrote it, or NULL
+    };
+
+    /* Expression */
+    struct {
+      int count;
+      lval** cell;
+    };
+  };
+};
+
+/* Reference counts of shared handles are updated atomically, since
+   copies of a handle may be held by several pool worker threads */
+#define LREF_INC(x) __atomic_add_fetch(&(x)->refs, 1, __ATOMIC_RELAXED)
+#define LREF_DEC(x) __atomic_sub_fetch(&(x)->refs, 1, __ATOMIC_ACQ_REL)
 
-  /* Function */
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
+/* Compiled Regular Expression (shared between copies) */
+struct lregex {
+  int refs;               // Number of lvals and cache slots holding it
+  char* src;              // Pattern source
+  mpc_parser_t* whole;    // Matches the entire input
+  mpc_parser_t* search;   // Collects every match, built on first use
+  mpc_parser_t* split;    // Collects text between matches, built on first use
+};
+
+/* Inline cache of a call site: where its head symbol was last found in
+   a root environment, as the root's id above LCACHE_INDEX_BITS and the
+   binding's index below. Shared between copies of the symbol. */
+#define LCACHE_INDEX_BITS 20
+
+struct lcache {
+  int refs;               // Number of symbols holding it
+  unsigned long slot;     // Root id and index, 0 when empty
+  const char* name;       // Interned profiler name of the call site, or NULL
+};
+
+/* Body of a function as written, kept when the optimizer rewrites it
+   (see opt.c); shared between copies */
+struct lorig {
+  int refs;               // Number of lvals holding it
   lval* body;
+  lval* assumed;          // Names the rewrite relied on, as symbols
+  unsigned long rebinds;  // The context's rebinds when it was made
+};
 
-  /* Expression */
-  int count;
-  lval** cell;
+/* Entry point of compiled code: arguments in, result out */
+typedef int(*ljit_fn)(const long* args, long* out);
+
+/* A global the compiled code assumed: a Number, a builtin, the function
+   or a special form */
+typedef struct {
+  char* sym;
+  int type;             // LVAL_NUM, LVAL_FUN for functions, or -1 for a special form
+  long num;
+  lbuiltin builtin;     // The builtin, or NULL for the function itself
+} ljit_guard;
+
+/* Compilation state of a function (shared between copies) */
+struct ljit {
+  int refs;             // Number of lvals holding it
+  int state;
+  long calls;           // Calls counted so far
+  char* name;           // Global the function is defined as
+  ljit_fn fn;           // Compiled code, once LJIT_COMPILED
+  void* lib;            // Shared object holding it
+  ljit_guard* guards;
+  int nguards;
+};
+
+/* A top-level form of a program compiled ahead of time (see compile.c) */
+typedef struct {
+  lval* (*build)(void);   // Constructs the form
+  char* name;             // Function it defines with a translation, or NULL
+  const char* id;         // Name of the translation
+  ljit_fn fn;             // Its entry point
+  unsigned long hash;     // Hash of the translation (see ljit_preload)
+} lcomp_form;
+
+/* Output Buffer Structure */
+#define LBUF_SIZE 65536
+
+typedef struct lbuf {
+  char* data;     // Backing memory (NULL when only counting)
+  size_t len;     // Bytes written so far
+  size_t cap;     // Capacity of the backing memory
+  FILE* sink;     // Stream flushed to when full, NULL for in-memory
+  int grow;       // In-memory buffer that reallocates instead of truncating
+} lbuf;
+
+/* Rope: immutable string shared between copies */
+struct lrope {
+  int refs;       // Number of lvals and parent ropes holding it
+  int depth;      // Height of the concatenation tree, 0 for leaves
+  size_t len;     // Length in bytes
+  char* data;     // Leaf bytes (owned unless this is a slice)
+  char* flat;     // Cached flattening of a concatenation
+  lrope* left;    // Concatenation children, NULL for leaves
+  lrope* right;
+  lrope* base;    // Leaf whose bytes a slice points into
 };
 
+/* String Builder: mutable buffer shared between copies */
+struct lsbuf {
+  int refs;       // Number of lvals holding it
+  lbuf buf;       // Growable in-memory buffer
+};
+
+/* File Handle (shared between copies) */
+struct lfile {
+  int refs;       // Number of lvals holding it
+  FILE* fp;       // Open stream, NULL once closed
+  char* path;     // Path it was opened with
+  int writing;    // Opened for writing or appending
+  char* buf;      // Block buffer for reading or writing
+  size_t cap;     // Size of buf
+  size_t pos;     // Next unread byte
+  size_t end;     // End of the bytes read into buf
+  int eof;        // No more data to read
+  lbuf out;       // Writer flushing buf to fp
+};
+
+/* Task: a function call run as a coroutine (shared between copies) */
+struct ltask {
+  int refs;       // Number of lvals and the run queue holding it
+  long id;        // Spawn order, for printing
+  int started;    // Has run at least once
+  int done;       // Finished; result is set
+  lval* fn;       // Function to call
+  lval* args;     // Arguments S-expression
+  lval* result;   // Return value once done
+  ucontext_t uc;  // Saved registers while suspended
+  char* sp;       // Lowest address of the saved stack image
+  char* saved;    // Stack image while suspended
+  size_t saved_len;
+  size_t saved_cap;
+  ltask* next;    // Next task in the run queue
+  ltask* waiting; // Task this one is awaiting, NULL if none
+};
+
+/* Lazy sequence (immutable, shared between copies; see seq.c) */
+enum { LSEQ_RANGE, LSEQ_LIST, LSEQ_ITERATE, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE };
+
+struct lseq {
+  int refs;       // Number of lvals and sequences holding it
+  int kind;
+  long start;     // LSEQ_RANGE: first element, bound (excluded) and step
+  long end;
+  long step;
+  long n;         // LSEQ_TAKE: elements taken
+  lval* fn;       // LSEQ_ITERATE, LSEQ_MAP, LSEQ_FILTER: the function
+  lval* init;     // LSEQ_ITERATE: first element; LSEQ_LIST: the Q-expression
+  lseq* src;      // LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE: sequence consumed
+};
+
+/* Position in a sequence being consumed, one per stage */
+typedef struct lseq_iter {
+  lseq* seq;
+  long i;         // Next Number of a range, index in a list, or left to take
+  lval* cur;      // Element an iterate produced last
+  struct lseq_iter* src;
+} lseq_iter;
+
+/* Cooperative scheduler of one context */
+struct lsched {
+  ucontext_t root;    // Context of the code that started the scheduler
+  char* stack;        // Stack shared by every task, one at a time
+  size_t stack_size;
+  ltask* current;     // Task running on the stack, NULL at the root
+  ltask* head;        // Run queue of started and pending tasks
+  ltask* tail;
+  long count;         // Tasks in the run queue
+  long spawned;       // Tasks created so far
+  pthread_t owner;    // Thread the scheduler belongs to
+};
+
+/* Interpreter Counters, shared by all contexts and threads */
+typedef struct {
+  long allocs;        // lvals allocated
+  long frees;         // lvals freed
+  long live;          // lvals allocated and not yet freed
+  long peak;          // Highest value of live (per thread; see stats.c)
+  long copies;        // lval_copy calls, including nested ones
+  long copy_bytes;    // Bytes allocated by lval_copy
+  long lookups;       // lenv_get calls
+  long lookup_depth;  // Environments searched by lenv_get
+  long cache_hits;    // Root lookups answered by an inline cache
+  long cache_misses;  // Root lookups that searched the root
+  long calls;         // lval_call calls
+  long fast_hits;     // Builtin calls taken by their fast path
+  long fast_misses;   // Calls of builtins with a fast path that it declined
+} lstats;
+
+/* Counters of the calling thread, registered on first use. Each thread
+   only adds to its own, without locked instructions; readers sum them. */
+extern __thread lstats* lstats_mine __attribute__((tls_model("initial-exec")));
+lstats* lstats_register(void);
+#define LSTATS_MINE() (lstats_mine ? lstats_mine : lstats_register())
+
+#define LSTAT_ADD(field, n) do { \
+    lstats* lstat_ = LSTATS_MINE(); \
+    __atomic_store_n(&lstat_->field, lstat_->field + (n), __ATOMIC_RELAXED); \
+  } while (0)
+
 /* Lisp Environment Structure */
 struct lenv {
   lenv* par;      // Parent environment
+  int refs;       // Owner plus closures and scopes holding it (lexical scope)
+  int owned;      // Not yet deleted by its owner
+  int holds_par;  // par is a counted reference
   int count;      // Number of symbol-value pairs
+  int cap;        // Room in syms and vals
+  int frame;      // Part of an lframe rather than allocated
+  int specials;   // Bindings of special form names, see lenv_shadowed
+  int frozen;     // Snapshot shared by a parallel job; no definitions (pool.c)
+  unsigned long id; // Identifies a root for inline caches, 0 until used
   char** syms;    // Array of symbols
   lval** vals;    // Array of corresponding values
 };
 
-/* External Parser Reference (defined in main.c) */
-extern mpc_parser_t* Number;
-extern mpc_parser_t* Symbol;
-extern mpc_parser_t* String;
-extern mpc_parser_t* Comment;
-extern mpc_parser_t* Sexpr;
-extern mpc_parser_t* Qexpr;
-extern mpc_parser_t* Expr;
-extern mpc_parser_t* Lispy;
+/* Bindings an lframe holds before it needs heap memory */
+#define LFRAME_SLOTS 8
+
+/* Environment for a local scope, living on the evaluator's C stack.
+   Used by let forms outside lexical scope, where nothing can refer to it
+   once the scope is left. */
+typedef struct {
+  lenv env;
+  char* syms[LFRAME_SLOTS];
+  lval* vals[LFRAME_SLOTS];
+} lframe;
+
+/* Interpreter Context: everything one independent interpreter owns.
+   Each thread may run its own context. What contexts do share is
+   process-wide and locked or atomic: the regex cache, the thread pool,
+   the statistics counters, the profiler and the source of environment
+   ids. */
+struct lctx {
+  /* Parsers */
+  mpc_parser_t* number;
+  mpc_parser_t* symbol;
+  mpc_parser_t* string;
+  mpc_parser_t* comment;
+  mpc_parser_t* sexpr;
+  mpc_parser_t* qexpr;
+  mpc_parser_t* expr;
+  mpc_parser_t* lispy;
+
+  lenv* env;                  // Root environment with the builtins
+  lsched* sched;              // Task scheduler, created on first spawn
+  int lexical;                // New lambdas close over their scope
+  unsigned specials_rebound;  // Special forms whose name was bound again at the root
+  unsigned long rebinds;      // Builtins and special forms bound again at the root
+  int jit;                    // Compile hot global functions
+
+  /* Allocator for values and environments, see lctx_new_with */
+  void* (*alloc)(size_t size);
+  void* (*realloc)(void* ptr, size_t size);
+  void (*free)(void* ptr);
+  long bytes;                 // Bytes allocated through lalloc and in use
+  long quota;                 // Limit on bytes, or 0
+  int out_of_memory;          // The quota has been exceeded
+  int alloc_failed;           // The system refused an allocation
+  int nesting;                // Top-level evaluations in progress, see lctx_begin
+
+  /* Evaluation limits, see lctx_limit */
+  int limited;                // A limit is set or an allocation failed
+  int has_fuel;
+  long fuel;                  // Evaluation steps left
+  double deadline;            // Monotonic time in seconds to stop at, or 0
+  int expired;                // The deadline has passed
+};
+
+/* Context Functions */
+lctx* lctx_new(void);
+lctx* lctx_new_with(void* (*alloc)(size_t), void* (*re)(void*, size_t), void (*release)(void*));
+void lctx_del(lctx* c);
+lctx* lctx_current(void);
+lctx* lctx_enter(lctx* c);
+lctx* lctx_begin(lctx* c);
+void lctx_end(lctx* c, lctx* prev);
+void lctx_relimit(lctx* c);
+lval* lctx_eval_string(lctx* c, char* name, char* input);
+lval* lctx_load(lctx* c, char* path);
+void lctx_limit(lctx* c, long steps, long ms);
+void lctx_quota(lctx* c, long bytes);
+lval* lctx_check(void);
+void* lalloc(size_t size);
+void* lrealloc(void* ptr, size_t size);
+void* lrealloc_try(void* ptr, size_t size);
+void lfree(void* ptr);
+char* lstrdup(const char* s);
 
 /* lval Creation Functions */
 lval* lval_num(long x);
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* s);
 lval* lval_str(char* s);
+lval* lval_str_n(const char* s, size_t n);
+lval* lval_str_alloc(size_t n);
+lval* lval_regex(lregex* re);
+lval* lval_rope(lrope* r);
+lval* lval_sbuf(lsbuf* sb);
+lval* lval_file(lfile* f);
+lval* lval_task(ltask* t);
+lval* lval_seq(lseq* s);
 lval* lval_builtin(lbuiltin func);
 lval* lval_lambda(lval* formals, lval* body);
+lval* lval_close(lval* f, lenv* e);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
 
@@ -82,9 +412,22 @@ lval* lval_copy(lval* v);
 void lval_del(lval* v);
 
 /* lval Printing Functions */
+void lval_write(lbuf* b, lval* v);
+void lval_write_text(lbuf* b, lval* v);
 void lval_print(lval* v);
 void lval_println(lval* v);
 
+/* Output Buffer Functions */
+void lbuf_init(lbuf* b, char* data, size_t cap, FILE* sink);
+void lbuf_init_grow(lbuf* b, size_t cap);
+void lbuf_flush(lbuf* b);
+void lbuf_write(lbuf* b, const char* s, size_t n);
+void lbuf_putc(lbuf* b, char c);
+void lbuf_puts(lbuf* b, const char* s);
+void lbuf_num(lbuf* b, long x);
+void lbuf_escape(lbuf* b, const char* s, size_t n);
+lbuf* lbuf_stdout(void);
+
 /* lval Utility Functions */
 int lval_eq(lval* x, lval* y);
 char* ltype_name(int t);
@@ -92,13 +435,104 @@ char* ltype_name(int t);
 /* lenv Functions */
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
+lenv* lenv_retain(lenv* e);
+void lenv_release(lenv* e);
+void lenv_link(lenv* e, lenv* par);
+lenv* lenv_root(lenv* e);
+int lenv_shadowed(lenv* e, char* sym);
+lcache* lcache_new(void);
+void lcache_release(lcache* c);
 lenv* lenv_copy(lenv* e);
+lenv* lenv_freeze(lenv* e);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
+void lenv_bind(lenv* e, char* sym, lval* v);
+lenv* lframe_init(lframe* f, lenv* par);
+
+/* Regular Expression Functions */
+lregex* lregex_compile(char* src);
+lregex* lregex_cached(char* src);
+void lregex_release(lregex* re);
+void lregex_cache_clear(void);
+
+/* Rope and String Builder Functions */
+lrope* lrope_leaf(char* data, size_t len);
+lrope* lrope_cat(lrope* l, lrope* r);
+lrope* lrope_slice(lrope* r, size_t start, size_t n);
+char* lrope_flatten(lrope* r);
+void lrope_write(lbuf* b, lrope* r);
+void lrope_release(lrope* r);
+void lsbuf_release(lsbuf* sb);
+
+/* File Functions */
+lfile* lfile_open(char* path, char* mode);
+lval* lfile_read_line(lfile* f);
+void lfile_close(lfile* f);
+void lfile_release(lfile* f);
+
+/* Counter Functions */
+void lstats_get(lstats* out);
+void lstats_print(FILE* f);
+
+/* Profiler Functions */
+extern int lprof_on;
+const char* lprof_intern(const char* name);
+void lprof_push(const char* name);
+void lprof_pop(void);
+int lprof_depth(void);
+void lprof_set_depth(int depth);
+void lprof_start(char* path);
+void lprof_stop(void);
+
+/* Task Functions */
+void ltask_release(ltask* t);
+void lsched_run(lsched* s);
+void lsched_del(lsched* s);
+
+/* Sequence Functions */
+void lseq_release(lseq* s);
+lseq_iter* lseq_begin(lseq* s);
+lval* lseq_next(lenv* e, lseq_iter* it);
+void lseq_end(lseq_iter* it);
+
+/* Thread Pool Functions */
+typedef void (*lpool_fn)(void* data, long chunk, int slot);
+int lpool_size(void);
+int lpool_in_worker(void);
+int lpool_in_job(void);
+void lpool_run(long chunks, lpool_fn fn, void* data);
+void lpool_shutdown(void);
+
+/* Assertion Macros for Builtins */
+#define LASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { \
+    lval* err = lval_err(fmt, ##__VA_ARGS__); \
+    lval_del(args); \
+    return err; \
+  }
+
+#define LASSERT_TYPE(func, args, index, expect) \
+  LASSERT(args, args->cell[index]->type == expect, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+
+#define LASSERT_NUM(func, args, num) \
+  LASSERT(args, args->count == num, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+    func, args->count, num)
+
+#define LASSERT_NOT_EMPTY(func, args, index) \
+  LASSERT(args, args->cell[index]->count != 0, \
+    "Function '%s' passed {} for argument %i.", func, index)
+
+/* String Functions */
+long lstr_find(const char* s, size_t n, const char* pat, size_t m, size_t from);
 
 /* Builtin Functions */
 lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_fun(lenv* e, lval* a);
+lval* builtin_lexical(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
 lval* builtin_head(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
@@ -123,15 +557,72 @@ lval* builtin_ne(lenv* e, lval* a);
 lval* builtin_if(lenv* e, lval* a);
 lval* builtin_load(lenv* e, lval* a);
 lval* builtin_print(lenv* e, lval* a);
+lval* builtin_to_string(lenv* e, lval* a);
 lval* builtin_error(lenv* e, lval* a);
+lval* builtin_str_len(lenv* e, lval* a);
+lval* builtin_str_cat(lenv* e, lval* a);
+lval* builtin_substr(lenv* e, lval* a);
+lval* builtin_str_split(lenv* e, lval* a);
+lval* builtin_str_join(lenv* e, lval* a);
+lval* builtin_str_to_num(lenv* e, lval* a);
+lval* builtin_num_to_str(lenv* e, lval* a);
+lval* builtin_rope(lenv* e, lval* a);
+lval* builtin_rope_slice(lenv* e, lval* a);
+lval* builtin_rope_len(lenv* e, lval* a);
+lval* builtin_rope_to_str(lenv* e, lval* a);
+lval* builtin_string_builder(lenv* e, lval* a);
+lval* builtin_append(lenv* e, lval* a);
+lval* builtin_open(lenv* e, lval* a);
+lval* builtin_read_line(lenv* e, lval* a);
+lval* builtin_read_all(lenv* e, lval* a);
+lval* builtin_write(lenv* e, lval* a);
+lval* builtin_close(lenv* e, lval* a);
+lval* builtin_for_each_line(lenv* e, lval* a);
+lval* builtin_re_compile(lenv* e, lval* a);
+lval* builtin_re_match(lenv* e, lval* a);
+lval* builtin_re_find_all(lenv* e, lval* a);
+lval* builtin_re_split(lenv* e, lval* a);
+lval* builtin_pmap(lenv* e, lval* a);
+lval* builtin_pfilter(lenv* e, lval* a);
+lval* builtin_preduce(lenv* e, lval* a);
+lval* builtin_spawn(lenv* e, lval* a);
+lval* builtin_await(lenv* e, lval* a);
+lval* builtin_yield(lenv* e, lval* a);
+lval* builtin_range(lenv* e, lval* a);
+lval* builtin_iterate(lenv* e, lval* a);
+lval* builtin_lazy_map(lenv* e, lval* a);
+lval* builtin_lazy_filter(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+lval* builtin_realize(lenv* e, lval* a);
+lval* builtin_stats(lenv* e, lval* a);
+lval* builtin_limit(lenv* e, lval* a);
+lval* builtin_quota(lenv* e, lval* a);
 
 /* Add all builtins to the environment */
 void lenv_add_builtins(lenv* e);
 
 /* Evaluation Functions */
+lspecial lspecial_find(char* sym);
+lspecial lspecial_get(lenv* e, char* sym);
+void lspecial_rebound(char* sym);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_optimize(lenv* e, lval* f);
+lval* lopt_body(lenv* e, lval* f);
+void lorig_release(lorig* o);
+
+/* JIT Functions */
+void ljit_attach(lval* f, lenv* e, char* name);
+void ljit_release(ljit* j);
+lval* ljit_call(lenv* e, lval* f, lval* a);
+int ljit_emit_c(lenv* root, char* name, const char* id, lbuf* out, unsigned long* hash);
+void ljit_preload(lenv* e, char* name, const char* id, ljit_fn fn, unsigned long hash);
+
+/* Ahead-of-time Compilation Functions */
+lval* lcomp_list(int type, int n, ...);
+int lcomp_run(const lcomp_form* forms, int count);
+int lcomp_compile(lctx* c, char** files, int count, const char* path);
 
 /* Reading Functions */
 lval* lval_read(mpc_ast_t* t);
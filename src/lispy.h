@@ -0,0 +1,82 @@
+// File: lispy.h
+#ifndef LISPY_H
+#define LISPY_H
+
+/*
+ * Public interface for embedding the interpreter.
+ *
+ * Each lispy context is an independent interpreter. Different contexts can
+ * be used from different threads at the same time, and any function may be
+ * called again from inside a builtin (for example to evaluate a nested
+ * expression). One context must not be used by two threads at once.
+ *
+ * Values are owned by the caller unless a function says it consumes them.
+ * Free owned values with lispy_val_free on the context that created them.
+ */
+
+#include <stddef.h>
+
+/* Marks the functions liblispy.so exports; the rest of it is hidden */
+#if defined(__GNUC__)
+#define LISPY_API __attribute__((visibility("default")))
+#else
+#define LISPY_API
+#endif
+
+/* Opaque Types */
+typedef struct lctx lispy;
+typedef struct lval lispy_val;
+typedef struct lenv lispy_env;
+
+/* Native builtin: receives its evaluated arguments as a list it owns and
+   must free, and returns a new value (use lispy_error to fail) */
+typedef lispy_val* (*lispy_builtin)(lispy_env* env, lispy_val* args);
+
+/* Optional fast path of a native builtin, called directly with two number
+   arguments; store the result and return 1, or return 0 to fall back to
+   the generic builtin (e.g. to report an error) */
+typedef int (*lispy_fast)(long x, long y, long* out);
+
+/* Value Types */
+enum { LISPY_ERR, LISPY_NUM, LISPY_SYM, LISPY_STR, LISPY_FUN, LISPY_SEXPR,
+       LISPY_QEXPR, LISPY_OTHER };
+
+/* Contexts */
+LISPY_API lispy* lispy_new(void);
+LISPY_API lispy* lispy_new_with_allocator(void* (*alloc)(size_t size),
+                                          void* (*realloc)(void* ptr, size_t size),
+                                          void (*free)(void* ptr));
+LISPY_API void lispy_free(lispy* c);
+LISPY_API lispy* lispy_current(void);
+
+/* Evaluation */
+LISPY_API lispy_val* lispy_eval(lispy* c, const char* src);
+LISPY_API lispy_val* lispy_load(lispy* c, const char* path);
+LISPY_API lispy_val* lispy_call(lispy* c, const char* name, int argc, lispy_val** argv);
+LISPY_API lispy_val* lispy_get(lispy* c, const char* name);
+LISPY_API void lispy_def(lispy* c, const char* name, lispy_val* v);
+LISPY_API void lispy_register(lispy* c, const char* name, lispy_builtin fn);
+LISPY_API void lispy_register_fast(lispy* c, const char* name, lispy_builtin fn, lispy_fast fast);
+LISPY_API void lispy_limit(lispy* c, long steps, long ms);
+LISPY_API void lispy_quota(lispy* c, long bytes);
+LISPY_API long lispy_memory(lispy* c);
+
+/* Creating Values */
+LISPY_API lispy_val* lispy_num(lispy* c, long x);
+LISPY_API lispy_val* lispy_str(lispy* c, const char* s);
+LISPY_API lispy_val* lispy_str_n(lispy* c, const char* s, size_t n);
+LISPY_API lispy_val* lispy_error(lispy* c, const char* msg);
+LISPY_API lispy_val* lispy_list(lispy* c);
+LISPY_API lispy_val* lispy_push(lispy* c, lispy_val* list, lispy_val* v);
+LISPY_API lispy_val* lispy_copy(lispy* c, lispy_val* v);
+LISPY_API void lispy_val_free(lispy* c, lispy_val* v);
+
+/* Inspecting Values */
+LISPY_API int lispy_type(lispy_val* v);
+LISPY_API long lispy_to_num(lispy_val* v);
+LISPY_API const char* lispy_to_str(lispy_val* v, size_t* len);
+LISPY_API int lispy_count(lispy_val* v);
+LISPY_API lispy_val* lispy_item(lispy_val* v, int i);
+LISPY_API char* lispy_to_string(lispy_val* v);
+
+#endif // LISPY_H
@@ -5,13 +5,36 @@
 #include <string.h>
 #include <stdarg.h>
 
+/**
+ * Allocate an lval, updating the allocation counters.
+ * @return The uninitialized lval.
+ */
+static lval* lval_alloc(void) {
+  lstats* s = LSTATS_MINE();
+  long live = s->live + 1;
+  __atomic_store_n(&s->allocs, s->allocs + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->live, live, __ATOMIC_RELAXED);
+  if (live > s->peak) __atomic_store_n(&s->peak, live, __ATOMIC_RELAXED);
+  return lalloc(sizeof(lval));
+}
+
+/**
+ * Free an lval allocated with lval_alloc.
+ * @param v The lval, whose contents have been released.
+ */
+static void lval_free(lval* v) {
+  LSTAT_ADD(frees, 1);
+  LSTAT_ADD(live, -1);
+  lfree(v);
+}
+
 /**
  * Create a new lval representing a number.
  * @param x The numeric value.
  * @return Pointer to the new lval.
  */
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_NUM;
   v->num = x;
   return v;
@@ -24,13 +47,13 @@ lval* lval_num(long x) {
  * @return Pointer to the new lval error.
  */
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_ERR;
   va_list va;
   va_start(va, fmt);
-  v->err = malloc(512);
+  v->err = lalloc(512);
   vsnprintf(v->err, 511, fmt, va);
-  v->err = realloc(v->err, strlen(v->err) + 1);
+  v->err = lrealloc(v->err, strlen(v->err) + 1);
   va_end(va);
   return v;
 }
@@ -41,10 +64,11 @@ lval* lval_err(char* fmt, ...) {
  * @return Pointer to the new lval.
  */
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
+  v->sym = lalloc(strlen(s) + 1);
   strcpy(v->sym, s);
+  v->cache = NULL;
   return v;
 }
 
@@ -54,10 +78,105 @@ lval* lval_sym(char* s) {
  * @return Pointer to the new lval.
  */
 lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
+  return lval_str_n(s, strlen(s));
+}
+
+/**
+ * Create a new lval representing a string of known length.
+ * @param s The string bytes (may contain NUL).
+ * @param n Number of bytes.
+ * @return Pointer to the new lval.
+ */
+lval* lval_str_n(const char* s, size_t n) {
+  lval* v = lval_str_alloc(n);
+  memcpy(v->str, s, n);
+  return v;
+}
+
+/**
+ * Create a new string lval with room for n characters.
+ * The caller fills in the characters; the terminator is already set.
+ * @param n Length of the string.
+ * @return Pointer to the new lval.
+ */
+lval* lval_str_alloc(size_t n) {
+  lval* v = lval_alloc();
   v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+  v->str = lalloc(n + 1);
+  v->str[n] = '\0';
+  v->len = n;
+  return v;
+}
+
+/**
+ * Create a new lval holding a compiled regular expression.
+ * @param re The pattern; the lval takes over the caller's reference.
+ * @return Pointer to the new lval.
+ */
+lval* lval_regex(lregex* re) {
+  lval* v = lval_alloc();
+  v->type = LVAL_REGEX;
+  v->regex = re;
+  return v;
+}
+
+/**
+ * Create a new lval holding a rope.
+ * @param r The rope; the lval takes over the caller's reference.
+ * @return Pointer to the new lval.
+ */
+lval* lval_rope(lrope* r) {
+  lval* v = lval_alloc();
+  v->type = LVAL_ROPE;
+  v->rope = r;
+  return v;
+}
+
+/**
+ * Create a new lval holding a string builder.
+ * @param sb The builder; the lval takes over the caller's reference.
+ * @return Pointer to the new lval.
+ */
+lval* lval_sbuf(lsbuf* sb) {
+  lval* v = lval_alloc();
+  v->type = LVAL_SBUF;
+  v->sbuf = sb;
+  return v;
+}
+
+/**
+ * Create a new lval holding a file handle.
+ * @param f The handle; the lval takes over the caller's reference.
+ * @return Pointer to the new lval.
+ */
+lval* lval_file(lfile* f) {
+  lval* v = lval_alloc();
+  v->type = LVAL_FILE;
+  v->file = f;
+  return v;
+}
+
+/**
+ * Create a new lval holding a task.
+ * @param t The task; the lval takes over the caller's reference.
+ * @return Pointer to the new lval.
+ */
+lval* lval_task(ltask* t) {
+  lval* v = lval_alloc();
+  v->type = LVAL_TASK;
+  v->task = t;
+  return v;
+}
+
+/**
+ * Create a new lval holding a lazy sequence.
+ * @param s The sequence; the lval takes over the caller's reference.
+ * @return Pointer to the new lval.
+ */
+lval* lval_seq(lseq* s) {
+  lval* v = lval_alloc();
+  v->type = LVAL_SEQ;
+  v->seq = s;
   return v;
 }
 
@@ -67,9 +186,11 @@ lval* lval_str(char* s) {
  * @return Pointer to the new lval.
  */
 lval* lval_builtin(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = func;
+  v->fast = NULL;
+  v->fold = 0;
   return v;
 }
 
@@ -80,21 +201,43 @@ lval* lval_builtin(lbuiltin func) {
  * @return Pointer to the new lval.
  */
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = NULL;
+  v->fast = NULL;
   v->env = lenv_new();
   v->formals = formals;
   v->body = body;
+  v->lexical = 0;
+  v->closure = NULL;
+  v->jit = NULL;
+  v->orig = NULL;
   return v;
 }
 
+/**
+ * Make a new lambda close over the environment it is created in, when the
+ * current context uses lexical scope. Its free symbols then resolve in
+ * that environment rather than in the caller's.
+ * @param f The lambda.
+ * @param e The environment it is created in.
+ * @return f.
+ */
+lval* lval_close(lval* f, lenv* e) {
+  lctx* c = lctx_current();
+  if (c && c->lexical) {
+    f->lexical = 1;
+    f->closure = lenv_retain(e);
+  }
+  return f;
+}
+
 /**
  * Create a new empty S-expression lval.
  * @return Pointer to the new lval.
  */
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
@@ -106,7 +249,7 @@ lval* lval_sexpr(void) {
  * @return Pointer to the new lval.
  */
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
@@ -125,20 +268,32 @@ void lval_del(lval* v) {
         lenv_del(v->env);
         lval_del(v->formals);
         lval_del(v->body);
+        if (v->closure) lenv_release(v->closure);
+        if (v->jit) ljit_release(v->jit);
+        if (v->orig) lorig_release(v->orig);
       }
       break;
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
+    case LVAL_ERR: lfree(v->err); break;
+    case LVAL_SYM:
+      lfree(v->sym);
+      if (v->cache) lcache_release(v->cache);
+      break;
+    case LVAL_STR: lfree(v->str); break;
+    case LVAL_REGEX: lregex_release(v->regex); break;
+    case LVAL_ROPE: lrope_release(v->rope); break;
+    case LVAL_SBUF: lsbuf_release(v->sbuf); break;
+    case LVAL_FILE: lfile_release(v->file); break;
+    case LVAL_TASK: ltask_release(v->task); break;
+    case LVAL_SEQ: lseq_release(v->seq); break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       for (int i = 0; i < v->count; i++) {
         lval_del(v->cell[i]);
       }
-      free(v->cell);
+      lfree(v->cell);
       break;
   }
-  free(v);
+  lval_free(v);
 }
 
 /**
@@ -147,36 +302,79 @@ void lval_del(lval* v) {
  * @return Pointer to the copied lval.
  */
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
+  lval* x = lval_alloc();
+  LSTAT_ADD(copies, 1);
+  LSTAT_ADD(copy_bytes, sizeof(lval));
   x->type = v->type;
   switch (v->type) {
     case LVAL_FUN:
       if (v->builtin) {
         x->builtin = v->builtin;
+        x->fast = v->fast;
+        x->fold = v->fold;
       } else {
         x->builtin = NULL;
+        x->fast = NULL;
         x->env = lenv_copy(v->env);
         x->formals = lval_copy(v->formals);
         x->body = lval_copy(v->body);
+        x->lexical = v->lexical;
+        x->closure = v->closure;
+        if (x->closure) LREF_INC(x->closure);
+        x->jit = v->jit;
+        if (x->jit) LREF_INC(x->jit);
+        x->orig = v->orig;
+        if (x->orig) LREF_INC(x->orig);
       }
       break;
     case LVAL_NUM: x->num = v->num; break;
     case LVAL_ERR:
-      x->err = malloc(strlen(v->err) + 1);
+      x->err = lalloc(strlen(v->err) + 1);
       strcpy(x->err, v->err);
+      LSTAT_ADD(copy_bytes, strlen(v->err) + 1);
       break;
     case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
+      x->sym = lalloc(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym);
+      LSTAT_ADD(copy_bytes, strlen(v->sym) + 1);
+      x->cache = v->cache;
+      if (x->cache) LREF_INC(x->cache);
       break;
     case LVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str);
+      x->str = lalloc(v->len + 1);
+      memcpy(x->str, v->str, v->len + 1);
+      x->len = v->len;
+      LSTAT_ADD(copy_bytes, v->len + 1);
+      break;
+    case LVAL_REGEX:
+      x->regex = v->regex;
+      LREF_INC(x->regex);
+      break;
+    case LVAL_ROPE:
+      x->rope = v->rope;
+      LREF_INC(x->rope);
+      break;
+    case LVAL_SBUF:
+      x->sbuf = v->sbuf;
+      LREF_INC(x->sbuf);
+      break;
+    case LVAL_FILE:
+      x->file = v->file;
+      LREF_INC(x->file);
+      break;
+    case LVAL_TASK:
+      x->task = v->task;
+      LREF_INC(x->task);
+      break;
+    case LVAL_SEQ:
+      x->seq = v->seq;
+      LREF_INC(x->seq);
       break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
+      x->cell = lalloc(sizeof(lval*) * x->count);
+      LSTAT_ADD(copy_bytes, sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
       }
@@ -193,7 +391,7 @@ lval* lval_copy(lval* v) {
  */
 lval* lval_add(lval* v, lval* x) {
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell = lrealloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count - 1] = x;
   return v;
 }
@@ -208,8 +406,8 @@ lval* lval_join(lval* x, lval* y) {
   for (int i = 0; i < y->count; i++) {
     x = lval_add(x, y->cell[i]);
   }
-  free(y->cell);
-  free(y);
+  lfree(y->cell);
+  lval_free(y);
   return x;
 }
 
@@ -223,7 +421,7 @@ lval* lval_pop(lval* v, int i) {
   lval* x = v->cell[i];
   memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
   v->count--;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell = lrealloc(v->cell, sizeof(lval*) * v->count);
   return x;
 }
 
@@ -240,67 +438,115 @@ lval* lval_take(lval* v, int i) {
 }
 
 /**
- * Print an expression lval with open/close delimiters.
+ * Write an expression lval with open/close delimiters.
+ * @param b The output buffer.
  * @param v The expression.
  * @param open Opening character.
  * @param close Closing character.
  */
-static void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
+static void lval_write_expr(lbuf* b, lval* v, char open, char close) {
+  lbuf_putc(b, open);
   for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
+    lval_write(b, v->cell[i]);
     if (i != (v->count - 1)) {
-      putchar(' ');
+      lbuf_putc(b, ' ');
     }
   }
-  putchar(close);
+  lbuf_putc(b, close);
 }
 
 /**
- * Print a string lval with escaping.
- * @param v The string lval.
+ * Write an lval to an output buffer.
+ * @param b The output buffer.
+ * @param v The lval to write.
  */
-static void lval_print_str(lval* v) {
-  char* escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
-  escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
-  free(escaped);
-}
-
-/**
- * Print an lval.
- * @param v The lval to print.
- */
-void lval_print(lval* v) {
+void lval_write(lbuf* b, lval* v) {
   switch (v->type) {
     case LVAL_FUN:
       if (v->builtin) {
-        printf("<builtin>");
+        lbuf_puts(b, "<builtin>");
       } else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
+        lbuf_puts(b, "(\\ ");
+        lval_write(b, v->formals);
+        lbuf_putc(b, ' ');
+        lval_write(b, v->body);
+        lbuf_putc(b, ')');
       }
       break;
-    case LVAL_NUM: printf("%li", v->num); break;
-    case LVAL_ERR: printf("Error: %s", v->err); break;
-    case LVAL_SYM: printf("%s", v->sym); break;
-    case LVAL_STR: lval_print_str(v); break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+    case LVAL_NUM: lbuf_num(b, v->num); break;
+    case LVAL_ERR: lbuf_puts(b, "Error: "); lbuf_puts(b, v->err); break;
+    case LVAL_SYM: lbuf_puts(b, v->sym); break;
+    case LVAL_STR:
+      lbuf_putc(b, '"');
+      lbuf_escape(b, v->str, v->len);
+      lbuf_putc(b, '"');
+      break;
+    case LVAL_REGEX:
+      lbuf_puts(b, "<regex \"");
+      lbuf_escape(b, v->regex->src, strlen(v->regex->src));
+      lbuf_puts(b, "\">");
+      break;
+    case LVAL_ROPE:
+      lbuf_putc(b, '"');
+      lbuf_escape(b, lrope_flatten(v->rope), v->rope->len);
+      lbuf_putc(b, '"');
+      break;
+    case LVAL_SBUF:
+      lbuf_putc(b, '"');
+      lbuf_escape(b, v->sbuf->buf.data, v->sbuf->buf.len);
+      lbuf_putc(b, '"');
+      break;
+    case LVAL_FILE:
+      lbuf_puts(b, v->file->fp ? "<file \"" : "<closed file \"");
+      lbuf_escape(b, v->file->path, strlen(v->file->path));
+      lbuf_puts(b, "\">");
+      break;
+    case LVAL_TASK:
+      lbuf_puts(b, "<task ");
+      lbuf_num(b, v->task->id);
+      lbuf_puts(b, v->task->done ? " done>" : " pending>");
+      break;
+    case LVAL_SEQ: lbuf_puts(b, "<seq>"); break;
+    case LVAL_SEXPR: lval_write_expr(b, v, '(', ')'); break;
+    case LVAL_QEXPR: lval_write_expr(b, v, '{', '}'); break;
   }
 }
 
+/**
+ * Write an lval as plain text.
+ * Strings, ropes and builders are written as their raw bytes, anything
+ * else as print shows it.
+ * @param b The output buffer.
+ * @param v The lval to write.
+ */
+void lval_write_text(lbuf* b, lval* v) {
+  switch (v->type) {
+    case LVAL_STR: lbuf_write(b, v->str, v->len); break;
+    case LVAL_ROPE: lrope_write(b, v->rope); break;
+    case LVAL_SBUF: lbuf_write(b, v->sbuf->buf.data, v->sbuf->buf.len); break;
+    default: lval_write(b, v); break;
+  }
+}
+
+/**
+ * Print an lval.
+ * @param v The lval to print.
+ */
+void lval_print(lval* v) {
+  lbuf* out = lbuf_stdout();
+  lval_write(out, v);
+  lbuf_flush(out);
+}
+
 /**
  * Print an lval followed by a newline.
  * @param v The lval to print.
  */
 void lval_println(lval* v) {
-  lval_print(v);
-  putchar('\n');
+  lbuf* out = lbuf_stdout();
+  lval_write(out, v);
+  lbuf_putc(out, '\n');
+  lbuf_flush(out);
 }
 
 /**
@@ -315,7 +561,17 @@ int lval_eq(lval* x, lval* y) {
     case LVAL_NUM: return (x->num == y->num);
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
     case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    case LVAL_STR: return (x->len == y->len && memcmp(x->str, y->str, x->len) == 0);
+    case LVAL_REGEX: return (strcmp(x->regex->src, y->regex->src) == 0);
+    case LVAL_ROPE:
+      return (x->rope->len == y->rope->len &&
+              memcmp(lrope_flatten(x->rope), lrope_flatten(y->rope), x->rope->len) == 0);
+    case LVAL_SBUF:
+      return (x->sbuf->buf.len == y->sbuf->buf.len &&
+              memcmp(x->sbuf->buf.data, y->sbuf->buf.data, x->sbuf->buf.len) == 0);
+    case LVAL_FILE: return (x->file == y->file);
+    case LVAL_TASK: return (x->task == y->task);
+    case LVAL_SEQ: return (x->seq == y->seq);
     case LVAL_FUN:
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
@@ -347,6 +603,12 @@ char* ltype_name(int t) {
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_REGEX: return "Regex";
+    case LVAL_ROPE: return "Rope";
+    case LVAL_SBUF: return "String Builder";
+    case LVAL_FILE: return "File";
+    case LVAL_TASK: return "Task";
+    case LVAL_SEQ: return "Sequence";
     default: return "Unknown";
   }
 }
\ No newline at end of file
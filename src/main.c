@@ -2,6 +2,7 @@
 #include "lisp.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
 static char buffer[2048];
@@ -26,46 +27,69 @@ char* readline(char* prompt) {
 void add_history(char* unused) {}
 #endif
 
-/* Global Parser Definitions */
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
-
 /**
  * Main entry point.
  * Handles interactive REPL or file loading.
+ * Options: --profile=FILE samples Lisp function calls and writes the
+ * collapsed stacks to FILE at exit; --stats prints the interpreter
+ * counters at exit; --fuel=N and --timeout=MS limit the evaluation steps
+ * and time of the whole run, and --quota=BYTES the memory it may use;
+ * --lexical gives every lambda lexical scope, as (lexical 1) does;
+ * --jit compiles hot functions to native code. With --compile the files
+ * are not run but compiled to the C program given by -o FILE instead.
  */
 int main(int argc, char** argv) {
-  /* Create Parsers */
-  Number = mpc_new("number");
-  Symbol = mpc_new("symbol");
-  String = mpc_new("string");
-  Comment = mpc_new("comment");
-  Sexpr = mpc_new("sexpr");
-  Qexpr = mpc_new("qexpr");
-  Expr = mpc_new("expr");
-  Lispy = mpc_new("lispy");
+  /* Handle options, keeping the file arguments */
+  int files = 1;
+  int stats = 0;
+  long fuel = 0;
+  long timeout = 0;
+  long quota = 0;
+  int lexical = 0;
+  int jit = 0;
+  int compile = 0;
+  char* output = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--profile=", 10) == 0) {
+      lprof_start(argv[i] + 10);
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
+    } else if (strncmp(argv[i], "--fuel=", 7) == 0) {
+      fuel = atol(argv[i] + 7);
+    } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+      timeout = atol(argv[i] + 10);
+    } else if (strncmp(argv[i], "--quota=", 8) == 0) {
+      quota = atol(argv[i] + 8);
+    } else if (strcmp(argv[i], "--lexical") == 0) {
+      lexical = 1;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      jit = 1;
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compile = 1;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      argv[files++] = argv[i];
+    }
+  }
+  argc = files;
 
-  /* Define Language Grammar */
-  mpca_lang(MPCA_LANG_DEFAULT,
-            "number  : /-?[0-9]+/ ; "
-            "symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; "
-            "string  : /\"(\\\\.|[^\"])*\"/ ; "
-            "comment : /;[^\\r\\n]*/ ; "
-            "sexpr   : '(' <expr>* ')' ; "
-            "qexpr   : '{' <expr>* '}' ; "
-            "expr    : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; "
-            "lispy   : /^/ <expr>* /$/ ;",
-            Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  /* Create Interpreter */
+  lctx* c = lctx_new();
+  lctx_enter(c);
+  lctx_limit(c, fuel, timeout);
+  lctx_quota(c, quota);
+  c->lexical = lexical;
+  c->jit = jit;
 
-  /* Create Environment */
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
+  /* Compilation Mode */
+  if (compile) {
+    int status = 1;
+    if (argc < 2 || !output) fputs("Usage: lispy --compile FILE... -o OUT.c\n", stderr);
+    else status = lcomp_compile(c, argv + 1, argc - 1, output);
+    lctx_del(c);
+    return status;
+  }
 
   /* Interactive REPL Mode */
   if (argc == 1) {
@@ -76,16 +100,9 @@ int main(int argc, char** argv) {
       char* input = readline("lispy> ");
       add_history(input);
 
-      mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
-        lval* x = lval_eval(e, lval_read(r.output));
-        lval_println(x);
-        lval_del(x);
-        mpc_ast_delete(r.output);
-      } else {
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
-      }
+      lval* x = lctx_eval_string(c, "<stdin>", input);
+      lval_println(x);
+      lval_del(x);
       free(input);
     }
   }
@@ -93,15 +110,17 @@ int main(int argc, char** argv) {
   /* File Loading Mode */
   if (argc >= 2) {
     for (int i = 1; i < argc; i++) {
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-      lval* x = builtin_load(e, args);
+      lval* x = lctx_load(c, argv[i]);
       if (x->type == LVAL_ERR) lval_println(x);
       lval_del(x);
     }
   }
 
   /* Cleanup */
-  lenv_del(e);
-  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  lprof_stop();
+  lpool_shutdown();
+  lctx_del(c);
+  lregex_cache_clear();
+  if (stats) lstats_print(stderr);
   return 0;
 }
\ No newline at end of file
@@ -82,6 +82,7 @@ typedef struct {
   mpc_state_t state;
 
   char *string;
+  long length;
   char *buffer;
   FILE *file;
 
@@ -110,7 +111,8 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
@@ -139,8 +141,9 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
   i->state = mpc_state_new();
 
+  i->length = length;
   i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
+  memcpy(i->string, string, length);
   i->string[length] = '\0';
   i->buffer = NULL;
   i->file = NULL;
@@ -429,6 +432,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_STRING) { return i->state.pos >= i->length; }
   return mpc_input_peekc(i) == '\0';
 }
 
@@ -504,14 +508,14 @@ static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return x != '\0' && strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
 static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return x == '\0' || strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -0,0 +1,270 @@
+// File: opt.c
+#include "lisp.h"
+#include <string.h>
+
+/*
+ * Optimizer for the bodies of functions defined at top level. It rewrites
+ * the body once, when the function is defined:
+ *
+ *   - calls of the arithmetic and comparison builtins on Number literals
+ *     are folded, (* 60 60) becoming 3600;
+ *   - (do x) becomes x, and (let {body}) becomes the body when the body
+ *     binds nothing, as the scope would stay empty.
+ *
+ * Builtins are resolved in the root environment at definition time. The
+ * body as written is kept with the names the rewrite relied on, and a call
+ * runs it instead (lopt_body) once any builtin or special form has been
+ * bound again at the root, or when, under dynamic scope, a caller binds
+ * one of those names. Calls of Lisp functions are left alone: their
+ * bodies would see the caller's bindings and miss later redefinitions.
+ * Names the function binds itself (formals, let bindings, targets of =)
+ * are never rewritten, and neither are the bodies of nested lambdas,
+ * which outlive the call that creates them.
+ */
+
+/* State of one optimization */
+typedef struct {
+  lenv* e;        // Root environment functions resolve in
+  lval* bound;    // Names bound by the function, as symbols
+  lval* assumed;  // Names the rewrite relied on, as symbols
+} lopt;
+
+static lval* lopt_expr(lopt* o, lval* v);
+
+/**
+ * Check whether a symbol is one of the names a function binds.
+ */
+static int lopt_bound(lopt* o, char* sym) {
+  for (int i = 0; i < o->bound->count; i++) {
+    if (strcmp(o->bound->cell[i]->sym, sym) == 0) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Record that the rewrite relies on the root meaning of a name.
+ */
+static void lopt_assume(lopt* o, char* sym) {
+  for (int i = 0; i < o->assumed->count; i++) {
+    if (strcmp(o->assumed->cell[i]->sym, sym) == 0) return;
+  }
+  lval_add(o->assumed, lval_sym(sym));
+}
+
+/**
+ * Add every symbol of a list, at any depth, to a list of bound names.
+ */
+static void lopt_bind_all(lval* bound, lval* v) {
+  if (v->type == LVAL_SYM) lval_add(bound, lval_sym(v->sym));
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) return;
+  for (int i = 0; i < v->count; i++) lopt_bind_all(bound, v->cell[i]);
+}
+
+/**
+ * Collect the names an expression may bind locally: formals of the
+ * lambdas in it, let bindings, loop variables and the targets of = and
+ * def. Over-approximating is harmless; it only leaves more calls alone.
+ */
+static void lopt_collect(lval* bound, lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) return;
+  if (v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+    char* h = v->cell[0]->sym;
+    if (strcmp(h, "=") == 0 || strcmp(h, "def") == 0 || strcmp(h, "\\") == 0
+        || strcmp(h, "fun") == 0 || strcmp(h, "lambda") == 0 || strcmp(h, "define") == 0
+        || strcmp(h, "dotimes") == 0 || strcmp(h, "for-each") == 0) {
+      lopt_bind_all(bound, v->cell[1]);
+    }
+    if (strcmp(h, "let") == 0 || strcmp(h, "let*") == 0 || strcmp(h, "letrec") == 0) {
+      lval* binds = v->cell[1];
+      int list = binds->type == LVAL_SEXPR || binds->type == LVAL_QEXPR;
+      for (int i = 0; list && i < binds->count; i++) {
+        lval* b = binds->cell[i];
+        if ((b->type == LVAL_SEXPR || b->type == LVAL_QEXPR) && b->count > 0) {
+          lopt_bind_all(bound, b->cell[0]);
+        }
+      }
+    }
+  }
+  for (int i = 0; i < v->count; i++) lopt_collect(bound, v->cell[i]);
+}
+
+/**
+ * Find the value a call's head symbol names in the root environment.
+ * @return The bound value (not a copy), or NULL.
+ */
+static lval* lopt_lookup(lopt* o, lval* head) {
+  if (head->type != LVAL_SYM || lopt_bound(o, head->sym)) return NULL;
+  for (int i = 0; i < o->e->count; i++) {
+    if (strcmp(o->e->syms[i], head->sym) == 0) return o->e->vals[i];
+  }
+  return NULL;
+}
+
+/**
+ * Check whether a Q-expression argument of a call is code rather than data:
+ * a branch of if, the body of (let {body}) or a clause of select or case.
+ */
+static int lopt_is_code(lval* v, int i) {
+  if (v->cell[0]->type != LVAL_SYM) return 0;
+  char* h = v->cell[0]->sym;
+  if (strcmp(h, "if") == 0) return i == 2 || i == 3;
+  if (strcmp(h, "let") == 0) return i == 1 && v->count == 2;
+  if (strcmp(h, "select") == 0) return i >= 1;
+  if (strcmp(h, "case") == 0) return i >= 2;
+  return 0;
+}
+
+/**
+ * Fold a call of an arithmetic or comparison builtin on Numbers.
+ * @return The Number, or NULL if the call is not foldable or fails.
+ */
+static lval* lopt_fold(lopt* o, lval* f, lval* v) {
+  if (!f->builtin || !f->fast) return NULL;
+  for (int i = 1; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_NUM) return NULL;
+  }
+  lval* args = lval_sexpr();
+  for (int i = 1; i < v->count; i++) lval_add(args, lval_copy(v->cell[i]));
+  lval* x = f->builtin(o->e, args);
+  if (x->type == LVAL_NUM) return x;
+  lval_del(x);
+  return NULL;
+}
+
+/**
+ * Check whether a body may bind names in the scope it runs in.
+ */
+static int lopt_binds(lval* v) {
+  if (v->type == LVAL_SYM) return strcmp(v->sym, "=") == 0;
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) return 0;
+  for (int i = 0; i < v->count; i++) {
+    if (lopt_binds(v->cell[i])) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Optimize a Q-expression that is evaluated as code, keeping it a
+ * Q-expression.
+ */
+static lval* lopt_code(lopt* o, lval* q) {
+  q->type = LVAL_SEXPR;
+  lval* x = lopt_expr(o, q);
+  if (x->type == LVAL_SEXPR) {
+    x->type = LVAL_QEXPR;
+    return x;
+  }
+  return lval_add(lval_qexpr(), x);
+}
+
+/**
+ * Optimize an S-expression in an evaluated position.
+ * @param o The optimization.
+ * @param v The expression, consumed.
+ * @return The optimized expression.
+ */
+static lval* lopt_expr(lopt* o, lval* v) {
+  if (v->count == 0) return v;
+  lval* head = v->cell[0];
+  if (head->type == LVAL_SYM
+      && (strcmp(head->sym, "quote") == 0 || strcmp(head->sym, "\\") == 0
+          || strcmp(head->sym, "fun") == 0 || strcmp(head->sym, "lambda") == 0
+          || strcmp(head->sym, "define") == 0)) {
+    return v;
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    lval* x = v->cell[i];
+    if (x->type == LVAL_SEXPR) v->cell[i] = lopt_expr(o, x);
+    else if (x->type == LVAL_QEXPR && i > 0 && lopt_is_code(v, i)) v->cell[i] = lopt_code(o, x);
+  }
+
+  if (head->type != LVAL_SYM || lopt_bound(o, head->sym)) return v;
+
+  /* Wrappers that add nothing */
+  if (strcmp(head->sym, "do") == 0 && v->count == 2) {
+    lopt_assume(o, "do");
+    lval* x = lval_take(v, 1);
+    return x->type == LVAL_SEXPR ? x : lval_add(lval_sexpr(), x);
+  }
+  if (strcmp(head->sym, "let") == 0 && v->count == 2
+      && v->cell[1]->type == LVAL_QEXPR && !lopt_binds(v->cell[1])) {
+    lopt_assume(o, "let");
+    lval* x = lval_take(v, 1);
+    x->type = LVAL_SEXPR;
+    return x;
+  }
+  if (lspecial_find(head->sym)) return v;
+
+  lval* f = lopt_lookup(o, head);
+  if (!f || f->type != LVAL_FUN) return v;
+
+  lval* x = lopt_fold(o, f, v);
+  if (!x) return v;
+  lopt_assume(o, head->sym);
+  lval_del(v);
+  return x;
+}
+
+/**
+ * Optimize the body of a function being defined.
+ * Only definitions made in a root environment are optimized, so lambdas
+ * created while evaluating are not rewritten again on every evaluation.
+ * @param e The environment the function is defined in.
+ * @param f The function; its body is replaced. Errors pass through.
+ * @return The function.
+ */
+lval* lval_optimize(lenv* e, lval* f) {
+  if (e->par || f->type != LVAL_FUN || f->builtin || f->body->type != LVAL_QEXPR) return f;
+  lopt o = { e, lval_qexpr(), lval_qexpr() };
+  lopt_bind_all(o.bound, f->formals);
+  lopt_collect(o.bound, f->body);
+  lval* body = lval_copy(f->body);
+  f->body = lopt_code(&o, f->body);
+  lval_del(o.bound);
+  if (o.assumed->count == 0) {
+    lval_del(body);
+    lval_del(o.assumed);
+    return f;
+  }
+  lorig* r = lalloc(sizeof(lorig));
+  r->refs = 1;
+  r->body = body;
+  r->assumed = o.assumed;
+  r->rebinds = __atomic_load_n(&lctx_current()->rebinds, __ATOMIC_RELAXED);
+  f->orig = r;
+  return f;
+}
+
+/**
+ * Choose the body a call of a function runs: the optimized one, or the
+ * body as written once a name the optimizer relied on may mean something
+ * else.
+ * @param e The calling environment.
+ * @param f The function.
+ * @return The body (not a copy).
+ */
+lval* lopt_body(lenv* e, lval* f) {
+  lorig* r = f->orig;
+  if (!r) return f->body;
+  if (__atomic_load_n(&lctx_current()->rebinds, __ATOMIC_RELAXED) != r->rebinds) return r->body;
+  if (f->lexical) return f->body;
+  for (; e && e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      for (int j = 0; j < r->assumed->count; j++) {
+        if (strcmp(e->syms[i], r->assumed->cell[j]->sym) == 0) return r->body;
+      }
+    }
+  }
+  return f->body;
+}
+
+/**
+ * Release a reference to the body a function was written with.
+ */
+void lorig_release(lorig* r) {
+  if (LREF_DEC(r) != 0) return;
+  lval_del(r->body);
+  lval_del(r->assumed);
+  lfree(r);
+}
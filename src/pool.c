@@ -0,0 +1,540 @@
+// File: pool.c
+#define _POSIX_C_SOURCE 200809L
+#include "lisp.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Chunks created per participant, so stealing can even out uneven work */
+#define LPOOL_CHUNKS_PER_SLOT 8
+
+/* Chunks still owned by one participant; the owner takes from lo,
+   thieves take the upper half */
+typedef struct {
+  pthread_mutex_t lock;
+  long lo;
+  long hi;
+} lpool_range;
+
+/* A job run by every participant until no chunk is left */
+typedef struct {
+  lpool_fn fn;
+  void* data;
+  int slots;
+  lpool_range* ranges;
+} lpool_job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t* pool_threads;
+static int pool_workers = -1;     // -1 until the pool is started
+static lpool_job* pool_job;       // Job currently being run
+static long pool_generation;      // Bumped for every new job
+static int pool_running;          // Workers still inside the current job
+static int pool_busy;             // A job is in progress
+static int pool_stopping;
+
+/* Set in worker threads; nested parallel calls run inline */
+static __thread int pool_in_worker;
+
+/* Jobs the calling thread is running; their state lives on its stack */
+static __thread int pool_jobs;
+
+/**
+ * Take the next chunk for a participant, stealing when its own range is empty.
+ * @param job The job.
+ * @param slot The participant.
+ * @return The chunk index, or -1 when every range is empty.
+ */
+static long lpool_take(lpool_job* job, int slot) {
+  lpool_range* own = &job->ranges[slot];
+  pthread_mutex_lock(&own->lock);
+  if (own->lo < own->hi) {
+    long c = own->lo++;
+    pthread_mutex_unlock(&own->lock);
+    return c;
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  for (int k = 1; k < job->slots; k++) {
+    lpool_range* victim = &job->ranges[(slot + k) % job->slots];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->lo < victim->hi) {
+      long hi = victim->hi;
+      long mid = hi - (hi - victim->lo + 1) / 2;
+      victim->hi = mid;
+      pthread_mutex_unlock(&victim->lock);
+
+      pthread_mutex_lock(&own->lock);
+      own->lo = mid + 1;
+      own->hi = hi;
+      pthread_mutex_unlock(&own->lock);
+      return mid;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return -1;
+}
+
+/**
+ * Run chunks of a job until none are left.
+ */
+static void lpool_participate(lpool_job* job, int slot) {
+  long c;
+  while ((c = lpool_take(job, slot)) != -1) {
+    job->fn(job->data, c, slot);
+  }
+}
+
+/**
+ * Main loop of a worker thread.
+ * @param arg The participant slot of the worker.
+ */
+static void* lpool_worker(void* arg) {
+  int slot = (int)(intptr_t)arg;
+  long seen = 0;
+  pool_in_worker = 1;
+
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (!pool_stopping && pool_generation == seen) {
+      pthread_cond_wait(&pool_wake, &pool_lock);
+    }
+    if (pool_stopping) break;
+    seen = pool_generation;
+    lpool_job* job = pool_job;
+    pthread_mutex_unlock(&pool_lock);
+
+    lpool_participate(job, slot);
+
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_running == 0) pthread_cond_signal(&pool_done);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+/**
+ * Check whether the calling thread is a pool worker.
+ * @return 1 in worker threads, 0 elsewhere.
+ */
+int lpool_in_worker(void) {
+  return pool_in_worker;
+}
+
+/**
+ * Check whether the calling thread is inside lpool_run, so suspending it
+ * would leave the job's state to other threads while it is switched out.
+ * @return 1 in a job or a worker thread, 0 elsewhere.
+ */
+int lpool_in_job(void) {
+  return pool_in_worker || pool_jobs > 0;
+}
+
+/**
+ * Number of participants in a parallel job, starting the pool on first use.
+ * The pool has one worker per online CPU besides the calling thread, or
+ * LISPY_THREADS - 1 workers when that variable is set.
+ * @return Workers plus the calling thread.
+ */
+int lpool_size(void) {
+  pthread_mutex_lock(&pool_lock);
+  if (pool_workers < 0) {
+    char* env = getenv("LISPY_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+
+    pool_workers = n - 1;
+    pool_threads = malloc(sizeof(pthread_t) * (pool_workers ? pool_workers : 1));
+    for (int i = 0; i < pool_workers; i++) {
+      if (pthread_create(&pool_threads[i], NULL, lpool_worker, (void*)(intptr_t)(i + 1)) != 0) {
+        pool_workers = i;
+        break;
+      }
+    }
+  }
+  int slots = pool_workers + 1;
+  pthread_mutex_unlock(&pool_lock);
+  return slots;
+}
+
+/**
+ * Run fn(data, chunk, slot) for every chunk in [0, chunks) in parallel.
+ * Every participant gets a contiguous share of the chunks and steals from
+ * the others once its share is done. Calls made from inside a job, or while
+ * another thread is running one, run on the calling thread instead.
+ * @param chunks Number of chunks.
+ * @param fn Function run for each chunk; slot is below lpool_size().
+ * @param data Passed through to fn.
+ */
+void lpool_run(long chunks, lpool_fn fn, void* data) {
+  int slots = lpool_size();
+
+  pthread_mutex_lock(&pool_lock);
+  int inline_run = pool_in_worker || pool_busy || slots == 1;
+  if (!inline_run) pool_busy = 1;
+  pthread_mutex_unlock(&pool_lock);
+
+  pool_jobs++;
+  if (inline_run) {
+    for (long c = 0; c < chunks; c++) fn(data, c, 0);
+    pool_jobs--;
+    return;
+  }
+
+  lpool_job job;
+  job.fn = fn;
+  job.data = data;
+  job.slots = slots;
+  job.ranges = malloc(sizeof(lpool_range) * slots);
+  for (int i = 0; i < slots; i++) {
+    pthread_mutex_init(&job.ranges[i].lock, NULL);
+    job.ranges[i].lo = chunks * i / slots;
+    job.ranges[i].hi = chunks * (i + 1) / slots;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  pool_job = &job;
+  pool_running = pool_workers;
+  pool_generation++;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  lpool_participate(&job, 0);
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_running > 0) pthread_cond_wait(&pool_done, &pool_lock);
+  pool_job = NULL;
+  pool_busy = 0;
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int i = 0; i < slots; i++) pthread_mutex_destroy(&job.ranges[i].lock);
+  free(job.ranges);
+  pool_jobs--;
+}
+
+/**
+ * Stop and join the worker threads.
+ */
+void lpool_shutdown(void) {
+  pthread_mutex_lock(&pool_lock);
+  if (pool_workers < 0) {
+    pthread_mutex_unlock(&pool_lock);
+    return;
+  }
+  pool_stopping = 1;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int i = 0; i < pool_workers; i++) pthread_join(pool_threads[i], NULL);
+  free(pool_threads);
+  pool_threads = NULL;
+  pool_workers = -1;
+  pool_stopping = 0;
+}
+
+/* State of one pmap, pfilter or preduce call */
+typedef struct {
+  lctx* ctx;      // Context of the calling thread, entered by every participant
+  lenv* frozen;   // Snapshot of the caller's environment, read only
+  lenv** envs;    // Private scope per participant, its parent the snapshot
+  lval* fn;       // Function applied, read only
+  lval* list;     // Elements, read only
+  lval** out;     // One result per element, or per chunk when reducing
+  long size;      // Elements per chunk
+} lpar;
+
+/**
+ * Find a value that cannot be shared between the threads of a parallel
+ * job: a string builder or file, which are written unsynchronized, or a
+ * lexical closure, whose scopes the caller may still change.
+ * A result of the job may hold its own builders and files, but not a
+ * closure: its scopes end in the job's snapshot, deleted with the job.
+ * @param v The value, searched at any depth.
+ * @param result Whether v is a result of the job.
+ * @return The name of what was found, or NULL.
+ */
+static char* lpar_unshared(lval* v, int result) {
+  switch (v->type) {
+    case LVAL_SBUF: return result ? NULL : "a string builder";
+    case LVAL_FILE: return result ? NULL : "a file";
+    case LVAL_FUN:
+      if (v->builtin) return NULL;
+      if (v->closure) return "a lexical closure";
+      for (int i = 0; i < v->env->count; i++) {
+        char* x = lpar_unshared(v->env->vals[i], result);
+        if (x) return x;
+      }
+      return NULL;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        char* x = lpar_unshared(v->cell[i], result);
+        if (x) return x;
+      }
+      return NULL;
+    default: return NULL;
+  }
+}
+
+/**
+ * Snapshot the caller's environment for a parallel job, once for all
+ * participants. Bindings to values that cannot be shared become errors,
+ * raised only if the function uses them.
+ */
+static lenv* lpar_freeze(lenv* e) {
+  lenv* n = lenv_freeze(e);
+  for (int i = 0; i < n->count; i++) {
+    char* x = lpar_unshared(n->vals[i], 0);
+    if (!x) continue;
+    lval_del(n->vals[i]);
+    n->vals[i] = lval_err("'%s' is %s and cannot be used inside pmap, pfilter or preduce.",
+                          n->syms[i], x);
+  }
+  n->frozen = 1;
+  return n;
+}
+
+/**
+ * Call the function of a parallel operation from a participant.
+ * Participants share the snapshot, which nothing writes to: bindings go
+ * to a scope of their own and definitions are refused (see builtin_var).
+ */
+static lval* lpar_call(lpar* p, int slot, lval* args) {
+  if (!p->envs[slot]) {
+    p->envs[slot] = lenv_new();
+    p->envs[slot]->par = p->frozen;
+  }
+  lval* f = lval_copy(p->fn);
+  lval* x = lval_call(p->envs[slot], f, args);
+  lval_del(f);
+  return x;
+}
+
+/**
+ * Apply the function to each element of a chunk.
+ */
+static void lpar_map_chunk(void* data, long c, int slot) {
+  lpar* p = data;
+  lctx* prev = lctx_enter(p->ctx);
+  long end = (c + 1) * p->size < p->list->count ? (c + 1) * p->size : p->list->count;
+  for (long i = c * p->size; i < end; i++) {
+    lval* args = lval_add(lval_sexpr(), lval_copy(p->list->cell[i]));
+    p->out[i] = lpar_call(p, slot, args);
+  }
+  lctx_enter(prev);
+}
+
+/**
+ * Fold the elements of a chunk from its first element.
+ */
+static void lpar_reduce_chunk(void* data, long c, int slot) {
+  lpar* p = data;
+  lctx* prev = lctx_enter(p->ctx);
+  long end = (c + 1) * p->size < p->list->count ? (c + 1) * p->size : p->list->count;
+  lval* acc = lval_copy(p->list->cell[c * p->size]);
+  for (long i = c * p->size + 1; i < end && acc->type != LVAL_ERR; i++) {
+    lval* args = lval_add(lval_sexpr(), acc);
+    acc = lpar_call(p, slot, lval_add(args, lval_copy(p->list->cell[i])));
+  }
+  p->out[c] = acc;
+  lctx_enter(prev);
+}
+
+/**
+ * Run a parallel operation over the elements of a list.
+ * @param e The calling environment.
+ * @param fn The function.
+ * @param list The elements.
+ * @param chunk_fn Per-chunk worker.
+ * @param per_chunk Whether there is one result per chunk rather than per element.
+ * @param chunks Set to the number of chunks.
+ * @return The results, to be freed by the caller.
+ */
+static lval** lpar_run(lenv* e, lval* fn, lval* list, lpool_fn chunk_fn,
+                       int per_chunk, long* chunks) {
+  int slots = lpool_size();
+  long n = list->count;
+
+  lpar p;
+  p.size = n / (slots * LPOOL_CHUNKS_PER_SLOT);
+  if (p.size < 1) p.size = 1;
+  *chunks = (n + p.size - 1) / p.size;
+
+  p.ctx = lctx_current();
+  p.frozen = lpar_freeze(e);
+  p.envs = calloc(slots, sizeof(lenv*));
+  p.fn = fn;
+  p.list = list;
+  p.out = lalloc(sizeof(lval*) * (per_chunk ? *chunks : n) + 1);
+
+  lpool_run(*chunks, chunk_fn, &p);
+
+  for (int i = 0; i < slots; i++) {
+    if (p.envs[i]) lenv_del(p.envs[i]);
+  }
+  free(p.envs);
+  lenv_del(p.frozen);
+  return p.out;
+}
+
+/**
+ * Check that the arguments of a parallel operation can be shared between
+ * threads, deleting them if not.
+ * @return An error, or NULL.
+ */
+static lval* lpar_check(char* func, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    char* x = lpar_unshared(a->cell[i], 0);
+    if (x) {
+      lval* err = lval_err("Function '%s' cannot share %s between threads.", func, x);
+      lval_del(a);
+      return err;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Find the first error among results, deleting all of them if there is one.
+ * A result that cannot outlive the job counts as an error.
+ * @return The error, or NULL if every result is valid.
+ */
+static lval* lpar_first_error(lval** out, long n) {
+  long i;
+  for (i = 0; i < n && out[i]->type != LVAL_ERR; i++) {
+    char* x = lpar_unshared(out[i], 1);
+    if (x) {
+      lval_del(out[i]);
+      out[i] = lval_err("Parallel function returned %s, which cannot outlive the call.", x);
+      break;
+    }
+  }
+  if (i == n) return NULL;
+
+  lval* err = out[i];
+  for (long j = 0; j < n; j++) {
+    if (j != i) lval_del(out[j]);
+  }
+  return err;
+}
+
+/**
+ * Builtin: Apply a function to every element of a list in parallel.
+ * The function runs against a frozen snapshot of the calling environment,
+ * shared by every thread, in which it cannot define globals.
+ */
+lval* builtin_pmap(lenv* e, lval* a) {
+  LASSERT_NUM("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+  lval* err = lpar_check("pmap", a);
+  if (err) return err;
+
+  long n = a->cell[1]->count;
+  long chunks;
+  lval** out = lpar_run(e, a->cell[0], a->cell[1], lpar_map_chunk, 0, &chunks);
+  lval_del(a);
+
+  err = lpar_first_error(out, n);
+  if (err) {
+    lfree(out);
+    return err;
+  }
+
+  lval* x = lval_qexpr();
+  x->count = n;
+  x->cell = out;
+  return x;
+}
+
+/**
+ * Builtin: Keep the elements of a list satisfying a predicate, tested in parallel.
+ */
+lval* builtin_pfilter(lenv* e, lval* a) {
+  LASSERT_NUM("pfilter", a, 2);
+  LASSERT_TYPE("pfilter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pfilter", a, 1, LVAL_QEXPR);
+  lval* err = lpar_check("pfilter", a);
+  if (err) return err;
+
+  long n = a->cell[1]->count;
+  long chunks;
+  lval** out = lpar_run(e, a->cell[0], a->cell[1], lpar_map_chunk, 0, &chunks);
+
+  err = lpar_first_error(out, n);
+  if (err) {
+    lfree(out);
+    lval_del(a);
+    return err;
+  }
+
+  lval* list = a->cell[1];
+  lval* x = lval_qexpr();
+  for (long i = 0; i < n; i++) {
+    if (!err && out[i]->type != LVAL_NUM) {
+      err = lval_err("Function 'pfilter' predicate returned %s for element %li, Expected %s.",
+                     ltype_name(out[i]->type), i, ltype_name(LVAL_NUM));
+    }
+    if (!err && out[i]->num) {
+      x = lval_add(x, list->cell[i]);
+      list->cell[i] = NULL;
+    }
+    lval_del(out[i]);
+  }
+  lfree(out);
+
+  /* Elements moved into the result were cleared from the argument list */
+  int kept = 0;
+  for (int i = 0; i < list->count; i++) {
+    if (list->cell[i]) list->cell[kept++] = list->cell[i];
+  }
+  list->count = kept;
+  lval_del(a);
+
+  if (err) {
+    lval_del(x);
+    return err;
+  }
+  return x;
+}
+
+/**
+ * Builtin: Fold a list with an associative function in parallel.
+ * Each chunk is folded on its own and the chunk results are then folded
+ * in order, starting from the initial value.
+ */
+lval* builtin_preduce(lenv* e, lval* a) {
+  LASSERT_NUM("preduce", a, 3);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+  LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+  lval* err = lpar_check("preduce", a);
+  if (err) return err;
+
+  long chunks;
+  lval** out = lpar_run(e, a->cell[0], a->cell[2], lpar_reduce_chunk, 1, &chunks);
+
+  err = lpar_first_error(out, chunks);
+  if (err) {
+    lfree(out);
+    lval_del(a);
+    return err;
+  }
+
+  lval* acc = lval_pop(a, 1);
+  for (long c = 0; c < chunks; c++) {
+    if (acc->type == LVAL_ERR) {
+      lval_del(out[c]);
+      continue;
+    }
+    lval* f = lval_copy(a->cell[0]);
+    lval* args = lval_add(lval_add(lval_sexpr(), acc), out[c]);
+    acc = lval_call(e, f, args);
+    lval_del(f);
+  }
+  lfree(out);
+  lval_del(a);
+  return acc;
+}
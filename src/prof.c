@@ -0,0 +1,370 @@
+// File: prof.c
+#define _POSIX_C_SOURCE 200809L
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/time.h>
+
+/* Sampling interval of the profiler, in microseconds of CPU time */
+#define LPROF_INTERVAL 1000
+
+/* Frames kept per shadow stack; deeper calls are counted but not named */
+#define LPROF_MAX_DEPTH 512
+
+/* Words of sample storage (each sample takes its depth plus one) */
+#define LPROF_BUFFER (16 << 20)
+
+/* Functions listed in the summary table */
+#define LPROF_TOP 20
+
+/* Whether calls are being recorded */
+int lprof_on;
+
+/* Shadow stack of one thread: names of the Lisp functions being called,
+   outermost first */
+typedef struct {
+  int depth;
+  const char* names[LPROF_MAX_DEPTH];
+} lprof_stack;
+
+/* This thread's shadow stack, allocated by its first call while profiling.
+   Initial-exec TLS sits at a fixed offset from the thread pointer, so the
+   signal handler reads it without calling into the dynamic linker. */
+static __thread lprof_stack* prof_stack __attribute__((tls_model("initial-exec")));
+
+/* Frees shadow stacks when their threads exit */
+static pthread_key_t prof_key;
+static pthread_once_t prof_key_once = PTHREAD_ONCE_INIT;
+
+/* Recorded samples: a depth followed by that many name pointers */
+static uintptr_t* prof_buf;
+static size_t prof_used;
+static size_t prof_dropped;
+static char* prof_path;
+
+/* Interned function names; entries live as long as the process, so call
+   sites can keep them */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static char** prof_names;
+static size_t prof_names_cap;
+static size_t prof_names_count;
+
+/* Name of calls that are not made through a symbol */
+static const char* prof_lambda;
+
+/**
+ * Hash a NUL-terminated string (FNV-1a).
+ */
+static size_t lprof_hash(const char* s) {
+  size_t h = 2166136261u;
+  for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+}
+
+/**
+ * Get the unique copy of a function name.
+ * @param name The name.
+ * @return A copy that stays valid while the profiler runs.
+ */
+const char* lprof_intern(const char* name) {
+  pthread_mutex_lock(&prof_lock);
+  if (prof_names_count * 2 >= prof_names_cap) {
+    size_t cap = prof_names_cap ? prof_names_cap * 2 : 256;
+    char** names = calloc(cap, sizeof(char*));
+    for (size_t i = 0; i < prof_names_cap; i++) {
+      if (!prof_names[i]) continue;
+      size_t j = lprof_hash(prof_names[i]) & (cap - 1);
+      while (names[j]) j = (j + 1) & (cap - 1);
+      names[j] = prof_names[i];
+    }
+    free(prof_names);
+    prof_names = names;
+    prof_names_cap = cap;
+  }
+
+  size_t i = lprof_hash(name) & (prof_names_cap - 1);
+  while (prof_names[i] && strcmp(prof_names[i], name) != 0) {
+    i = (i + 1) & (prof_names_cap - 1);
+  }
+  if (!prof_names[i]) {
+    prof_names[i] = malloc(strlen(name) + 1);
+    strcpy(prof_names[i], name);
+    prof_names_count++;
+  }
+  const char* x = prof_names[i];
+  pthread_mutex_unlock(&prof_lock);
+  return x;
+}
+
+/**
+ * Free the shadow stack of an exiting thread.
+ */
+static void lprof_stack_free(void* st) {
+  prof_stack = NULL;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  free(st);
+}
+
+/**
+ * Create the key that frees shadow stacks.
+ */
+static void lprof_key_create(void) {
+  pthread_key_create(&prof_key, lprof_stack_free);
+}
+
+/**
+ * Record entry into a function on the shadow stack.
+ * @param name An interned name, or NULL for a call not made through a symbol.
+ */
+void lprof_push(const char* name) {
+  lprof_stack* st = prof_stack;
+  if (!st) {
+    st = calloc(1, sizeof(lprof_stack));
+    pthread_once(&prof_key_once, lprof_key_create);
+    pthread_setspecific(prof_key, st);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    prof_stack = st;
+  }
+  if (st->depth < LPROF_MAX_DEPTH) st->names[st->depth] = name ? name : prof_lambda;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  st->depth++;
+}
+
+/**
+ * Record return from the innermost function on the shadow stack.
+ */
+void lprof_pop(void) {
+  if (prof_stack && prof_stack->depth > 0) prof_stack->depth--;
+}
+
+/**
+ * Get the depth of the shadow stack, to restore it after a task switch.
+ */
+int lprof_depth(void) {
+  return prof_stack ? prof_stack->depth : 0;
+}
+
+/**
+ * Reset the depth of the shadow stack.
+ */
+void lprof_set_depth(int depth) {
+  if (prof_stack) prof_stack->depth = depth;
+}
+
+/**
+ * SIGPROF handler: copy the interrupted thread's shadow stack.
+ * Only touches preallocated memory, so it is async-signal-safe.
+ */
+static void lprof_sample(int sig) {
+  (void)sig;
+  lprof_stack* st = prof_stack;
+  int depth = !st ? 0 : st->depth < LPROF_MAX_DEPTH ? st->depth : LPROF_MAX_DEPTH;
+  size_t at = __atomic_fetch_add(&prof_used, depth + 1, __ATOMIC_RELAXED);
+  if (at + depth + 1 > LPROF_BUFFER) {
+    /* The first sample that does not fit marks the end of the buffer */
+    if (at < LPROF_BUFFER) prof_buf[at] = LPROF_BUFFER;
+    __atomic_fetch_add(&prof_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  prof_buf[at] = depth;
+  for (int i = 0; i < depth; i++) {
+    prof_buf[at + 1 + i] = (uintptr_t)st->names[i];
+  }
+}
+
+/**
+ * Start sampling the shadow stacks.
+ * @param path File the collapsed stacks are written to on lprof_stop.
+ */
+void lprof_start(char* path) {
+  prof_path = malloc(strlen(path) + 1);
+  strcpy(prof_path, path);
+  prof_buf = malloc(sizeof(uintptr_t) * LPROF_BUFFER);
+  prof_used = 0;
+  prof_dropped = 0;
+  prof_lambda = lprof_intern("[lambda]");
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lprof_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  struct itimerval t;
+  t.it_interval.tv_sec = 0;
+  t.it_interval.tv_usec = LPROF_INTERVAL;
+  t.it_value = t.it_interval;
+  lprof_on = 1;
+  setitimer(ITIMER_PROF, &t, NULL);
+}
+
+/* One distinct stack and how often it was sampled */
+typedef struct {
+  uintptr_t* frames;
+  int depth;
+  long count;
+} lprof_row;
+
+/* Sample counts of one function */
+typedef struct {
+  const char* name;
+  long self;
+  long total;
+} lprof_fn;
+
+/**
+ * Order stacks frame by frame, so equal stacks end up adjacent.
+ */
+static int lprof_row_cmp(const void* a, const void* b) {
+  const lprof_row* x = a;
+  const lprof_row* y = b;
+  for (int i = 0; i < x->depth && i < y->depth; i++) {
+    /* Names are interned, so different pointers are different names */
+    if (x->frames[i] != y->frames[i]) {
+      return strcmp((char*)x->frames[i], (char*)y->frames[i]);
+    }
+  }
+  return x->depth - y->depth;
+}
+
+/**
+ * Order functions by self samples, then total samples, descending.
+ */
+static int lprof_fn_cmp(const void* a, const void* b) {
+  const lprof_fn* x = a;
+  const lprof_fn* y = b;
+  if (x->self != y->self) return x->self < y->self ? 1 : -1;
+  if (x->total != y->total) return x->total < y->total ? 1 : -1;
+  return strcmp(x->name, y->name);
+}
+
+/**
+ * Order functions by the address of their interned name.
+ */
+static int lprof_fn_addr_cmp(const void* a, const void* b) {
+  const lprof_fn* x = a;
+  const lprof_fn* y = b;
+  return x->name < y->name ? -1 : x->name > y->name;
+}
+
+/**
+ * Find the entry of an interned name in a table sorted by address.
+ */
+static long lprof_fn_index(lprof_fn* fns, long n, uintptr_t name) {
+  long lo = 0, hi = n - 1;
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    if ((uintptr_t)fns[mid].name < name) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Stop sampling, write the collapsed stacks and print the top functions.
+ * The output file has one "outer;...;inner count" line per distinct stack,
+ * as read by flamegraph.pl; the table goes to stderr.
+ */
+void lprof_stop(void) {
+  if (!lprof_on) return;
+
+  struct itimerval t;
+  memset(&t, 0, sizeof(t));
+  setitimer(ITIMER_PROF, &t, NULL);
+  signal(SIGPROF, SIG_IGN);
+  lprof_on = 0;
+
+  size_t used = prof_used < LPROF_BUFFER ? prof_used : LPROF_BUFFER;
+
+  /* Split the buffer into samples */
+  long samples = 0;
+  for (size_t at = 0; at < used; at += prof_buf[at] + 1) samples++;
+  lprof_row* rows = malloc(sizeof(lprof_row) * (samples ? samples : 1));
+  long n = 0;
+  for (size_t at = 0; at < used; at += prof_buf[at] + 1) {
+    if (at + prof_buf[at] + 1 > used) break;
+    rows[n].depth = prof_buf[at];
+    rows[n].frames = &prof_buf[at + 1];
+    rows[n].count = 1;
+    n++;
+  }
+  samples = n;
+  qsort(rows, n, sizeof(lprof_row), lprof_row_cmp);
+
+  /* Merge equal stacks */
+  long distinct = 0;
+  for (long i = 0; i < n; i++) {
+    if (distinct > 0 && lprof_row_cmp(&rows[distinct - 1], &rows[i]) == 0) {
+      rows[distinct - 1].count++;
+    } else {
+      rows[distinct++] = rows[i];
+    }
+  }
+
+  FILE* f = fopen(prof_path, "w");
+  if (f) {
+    for (long i = 0; i < distinct; i++) {
+      if (rows[i].depth == 0) fputs("[toplevel]", f);
+      for (int j = 0; j < rows[i].depth; j++) {
+        if (j) fputc(';', f);
+        fputs((char*)rows[i].frames[j], f);
+      }
+      fprintf(f, " %li\n", rows[i].count);
+    }
+    fclose(f);
+  } else {
+    fprintf(stderr, "Could not write profile \"%s\".\n", prof_path);
+  }
+
+  /* Self and total samples per function; recursion counts once per sample */
+  long nfns = 0;
+  lprof_fn* fns = malloc(sizeof(lprof_fn) * (prof_names_count + 1));
+  for (size_t i = 0; i < prof_names_cap; i++) {
+    if (!prof_names[i]) continue;
+    fns[nfns].name = prof_names[i];
+    fns[nfns].self = fns[nfns].total = 0;
+    nfns++;
+  }
+  qsort(fns, nfns, sizeof(lprof_fn), lprof_fn_addr_cmp);
+  long* seen = calloc(nfns + 1, sizeof(long));
+  long toplevel = 0;
+  for (long i = 0; i < distinct; i++) {
+    lprof_row* r = &rows[i];
+    if (r->depth == 0) {
+      toplevel += r->count;
+      continue;
+    }
+    fns[lprof_fn_index(fns, nfns, r->frames[r->depth - 1])].self += r->count;
+    for (int j = 0; j < r->depth; j++) {
+      long k = lprof_fn_index(fns, nfns, r->frames[j]);
+      if (seen[k] == i + 1) continue;
+      seen[k] = i + 1;
+      fns[k].total += r->count;
+    }
+  }
+  free(seen);
+  fns[nfns].name = "[toplevel]";
+  fns[nfns].self = fns[nfns].total = toplevel;
+  nfns++;
+  qsort(fns, nfns, sizeof(lprof_fn), lprof_fn_cmp);
+
+  fprintf(stderr, "Profile: %li samples (%zu dropped), written to %s\n",
+          samples, prof_dropped, prof_path);
+  fprintf(stderr, "%8s %7s %8s %7s  %s\n", "self", "%", "total", "%", "function");
+  for (long i = 0; i < nfns && i < LPROF_TOP; i++) {
+    fprintf(stderr, "%8li %6.1f%% %8li %6.1f%%  %s\n",
+            fns[i].self, samples ? 100.0 * fns[i].self / samples : 0.0,
+            fns[i].total, samples ? 100.0 * fns[i].total / samples : 0.0,
+            fns[i].name);
+  }
+
+  free(fns);
+  free(rows);
+  free(prof_buf);
+  prof_buf = NULL;
+  free(prof_path);
+  prof_path = NULL;
+}
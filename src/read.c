@@ -15,18 +15,50 @@ lval* lval_read_num(mpc_ast_t* t) {
   return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
 }
 
+/**
+ * Decode the character following a backslash.
+ * @param c The escaped character.
+ * @return The decoded character, or -1 if c is not an escape.
+ */
+static int lval_unescape_char(char c) {
+  switch (c) {
+    case 'a': return '\a';
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'v': return '\v';
+    case '\\': return '\\';
+    case '\'': return '\'';
+    case '\"': return '\"';
+    case '0': return '\0';
+    default: return -1;
+  }
+}
+
 /**
  * Read a string from an AST node, unescaping.
+ * "\0" decodes to an embedded NUL byte; unknown escapes are kept as written.
  * @param t The AST node.
  * @return lval string.
  */
 lval* lval_read_str(mpc_ast_t* t) {
-  t->contents[strlen(t->contents) - 1] = '\0';
-  char* unescaped = malloc(strlen(t->contents + 1) + 1);
-  strcpy(unescaped, t->contents + 1);
-  unescaped = mpcf_unescape(unescaped);
-  lval* str = lval_str(unescaped);
-  free(unescaped);
+  /* Contents without the surrounding quotes */
+  char* s = t->contents + 1;
+  size_t n = strlen(s) - 1;
+
+  lval* str = lval_str_alloc(n);
+  size_t len = 0;
+  for (size_t i = 0; i < n; i++) {
+    int c = s[i];
+    if (c == '\\' && i + 1 < n && lval_unescape_char(s[i + 1]) != -1) {
+      c = lval_unescape_char(s[++i]);
+    }
+    str->str[len++] = c;
+  }
+  str->str[len] = '\0';
+  str->len = len;
   return str;
 }
 
@@ -54,5 +86,8 @@ lval* lval_read(mpc_ast_t* t) {
     if (strstr(t->children[i]->tag, "comment")) continue;
     x = lval_add(x, lval_read(t->children[i]));
   }
+
+  /* Give each call site a cache for its head symbol's binding */
+  if (x->count > 0 && x->cell[0]->type == LVAL_SYM) x->cell[0]->cache = lcache_new();
   return x;
 }
\ No newline at end of file
@@ -0,0 +1,316 @@
+// File: regex.c
+#include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Most recently used patterns, most recent first */
+#define LREGEX_CACHE_SIZE 16
+static lregex* regex_cache[LREGEX_CACHE_SIZE];
+
+/* Guards the cache and the scanners built on first use */
+static pthread_mutex_t regex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Marker returned in place of a separator while splitting */
+static char regex_sep;
+
+/* Input of the scan running on this thread; matches are cut from it */
+static __thread const char* regex_input;
+
+/**
+ * Turn a match, between two input positions, into a String holding the
+ * matched bytes. The text mpc_re builds stops at the first NUL.
+ */
+static mpc_val_t* regex_fold_match(int n, mpc_val_t** xs) {
+  long start = ((mpc_state_t*)xs[0])->pos;
+  long end = ((mpc_state_t*)xs[n - 1])->pos;
+  for (int i = 0; i < n; i++) free(xs[i]);
+  return lval_str_n(regex_input + start, end - start);
+}
+
+/**
+ * Delete a match.
+ */
+static void regex_match_del(mpc_val_t* x) {
+  lval_del(x);
+}
+
+/**
+ * Reject empty matches so scanning always makes progress.
+ */
+static int regex_nonempty(mpc_val_t** x) {
+  return ((lval*)*x)->len > 0;
+}
+
+/**
+ * Discard a character skipped while searching.
+ */
+static mpc_val_t* regex_skip(mpc_val_t* x) {
+  free(x);
+  return NULL;
+}
+
+/**
+ * Replace a matched separator with the split marker.
+ */
+static mpc_val_t* regex_mark(mpc_val_t* x) {
+  lval_del(x);
+  return &regex_sep;
+}
+
+/**
+ * Fold search results into a Q-expression of matched strings.
+ */
+static mpc_val_t* regex_fold_find(int n, mpc_val_t** xs) {
+  lval* x = lval_qexpr();
+  for (int i = 0; i < n; i++) {
+    if (!xs[i]) continue;
+    x = lval_add(x, xs[i]);
+  }
+  return x;
+}
+
+/**
+ * Fold split results into a Q-expression of the pieces between separators.
+ * Every element is either the marker or a single skipped character.
+ */
+static mpc_val_t* regex_fold_split(int n, mpc_val_t** xs) {
+  lval* x = lval_qexpr();
+  int start = 0;
+  for (int i = 0; i <= n; i++) {
+    if (i < n && xs[i] != &regex_sep) continue;
+
+    lval* piece = lval_str_alloc(i - start);
+    for (int j = start; j < i; j++) {
+      piece->str[j - start] = *(char*)xs[j];
+      free(xs[j]);
+    }
+    x = lval_add(x, piece);
+    start = i + 1;
+  }
+  return x;
+}
+
+/**
+ * Build a parser that matches the pattern at any position. Each match is
+ * a String; set regex_input to the input before parsing.
+ * @param src The pattern source.
+ * @param fold Fold applied to the whole scan.
+ * @param on_match Apply function for each match.
+ * @param on_skip Apply function for each skipped character, or NULL.
+ */
+static mpc_parser_t* regex_scanner(char* src, mpc_fold_t fold,
+                                   mpc_apply_t on_match, mpc_apply_t on_skip) {
+  mpc_parser_t* re = mpc_and(3, regex_fold_match, mpc_state(), mpc_re(src), mpc_state(), free, free);
+  mpc_parser_t* match = mpc_check(re, regex_match_del, regex_nonempty, "non-empty match");
+  if (on_match) match = mpc_apply(match, on_match);
+  mpc_parser_t* skip = on_skip ? mpc_apply(mpc_any(), on_skip) : mpc_any();
+  return mpc_many(fold, mpc_or(2, match, skip));
+}
+
+/**
+ * Compile a pattern.
+ * Only the whole-string matcher is built up front; the search and split
+ * scanners are built the first time they are used. Patterns are shared by
+ * every context through the cache, so they are allocated outside of any.
+ * @param src The pattern source.
+ * @return The compiled pattern, or NULL if the pattern is invalid.
+ */
+lregex* lregex_compile(char* src) {
+  mpc_parser_t* whole = mpc_whole(mpc_re(src), free);
+
+  /* mpc_re returns a parser that always fails for invalid patterns, with
+     its own failure rather than a list of expected input */
+  mpc_result_t r;
+  if (mpc_parse("<regex>", "", whole, &r)) {
+    free(r.output);
+  } else {
+    int invalid = r.error->failure != NULL;
+    mpc_err_delete(r.error);
+    if (invalid) {
+      mpc_delete(whole);
+      return NULL;
+    }
+  }
+
+  lctx* prev = lctx_enter(NULL);
+  lregex* re = lalloc(sizeof(lregex));
+  re->refs = 1;
+  re->src = lstrdup(src);
+  lctx_enter(prev);
+  re->whole = whole;
+  re->search = NULL;
+  re->split = NULL;
+  return re;
+}
+
+/**
+ * Drop a reference to a compiled pattern, freeing it when unused.
+ * @param re The pattern.
+ */
+void lregex_release(lregex* re) {
+  if (LREF_DEC(re) > 0) return;
+  mpc_delete(re->whole);
+  if (re->search) mpc_delete(re->search);
+  if (re->split) mpc_delete(re->split);
+  lfree(re->src);
+  lfree(re);
+}
+
+/**
+ * Look up a pattern in the cache, compiling it on a miss.
+ * @param src The pattern source.
+ * @return A new reference to the compiled pattern, or NULL if invalid.
+ */
+lregex* lregex_cached(char* src) {
+  pthread_mutex_lock(&regex_lock);
+  int i;
+  for (i = 0; i < LREGEX_CACHE_SIZE && regex_cache[i]; i++) {
+    if (strcmp(regex_cache[i]->src, src) == 0) break;
+  }
+
+  lregex* re;
+  if (i < LREGEX_CACHE_SIZE && regex_cache[i]) {
+    re = regex_cache[i];
+  } else {
+    re = lregex_compile(src);
+    if (!re) {
+      pthread_mutex_unlock(&regex_lock);
+      return NULL;
+    }
+    if (i == LREGEX_CACHE_SIZE) {
+      i--;
+      lregex_release(regex_cache[i]);
+    }
+  }
+
+  /* Move to the front */
+  memmove(&regex_cache[1], &regex_cache[0], sizeof(lregex*) * i);
+  regex_cache[0] = re;
+  LREF_INC(re);
+  pthread_mutex_unlock(&regex_lock);
+  return re;
+}
+
+/**
+ * Release every pattern held by the cache.
+ */
+void lregex_cache_clear(void) {
+  for (int i = 0; i < LREGEX_CACHE_SIZE && regex_cache[i]; i++) {
+    lregex_release(regex_cache[i]);
+    regex_cache[i] = NULL;
+  }
+}
+
+/**
+ * Get a scanner of a pattern, building it on first use.
+ * @param re The pattern.
+ * @param slot Where the scanner is kept.
+ * @param fold, on_match, on_skip See regex_scanner.
+ * @return The scanner.
+ */
+static mpc_parser_t* regex_scanner_of(lregex* re, mpc_parser_t** slot, mpc_fold_t fold,
+                                      mpc_apply_t on_match, mpc_apply_t on_skip) {
+  pthread_mutex_lock(&regex_lock);
+  if (!*slot) *slot = regex_scanner(re->src, fold, on_match, on_skip);
+  pthread_mutex_unlock(&regex_lock);
+  return *slot;
+}
+
+/**
+ * Get the pattern for argument 0, compiling strings through the cache.
+ * @param a The arguments.
+ * @param func Name of the calling builtin.
+ * @param err Set to an error lval on failure.
+ * @return A new reference to the pattern, or NULL on error.
+ */
+static lregex* regex_arg(lval* a, char* func, lval** err) {
+  lval* p = a->cell[0];
+  if (p->type == LVAL_REGEX) {
+    LREF_INC(p->regex);
+    return p->regex;
+  }
+  if (p->type != LVAL_STR) {
+    *err = lval_err("Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.",
+                    func, ltype_name(p->type), ltype_name(LVAL_REGEX));
+    return NULL;
+  }
+  lregex* re = lregex_cached(p->str);
+  if (!re) *err = lval_err("Invalid regular expression '%s'.", p->str);
+  return re;
+}
+
+/**
+ * Builtin: Compile a regular expression.
+ */
+lval* builtin_re_compile(lenv* e, lval* a) {
+  LASSERT_NUM("re-compile", a, 1);
+  LASSERT_TYPE("re-compile", a, 0, LVAL_STR);
+
+  lregex* re = lregex_cached(a->cell[0]->str);
+  LASSERT(a, re, "Invalid regular expression '%s'.", a->cell[0]->str);
+  lval_del(a);
+  return lval_regex(re);
+}
+
+/**
+ * Builtin: Test whether a whole string matches a pattern.
+ */
+lval* builtin_re_match(lenv* e, lval* a) {
+  LASSERT_NUM("re-match", a, 2);
+  LASSERT_TYPE("re-match", a, 1, LVAL_STR);
+
+  lval* err = NULL;
+  lregex* re = regex_arg(a, "re-match", &err);
+  if (!re) { lval_del(a); return err; }
+
+  mpc_result_t r;
+  int matched = mpc_nparse("<regex>", a->cell[1]->str, a->cell[1]->len, re->whole, &r);
+  if (matched) free(r.output); else mpc_err_delete(r.error);
+
+  lregex_release(re);
+  lval_del(a);
+  return lval_num(matched);
+}
+
+/**
+ * Builtin: Find every non-overlapping match of a pattern.
+ */
+lval* builtin_re_find_all(lenv* e, lval* a) {
+  LASSERT_NUM("re-find-all", a, 2);
+  LASSERT_TYPE("re-find-all", a, 1, LVAL_STR);
+
+  lval* err = NULL;
+  lregex* re = regex_arg(a, "re-find-all", &err);
+  if (!re) { lval_del(a); return err; }
+
+  mpc_parser_t* search = regex_scanner_of(re, &re->search, regex_fold_find, NULL, regex_skip);
+
+  mpc_result_t r;
+  regex_input = a->cell[1]->str;
+  mpc_nparse("<regex>", a->cell[1]->str, a->cell[1]->len, search, &r);
+  lregex_release(re);
+  lval_del(a);
+  return r.output;
+}
+
+/**
+ * Builtin: Split a string around every match of a pattern.
+ */
+lval* builtin_re_split(lenv* e, lval* a) {
+  LASSERT_NUM("re-split", a, 2);
+  LASSERT_TYPE("re-split", a, 1, LVAL_STR);
+
+  lval* err = NULL;
+  lregex* re = regex_arg(a, "re-split", &err);
+  if (!re) { lval_del(a); return err; }
+
+  mpc_parser_t* split = regex_scanner_of(re, &re->split, regex_fold_split, regex_mark, NULL);
+
+  mpc_result_t r;
+  regex_input = a->cell[1]->str;
+  mpc_nparse("<regex>", a->cell[1]->str, a->cell[1]->len, split, &r);
+  lregex_release(re);
+  lval_del(a);
+  return r.output;
+}
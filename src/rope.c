@@ -0,0 +1,391 @@
+// File: rope.c
+#include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Concatenations shorter than this are copied into a single leaf */
+#define LROPE_SHORT 64
+
+/* Ropes deeper than this are rebalanced */
+#define LROPE_MAX_DEPTH 48
+
+/* Slots of the rebalancing forest: Fibonacci numbers past SIZE_MAX */
+#define LROPE_FOREST 96
+
+/**
+ * Create a leaf rope.
+ * @param data The bytes, from lalloc; the rope takes ownership.
+ * @param len Number of bytes.
+ * @return The new rope.
+ */
+lrope* lrope_leaf(char* data, size_t len) {
+  lrope* r = lalloc(sizeof(lrope));
+  r->refs = 1;
+  r->depth = 0;
+  r->len = len;
+  r->data = data;
+  r->flat = NULL;
+  r->left = NULL;
+  r->right = NULL;
+  r->base = NULL;
+  return r;
+}
+
+/**
+ * Drop a reference to a rope, freeing it when unused.
+ * @param r The rope.
+ */
+void lrope_release(lrope* r) {
+  if (LREF_DEC(r) > 0) return;
+  if (r->left) {
+    lrope_release(r->left);
+    lrope_release(r->right);
+  }
+  if (r->base) {
+    lrope_release(r->base);
+  } else {
+    lfree(r->data);
+  }
+  lfree(r->flat);
+  lfree(r);
+}
+
+/**
+ * Copy the bytes of a rope into a buffer.
+ * @param r The rope.
+ * @param dst Destination with room for r->len bytes.
+ */
+static void lrope_copy_to(lrope* r, char* dst) {
+  while (r->left && !r->flat) {
+    lrope_copy_to(r->left, dst);
+    dst += r->left->len;
+    r = r->right;
+  }
+  memcpy(dst, r->left ? r->flat : r->data, r->len);
+}
+
+/**
+ * Get the contents of a rope as contiguous bytes.
+ * A concatenation is flattened on first use and the result cached in the
+ * node, so later calls are free. The tree itself is never modified, which
+ * keeps ropes safe to read from several threads.
+ * @param r The rope.
+ * @return The bytes (only leaves that own them are NUL-terminated).
+ */
+char* lrope_flatten(lrope* r) {
+  if (!r->left) return r->data;
+
+  char* flat = __atomic_load_n(&r->flat, __ATOMIC_ACQUIRE);
+  if (flat) return flat;
+
+  flat = lalloc(r->len + 1);
+  lrope_copy_to(r, flat);
+  flat[r->len] = '\0';
+
+  /* Another thread may have flattened the same rope meanwhile */
+  char* expected = NULL;
+  if (!__atomic_compare_exchange_n(&r->flat, &expected, flat, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    lfree(flat);
+    flat = expected;
+  }
+  return flat;
+}
+
+/**
+ * Join two ropes under a new node, copying them into a single leaf when
+ * the result is short. Consumes both references.
+ */
+static lrope* lrope_join(lrope* l, lrope* r) {
+  if (l->len == 0) { lrope_release(l); return r; }
+  if (r->len == 0) { lrope_release(r); return l; }
+
+  size_t len = l->len + r->len;
+  if (len < LROPE_SHORT) {
+    char* data = lalloc(len + 1);
+    lrope_copy_to(l, data);
+    lrope_copy_to(r, data + l->len);
+    data[len] = '\0';
+    lrope_release(l);
+    lrope_release(r);
+    return lrope_leaf(data, len);
+  }
+
+  lrope* x = lrope_leaf(NULL, len);
+  x->left = l;
+  x->right = r;
+  x->depth = 1 + (l->depth > r->depth ? l->depth : r->depth);
+  return x;
+}
+
+/**
+ * Add a balanced piece of a rope to the rebalancing forest, after every
+ * piece already added. Slot i holds a rope whose length is at least
+ * min_len[i] and less than min_len[i + 1], the earliest pieces in the
+ * highest slots; smaller slots are merged in front of the piece first,
+ * and the piece keeps moving up while its slot is taken.
+ * @param forest The forest.
+ * @param min_len Fibonacci numbers 1, 2, 3, 5, ...
+ * @param x The piece; the forest takes the reference.
+ */
+static void lrope_forest_add(lrope** forest, const size_t* min_len, lrope* x) {
+  lrope* prefix = NULL;
+  int i;
+  for (i = 0; x->len >= min_len[i + 1]; i++) {
+    if (!forest[i]) continue;
+    prefix = prefix ? lrope_join(forest[i], prefix) : forest[i];
+    forest[i] = NULL;
+  }
+  if (prefix) x = lrope_join(prefix, x);
+
+  for (;; i++) {
+    if (forest[i]) {
+      x = lrope_join(forest[i], x);
+      forest[i] = NULL;
+    }
+    if (i == LROPE_FOREST - 2 || x->len < min_len[i + 1]) {
+      forest[i] = x;
+      return;
+    }
+  }
+}
+
+/**
+ * Add the pieces of a rope to the rebalancing forest in order, keeping
+ * subtrees that are already balanced (a tree of depth d is balanced when
+ * it holds at least min_len[d + 1] bytes) or flattened whole.
+ */
+static void lrope_forest_fill(lrope** forest, const size_t* min_len, lrope* r) {
+  if (!r->left || r->flat || (r->depth < LROPE_FOREST - 1 && r->len >= min_len[r->depth + 1])) {
+    LREF_INC(r);
+    lrope_forest_add(forest, min_len, r);
+    return;
+  }
+  lrope_forest_fill(forest, min_len, r->left);
+  lrope_forest_fill(forest, min_len, r->right);
+}
+
+/**
+ * Rebalance a rope (Boehm, Atkinson and Plass), so its depth is
+ * logarithmic in its length. Leaves are shared, never copied.
+ * Consumes the reference and returns a new one.
+ */
+static lrope* lrope_balance(lrope* r) {
+  size_t min_len[LROPE_FOREST];
+  lrope* forest[LROPE_FOREST] = {NULL};
+  min_len[0] = 1;
+  min_len[1] = 2;
+  for (int i = 2; i < LROPE_FOREST; i++) {
+    size_t n = min_len[i - 1] + min_len[i - 2];
+    min_len[i] = n < min_len[i - 1] ? (size_t)-1 : n;
+  }
+
+  lrope_forest_fill(forest, min_len, r);
+  lrope_release(r);
+
+  lrope* x = NULL;
+  for (int i = 0; i < LROPE_FOREST; i++) {
+    if (forest[i]) x = x ? lrope_join(forest[i], x) : forest[i];
+  }
+  return x;
+}
+
+/**
+ * Concatenate two ropes, rebalancing the result when it gets too deep.
+ * Consumes both references and returns a new one.
+ * @param l The left rope.
+ * @param r The right rope.
+ * @return The concatenation.
+ */
+lrope* lrope_cat(lrope* l, lrope* r) {
+  lrope* x = lrope_join(l, r);
+  if (x->depth > LROPE_MAX_DEPTH) x = lrope_balance(x);
+  return x;
+}
+
+/**
+ * Take a slice of a rope without copying its bytes.
+ * @param r The rope.
+ * @param start Offset of the slice.
+ * @param n Length of the slice (start + n must not exceed r->len).
+ * @return A new reference to the slice.
+ */
+lrope* lrope_slice(lrope* r, size_t start, size_t n) {
+  if (start == 0 && n == r->len) {
+    LREF_INC(r);
+    return r;
+  }
+
+  if (r->left) {
+    lrope* l = r->left;
+    if (start + n <= l->len) return lrope_slice(l, start, n);
+    if (start >= l->len) return lrope_slice(r->right, start - l->len, n);
+    return lrope_cat(lrope_slice(l, start, l->len - start),
+                     lrope_slice(r->right, 0, n - (l->len - start)));
+  }
+
+  /* Slices always point at the leaf that owns the bytes */
+  lrope* base = r->base ? r->base : r;
+  LREF_INC(base);
+  lrope* x = lrope_leaf(r->data + start, n);
+  x->base = base;
+  return x;
+}
+
+/**
+ * Drop a reference to a string builder, freeing it when unused.
+ * @param sb The builder.
+ */
+void lsbuf_release(lsbuf* sb) {
+  if (LREF_DEC(sb) > 0) return;
+  lfree(sb->buf.data);
+  lfree(sb);
+}
+
+/**
+ * Append the bytes of a rope to a buffer without flattening it.
+ * @param b The buffer.
+ * @param r The rope.
+ */
+void lrope_write(lbuf* b, lrope* r) {
+  while (r->left && !r->flat) {
+    lrope_write(b, r->left);
+    r = r->right;
+  }
+  lbuf_write(b, r->left ? r->flat : r->data, r->len);
+}
+
+/**
+ * Convert a string, rope or builder argument into a rope.
+ * String bytes are moved into the rope rather than copied.
+ * @param v The value (must be owned by the caller).
+ * @return A new reference, or NULL if v has another type.
+ */
+static lrope* lrope_from(lval* v) {
+  switch (v->type) {
+    case LVAL_STR: {
+      lrope* r = lrope_leaf(v->str, v->len);
+      v->str = NULL;
+      return r;
+    }
+    case LVAL_ROPE:
+      LREF_INC(v->rope);
+      return v->rope;
+    case LVAL_SBUF: {
+      char* data = lalloc(v->sbuf->buf.len + 1);
+      memcpy(data, v->sbuf->buf.data, v->sbuf->buf.len);
+      data[v->sbuf->buf.len] = '\0';
+      return lrope_leaf(data, v->sbuf->buf.len);
+    }
+    default: return NULL;
+  }
+}
+
+/**
+ * Builtin: Concatenate strings, ropes and builders into a rope.
+ */
+lval* builtin_rope(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a, a->cell[i]->type == LVAL_STR || a->cell[i]->type == LVAL_ROPE
+               || a->cell[i]->type == LVAL_SBUF,
+            "Function 'rope' passed incorrect type for argument %i. Got %s, Expected %s.",
+            i, ltype_name(a->cell[i]->type), ltype_name(LVAL_ROPE));
+  }
+
+  char* empty = lalloc(1);
+  empty[0] = '\0';
+  lrope* r = lrope_leaf(empty, 0);
+  for (int i = 0; i < a->count; i++) {
+    r = lrope_cat(r, lrope_from(a->cell[i]));
+  }
+  lval_del(a);
+  return lval_rope(r);
+}
+
+/**
+ * Builtin: Slice a rope from a start offset, optionally limited in length.
+ */
+lval* builtin_rope_slice(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'rope-slice' passed incorrect number of arguments. Got %i, Expected 2 or 3.",
+          a->count);
+  LASSERT_TYPE("rope-slice", a, 0, LVAL_ROPE);
+  LASSERT_TYPE("rope-slice", a, 1, LVAL_NUM);
+  if (a->count == 3) LASSERT_TYPE("rope-slice", a, 2, LVAL_NUM);
+
+  lrope* r = a->cell[0]->rope;
+  long start = a->cell[1]->num;
+  long n = a->count == 3 ? a->cell[2]->num : (long)r->len - start;
+  LASSERT(a, start >= 0 && (size_t)start <= r->len,
+          "Function 'rope-slice' start %li out of range for rope of length %li.",
+          start, (long)r->len);
+  LASSERT(a, n >= 0 && (size_t)n <= r->len - start,
+          "Function 'rope-slice' length %li out of range from start %li.", n, start);
+
+  lval* x = lval_rope(lrope_slice(r, start, n));
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Length of a rope or builder in bytes.
+ */
+lval* builtin_rope_len(lenv* e, lval* a) {
+  LASSERT_NUM("rope-len", a, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_ROPE || a->cell[0]->type == LVAL_SBUF,
+          "Function 'rope-len' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_ROPE));
+
+  lval* v = a->cell[0];
+  lval* x = lval_num(v->type == LVAL_ROPE ? v->rope->len : v->sbuf->buf.len);
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Flatten a rope or builder into a string.
+ */
+lval* builtin_rope_to_str(lenv* e, lval* a) {
+  LASSERT_NUM("rope->str", a, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_ROPE || a->cell[0]->type == LVAL_SBUF,
+          "Function 'rope->str' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_ROPE));
+
+  lval* v = a->cell[0];
+  lval* x = v->type == LVAL_ROPE
+    ? lval_str_n(lrope_flatten(v->rope), v->rope->len)
+    : lval_str_n(v->sbuf->buf.data, v->sbuf->buf.len);
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Create a string builder holding the given initial text.
+ */
+lval* builtin_string_builder(lenv* e, lval* a) {
+  lsbuf* sb = lalloc(sizeof(lsbuf));
+  sb->refs = 1;
+  lbuf_init_grow(&sb->buf, 64);
+  for (int i = 0; i < a->count; i++) {
+    lval_write_text(&sb->buf, a->cell[i]);
+  }
+  lval_del(a);
+  return lval_sbuf(sb);
+}
+
+/**
+ * Builtin: Append values to a string builder.
+ * The builder is shared by every copy, so the append is visible through
+ * all of them; the builder itself is returned.
+ */
+lval* builtin_append(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "Function 'append!' passed no arguments.");
+  LASSERT_TYPE("append!", a, 0, LVAL_SBUF);
+
+  lbuf* b = &a->cell[0]->sbuf->buf;
+  for (int i = 1; i < a->count; i++) {
+    lval_write_text(b, a->cell[i]);
+  }
+  LASSERT(a, !lctx_current()->alloc_failed, "Function 'append!' ran out of memory.");
+  return lval_take(a, 0);
+}
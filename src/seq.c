@@ -0,0 +1,284 @@
+// File: seq.c
+#include "lisp.h"
+#include <string.h>
+
+/*
+ * Lazy sequences. A sequence is an immutable description of how its
+ * elements are produced (a range, repeated application of a function, or
+ * a map, filter or take over another sequence or a Q-expression), shared
+ * between copies. Nothing is computed until the sequence is consumed:
+ * consumers walk it with an iterator, one element at a time, so a
+ * pipeline needs memory for its stages but not for its elements, and
+ * unbounded sequences are fine as long as only a finite part is used.
+ */
+
+/**
+ * Create a sequence of a kind, with every other field cleared.
+ */
+static lseq* lseq_new(int kind) {
+  lseq* s = lalloc(sizeof(lseq));
+  memset(s, 0, sizeof(lseq));
+  s->refs = 1;
+  s->kind = kind;
+  return s;
+}
+
+/**
+ * Drop a reference to a sequence, freeing it when unused.
+ * @param s The sequence.
+ */
+void lseq_release(lseq* s) {
+  if (LREF_DEC(s) > 0) return;
+  if (s->fn) lval_del(s->fn);
+  if (s->init) lval_del(s->init);
+  if (s->src) lseq_release(s->src);
+  lfree(s);
+}
+
+/**
+ * Get the sequence an argument stands for: a sequence, or the elements
+ * of a Q-expression.
+ * @param v The argument, consumed.
+ * @return The sequence, held once.
+ */
+static lseq* lseq_of(lval* v) {
+  lseq* s;
+  if (v->type == LVAL_SEQ) {
+    s = v->seq;
+    LREF_INC(s);
+    lval_del(v);
+  } else {
+    s = lseq_new(LSEQ_LIST);
+    s->init = v;
+  }
+  return s;
+}
+
+/**
+ * Start walking a sequence.
+ * @param s The sequence.
+ * @return The iterator, with one state per stage of the sequence.
+ */
+lseq_iter* lseq_begin(lseq* s) {
+  lseq_iter* it = lalloc(sizeof(lseq_iter));
+  it->seq = s;
+  it->i = s->kind == LSEQ_RANGE ? s->start : s->kind == LSEQ_TAKE ? s->n : 0;
+  it->cur = NULL;
+  it->src = s->src ? lseq_begin(s->src) : NULL;
+  return it;
+}
+
+/**
+ * Stop walking a sequence.
+ * @param it The iterator.
+ */
+void lseq_end(lseq_iter* it) {
+  if (it->src) lseq_end(it->src);
+  if (it->cur) lval_del(it->cur);
+  lfree(it);
+}
+
+/**
+ * Call a sequence's function on one element.
+ */
+static lval* lseq_apply(lenv* e, lval* fn, lval* x) {
+  lval* f = lval_copy(fn);
+  lval* r = lval_call(e, f, lval_add(lval_sexpr(), x));
+  lval_del(f);
+  return r;
+}
+
+/**
+ * Produce the next element of a sequence.
+ * @param e The environment functions are called in.
+ * @param it The iterator.
+ * @return The element, an error if producing it failed, or NULL once the
+ *         sequence is exhausted.
+ */
+lval* lseq_next(lenv* e, lseq_iter* it) {
+  lseq* s = it->seq;
+  switch (s->kind) {
+    case LSEQ_RANGE:
+      if (s->step > 0 ? it->i >= s->end : it->i <= s->end) return NULL;
+      it->i += s->step;
+      return lval_num(it->i - s->step);
+
+    case LSEQ_LIST:
+      if (it->i >= s->init->count) return NULL;
+      return lval_copy(s->init->cell[it->i++]);
+
+    case LSEQ_ITERATE:
+      /* Keep the element last produced, to apply the function to next */
+      if (!it->cur) it->cur = lval_copy(s->init);
+      else if (it->cur->type != LVAL_ERR) it->cur = lseq_apply(e, s->fn, it->cur);
+      return lval_copy(it->cur);
+
+    case LSEQ_MAP: {
+      lval* x = lseq_next(e, it->src);
+      if (!x || x->type == LVAL_ERR) return x;
+      return lseq_apply(e, s->fn, x);
+    }
+
+    case LSEQ_FILTER:
+      for (;;) {
+        lval* x = lseq_next(e, it->src);
+        if (!x || x->type == LVAL_ERR) return x;
+        lval* t = lseq_apply(e, s->fn, lval_copy(x));
+        if (t->type != LVAL_NUM) {
+          lval* err = t->type == LVAL_ERR ? t :
+            lval_err("Function 'lazy-filter' passed incorrect type for test. Got %s, Expected %s.",
+                     ltype_name(t->type), ltype_name(LVAL_NUM));
+          if (err != t) lval_del(t);
+          lval_del(x);
+          return err;
+        }
+        long keep = t->num;
+        lval_del(t);
+        if (keep) return x;
+        lval_del(x);
+      }
+
+    case LSEQ_TAKE:
+      if (it->i <= 0) return NULL;
+      it->i--;
+      return lseq_next(e, it->src);
+  }
+  return NULL;
+}
+
+/**
+ * Builtin: A lazy sequence of integers: (range end) counts from 0 up to
+ * end, (range start end) from start, and (range start end step) in steps,
+ * the end excluded.
+ */
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+          "Function 'range' passed incorrect number of arguments. Got %i, Expected 1 to 3.",
+          a->count);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("range", a, i, LVAL_NUM);
+  }
+  lseq* s = lseq_new(LSEQ_RANGE);
+  s->start = a->count > 1 ? a->cell[0]->num : 0;
+  s->end = a->cell[a->count > 1 ? 1 : 0]->num;
+  s->step = a->count > 2 ? a->cell[2]->num : 1;
+  lval_del(a);
+  if (s->step == 0) {
+    lseq_release(s);
+    return lval_err("Function 'range' passed a step of 0.");
+  }
+  return lval_seq(s);
+}
+
+/**
+ * Builtin: The unbounded lazy sequence x, (f x), (f (f x)), ...
+ */
+lval* builtin_iterate(lenv* e, lval* a) {
+  LASSERT_NUM("iterate", a, 2);
+  LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+  lseq* s = lseq_new(LSEQ_ITERATE);
+  s->fn = lval_pop(a, 0);
+  s->init = lval_pop(a, 0);
+  lval_del(a);
+  return lval_seq(s);
+}
+
+/**
+ * Check the arguments of a builtin taking a function and a sequence.
+ */
+#define LASSERT_FN_SEQ(func, args) \
+  LASSERT_NUM(func, args, 2); \
+  LASSERT_TYPE(func, args, 0, LVAL_FUN); \
+  LASSERT(args, args->cell[1]->type == LVAL_SEQ || args->cell[1]->type == LVAL_QEXPR, \
+    "Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.", \
+    func, ltype_name(args->cell[1]->type), ltype_name(LVAL_SEQ))
+
+/**
+ * Builtin: Lazily apply a function to each element of a sequence or list.
+ */
+lval* builtin_lazy_map(lenv* e, lval* a) {
+  LASSERT_FN_SEQ("lazy-map", a);
+  lseq* s = lseq_new(LSEQ_MAP);
+  s->fn = lval_pop(a, 0);
+  s->src = lseq_of(lval_pop(a, 0));
+  lval_del(a);
+  return lval_seq(s);
+}
+
+/**
+ * Builtin: Lazily keep the elements of a sequence or list a predicate
+ * holds for.
+ */
+lval* builtin_lazy_filter(lenv* e, lval* a) {
+  LASSERT_FN_SEQ("lazy-filter", a);
+  lseq* s = lseq_new(LSEQ_FILTER);
+  s->fn = lval_pop(a, 0);
+  s->src = lseq_of(lval_pop(a, 0));
+  lval_del(a);
+  return lval_seq(s);
+}
+
+/**
+ * Builtin: The first n elements of a list, or a lazy sequence of the
+ * first n elements of a sequence.
+ */
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_QEXPR,
+          "Function 'take' passed incorrect type for argument 1. Got %s, Expected %s.",
+          ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
+  long n = a->cell[0]->num;
+
+  if (a->cell[1]->type == LVAL_QEXPR) {
+    lval* l = lval_take(a, 1);
+    if (n < 0) n = 0;
+    if (n < l->count) {
+      for (int i = n; i < l->count; i++) lval_del(l->cell[i]);
+      l->count = n;
+      l->cell = lrealloc(l->cell, sizeof(lval*) * n);
+    }
+    return l;
+  }
+  lseq* s = lseq_new(LSEQ_TAKE);
+  s->n = n;
+  s->src = lseq_of(lval_pop(a, 1));
+  lval_del(a);
+  return lval_seq(s);
+}
+
+/**
+ * Builtin: Produce every element of a sequence into a list.
+ * Lists are returned unchanged.
+ */
+lval* builtin_realize(lenv* e, lval* a) {
+  LASSERT_NUM("realize", a, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_SEQ || a->cell[0]->type == LVAL_QEXPR,
+          "Function 'realize' passed incorrect type for argument 0. Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_SEQ));
+  if (a->cell[0]->type == LVAL_QEXPR) return lval_take(a, 0);
+
+  /* Grow the list geometrically, trimming it at the end */
+  lval* l = lval_qexpr();
+  int cap = 0;
+  lseq_iter* it = lseq_begin(a->cell[0]->seq);
+  lval* x;
+  while ((x = lctx_check()) || (x = lseq_next(e, it))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(l);
+      l = x;
+      break;
+    }
+    if (l->count == cap) {
+      cap = cap ? cap * 2 : 16;
+      l->cell = lrealloc(l->cell, sizeof(lval*) * cap);
+    }
+    l->cell[l->count++] = x;
+  }
+  if (l->type == LVAL_QEXPR && l->count < cap) {
+    l->cell = lrealloc(l->cell, sizeof(lval*) * l->count);
+  }
+  lseq_end(it);
+  lval_del(a);
+  return l;
+}
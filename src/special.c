@@ -0,0 +1,612 @@
+// File: special.c
+#include "lisp.h"
+#include <string.h>
+
+/*
+ * Special forms are recognised by the evaluator before any argument is
+ * evaluated. Each receives the whole S-expression, head included, takes
+ * out the parts it needs and deletes the rest unevaluated, so a branch
+ * that is not taken is never evaluated or copied.
+ */
+
+/**
+ * Check the number of arguments of a special form.
+ */
+#define LASSERT_FORM_NUM(form, v, num) \
+  LASSERT(v, (v)->count - 1 == num, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+    form, (v)->count - 1, num)
+
+/**
+ * Evaluate a branch of a conditional.
+ * A branch written as a Q-expression in the source is evaluated as code,
+ * as the if builtin does; any other branch is evaluated as an expression,
+ * and its value is the result even if it is a Q-expression.
+ * @param e The environment.
+ * @param x The branch.
+ * @return The result.
+ */
+static lval* lval_eval_branch(lenv* e, lval* x) {
+  if (x->type != LVAL_QEXPR) return lval_eval(e, x);
+  x->type = LVAL_SEXPR;
+  return lval_eval(e, x);
+}
+
+/**
+ * Evaluate the test of a conditional, which must be a Number.
+ * @param e The environment.
+ * @param form Name of the form, for errors.
+ * @param x The test.
+ * @return The Number, or an error.
+ */
+static lval* lval_eval_test(lenv* e, char* form, lval* x) {
+  x = lval_eval(e, x);
+  if (x->type == LVAL_ERR || x->type == LVAL_NUM) return x;
+  lval* err = lval_err("Function '%s' passed incorrect type for test. Got %s, Expected %s.",
+                       form, ltype_name(x->type), ltype_name(LVAL_NUM));
+  lval_del(x);
+  return err;
+}
+
+/**
+ * Evaluate the remaining elements of an expression in order.
+ * @param e The environment.
+ * @param v The expression, consumed.
+ * @return The value of the last element, or the first error.
+ */
+static lval* lval_eval_seq(lenv* e, lval* v) {
+  lval* x = lval_sexpr();
+  while (v->count && x->type != LVAL_ERR) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(v, 0));
+  }
+  lval_del(v);
+  return x;
+}
+
+/**
+ * Turn a body given in source into the Q-expression a lambda holds.
+ * {...} is kept, (...) becomes {...} and an atom x becomes {x}.
+ */
+static lval* lval_body(lval* x) {
+  if (x->type == LVAL_QEXPR) return x;
+  if (x->type == LVAL_SEXPR) {
+    x->type = LVAL_QEXPR;
+    return x;
+  }
+  return lval_add(lval_qexpr(), x);
+}
+
+/**
+ * Turn the body expressions of a lambda into one body.
+ * A single expression is kept as lval_body does; several are wrapped as
+ * {begin ...}.
+ * @param v The expressions, consumed.
+ */
+static lval* lval_body_seq(lval* v) {
+  if (v->count == 1) return lval_take(v, 0);
+  return lval_join(lval_add(lval_qexpr(), lval_sym("begin")), v);
+}
+
+/**
+ * Build a lambda from a list of formals and a body.
+ * @param e The environment it is created in.
+ * @param form Name of the form, for errors.
+ * @param formals Symbols, as a Q- or S-expression; consumed.
+ * @param body The body; consumed.
+ * @return The lambda, or an error.
+ */
+static lval* lval_make_lambda(lenv* e, char* form, lval* formals, lval* body) {
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->type != LVAL_SYM) {
+      lval* err = lval_err("Function '%s' cannot define non-symbol. Got %s, Expected %s.",
+                           form, ltype_name(formals->cell[i]->type), ltype_name(LVAL_SYM));
+      lval_del(formals);
+      lval_del(body);
+      return err;
+    }
+  }
+  formals->type = LVAL_QEXPR;
+  return lval_close(lval_lambda(formals, lval_body(body)), e);
+}
+
+/**
+ * Special form: (if test then else).
+ */
+static lval* special_if(lenv* e, lval* v) {
+  LASSERT_FORM_NUM("if", v, 3);
+  lval* test = lval_eval_test(e, "if", lval_pop(v, 1));
+  if (test->type == LVAL_ERR) {
+    lval_del(v);
+    return test;
+  }
+  lval* branch = lval_take(v, test->num ? 1 : 2);
+  lval_del(test);
+  return lval_eval_branch(e, branch);
+}
+
+/**
+ * Special form: (cond (test expr...) ...).
+ * Evaluates the expressions of the first clause whose test is true and
+ * returns the last one, or the test itself if there are none. Returns {}
+ * if no test is true.
+ */
+static lval* special_cond(lenv* e, lval* v) {
+  lval_del(lval_pop(v, 0));
+  while (v->count) {
+    lval* clause = lval_pop(v, 0);
+    if ((clause->type != LVAL_SEXPR && clause->type != LVAL_QEXPR) || clause->count == 0) {
+      lval* err = lval_err("Function 'cond' passed incorrect clause. Got %s, Expected %s.",
+                           ltype_name(clause->type), ltype_name(LVAL_SEXPR));
+      lval_del(clause);
+      lval_del(v);
+      return err;
+    }
+    lval* test = lval_eval_test(e, "cond", lval_pop(clause, 0));
+    if (test->type == LVAL_ERR || test->num) {
+      lval_del(v);
+      if (test->type == LVAL_ERR || clause->count == 0) {
+        lval_del(clause);
+        return test;
+      }
+      lval_del(test);
+      return lval_eval_seq(e, clause);
+    }
+    lval_del(test);
+    lval_del(clause);
+  }
+  lval_del(v);
+  return lval_qexpr();
+}
+
+/**
+ * Check that a clause of select or case is a {test expr} pair.
+ * @return NULL, or an error.
+ */
+static lval* lval_check_pair(char* form, lval* clause) {
+  if ((clause->type == LVAL_SEXPR || clause->type == LVAL_QEXPR) && clause->count == 2) {
+    return NULL;
+  }
+  return lval_err("Function '%s' passed incorrect clause. Expected {test expr}.", form);
+}
+
+/**
+ * Special form: (select {test expr} ...) evaluates the expr of the first
+ * clause whose test is true, as the prelude's select does, but in the
+ * caller's scope.
+ */
+static lval* special_select(lenv* e, lval* v) {
+  lval_del(lval_pop(v, 0));
+  while (v->count) {
+    lval* clause = lval_pop(v, 0);
+    lval* test = lval_check_pair("select", clause);
+    if (!test) test = lval_eval_test(e, "select", lval_pop(clause, 0));
+    if (test->type == LVAL_ERR || test->num) {
+      lval_del(v);
+      if (test->type == LVAL_ERR) {
+        lval_del(clause);
+        return test;
+      }
+      lval_del(test);
+      return lval_eval(e, lval_take(clause, 0));
+    }
+    lval_del(test);
+    lval_del(clause);
+  }
+  lval_del(v);
+  return lval_err("No Selection Found");
+}
+
+/**
+ * Special form: (case x {value expr} ...) evaluates the expr of the first
+ * clause whose value equals x, as the prelude's case does, but in the
+ * caller's scope.
+ */
+static lval* special_case(lenv* e, lval* v) {
+  lval* x = lval_eval(e, lval_pop(v, 1));
+  lval_del(lval_pop(v, 0));
+  while (v->count && x->type != LVAL_ERR) {
+    lval* clause = lval_pop(v, 0);
+    lval* y = lval_check_pair("case", clause);
+    if (!y) y = lval_eval(e, lval_pop(clause, 0));
+    if (y->type == LVAL_ERR || lval_eq(x, y)) {
+      lval_del(x);
+      lval_del(v);
+      if (y->type == LVAL_ERR) {
+        lval_del(clause);
+        return y;
+      }
+      lval_del(y);
+      return lval_eval(e, lval_take(clause, 0));
+    }
+    lval_del(y);
+    lval_del(clause);
+  }
+  lval_del(v);
+  if (x->type == LVAL_ERR) return x;
+  lval_del(x);
+  return lval_err("No Case Found");
+}
+
+/* How the values of a let form see its bindings */
+typedef enum {
+  LET_PAR,    // let: every value is evaluated in the enclosing scope
+  LET_SEQ,    // let*: each value sees the bindings before it
+  LET_REC     // letrec: every value sees all bindings
+} llet;
+
+/**
+ * Evaluate a let form in a frame on the C stack. The evaluator is
+ * recursive, so the frame lives exactly as long as the form and no
+ * environment is allocated unless it outgrows LFRAME_SLOTS bindings.
+ * Under lexical scope the scope is allocated, as closures may keep it.
+ * @param e The environment.
+ * @param v The form, consumed.
+ * @param form Name of the form, for errors.
+ * @param kind Scoping of the values.
+ * @return The value of the last body expression, or an error.
+ */
+static lval* lval_eval_let(lenv* e, lval* v, char* form, llet kind) {
+  LASSERT(v, v->count >= 2,
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected at least %i.",
+    form, v->count - 1, 1);
+  lval_del(lval_pop(v, 0));
+
+  /* Lambdas created under lexical scope may keep the scope */
+  lframe frame;
+  lenv* scope;
+  if (lctx_current()->lexical) {
+    scope = lenv_new();
+    lenv_link(scope, e);
+  } else {
+    scope = lframe_init(&frame, e);
+  }
+
+  lval* x;
+  if (v->count == 1) {
+    x = lval_eval_branch(scope, lval_take(v, 0));
+    lenv_del(scope);
+    return x;
+  }
+
+  lval* binds = lval_pop(v, 0);
+  x = NULL;
+  if (binds->type != LVAL_SEXPR && binds->type != LVAL_QEXPR) {
+    x = lval_err("Function '%s' passed incorrect type for bindings. Got %s, Expected %s.",
+                 form, ltype_name(binds->type), ltype_name(LVAL_SEXPR));
+  }
+  for (int i = 0; !x && i < binds->count; i++) {
+    lval* b = binds->cell[i];
+    if ((b->type != LVAL_SEXPR && b->type != LVAL_QEXPR) || b->count != 2
+        || b->cell[0]->type != LVAL_SYM) {
+      x = lval_err("Function '%s' passed incorrect binding. Expected (name value).", form);
+    } else if (kind == LET_REC) {
+      lenv_bind(scope, b->cell[0]->sym, lval_qexpr());
+    }
+  }
+  for (int i = 0; !x && i < binds->count; i++) {
+    lval* b = binds->cell[i];
+    lval* val = lval_eval(kind == LET_PAR ? e : scope, lval_pop(b, 1));
+    if (val->type == LVAL_ERR) x = val;
+    else lenv_bind(scope, b->cell[0]->sym, val);
+  }
+  lval_del(binds);
+
+  if (x) lval_del(v);
+  else x = lval_eval_seq(scope, v);
+  lenv_del(scope);
+  return x;
+}
+
+/**
+ * Special form: (let ((name value) ...) body...), binding every name to
+ * its value evaluated in the enclosing scope, or (let {body}), which only
+ * opens a scope as the prelude's let did.
+ */
+static lval* special_let(lenv* e, lval* v) {
+  return lval_eval_let(e, v, "let", LET_PAR);
+}
+
+/**
+ * Special form: (let* ((name value) ...) body...), binding the names in
+ * order so each value can use the names before it.
+ */
+static lval* special_let_seq(lenv* e, lval* v) {
+  return lval_eval_let(e, v, "let*", LET_SEQ);
+}
+
+/**
+ * Special form: (letrec ((name value) ...) body...), binding every name
+ * to {} first so each value can refer to any of them.
+ */
+static lval* special_letrec(lenv* e, lval* v) {
+  return lval_eval_let(e, v, "letrec", LET_REC);
+}
+
+/**
+ * Run the body of a loop once per value of its variable. Numbers are
+ * stored into the variable's binding in place, so counting over a range
+ * or a list of Numbers allocates nothing per iteration beyond what the
+ * body itself evaluates. As with let, the scope is a frame on the C
+ * stack; under lexical scope every iteration gets a scope of its own
+ * instead, as closures made in the body may keep it.
+ * @param e The environment.
+ * @param var The variable.
+ * @param src The values: a Q-expression or a sequence.
+ * @param body The body expressions, as an S-expression.
+ * @return (), or the first error.
+ */
+static lval* lval_eval_loop(lenv* e, char* var, lval* src, lval* body) {
+  int lexical = lctx_current()->lexical;
+  lseq* range = NULL;
+  lseq_iter* it = NULL;
+  if (src->type == LVAL_SEQ) {
+    if (src->seq->kind == LSEQ_RANGE) range = src->seq;
+    else it = lseq_begin(src->seq);
+  }
+
+  lframe frame;
+  lenv* scope = NULL;
+  long i = range ? range->start : 0;
+  lval* x = NULL;
+  while (!x) {
+    /* The next value: a Number of the range, an element or produced */
+    lval* val = NULL;
+    long num = i;
+    if (range) {
+      if (range->step > 0 ? i >= range->end : i <= range->end) break;
+      i += range->step;
+    } else if (it) {
+      val = lseq_next(e, it);
+      if (!val) break;
+      if (val->type == LVAL_ERR) {
+        x = val;
+        break;
+      }
+    } else {
+      if (i >= src->count) break;
+      val = src->cell[i++];
+      if (val->type == LVAL_NUM) num = val->num, val = NULL;
+      else val = lval_copy(val);
+    }
+
+    if (!scope) {
+      if (lexical) {
+        scope = lenv_new();
+        lenv_link(scope, e);
+      } else {
+        scope = lframe_init(&frame, e);
+      }
+    }
+    /* The variable is the scope's first binding */
+    if (val) lenv_bind(scope, var, val);
+    else if (scope->count && scope->vals[0]->type == LVAL_NUM) scope->vals[0]->num = num;
+    else lenv_bind(scope, var, lval_num(num));
+
+    x = lctx_check();
+    if (!x) x = lval_eval_seq(scope, lval_copy(body));
+    if (x->type == LVAL_ERR) break;
+    lval_del(x);
+    x = NULL;
+    if (lexical) {
+      lenv_del(scope);
+      scope = NULL;
+    }
+  }
+  if (scope) lenv_del(scope);
+  if (it) lseq_end(it);
+  return x ? x : lval_sexpr();
+}
+
+/**
+ * Evaluate a loop form, (dotimes (name count) body...) or
+ * (for-each (name values) body...).
+ * @param e The environment.
+ * @param v The form, consumed.
+ * @param form Name of the form.
+ * @param counting Whether the values are a count rather than a list or
+ *                 sequence.
+ * @return (), or the first error.
+ */
+static lval* lval_eval_for(lenv* e, lval* v, char* form, int counting) {
+  LASSERT(v, v->count >= 2,
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected at least %i.",
+    form, v->count - 1, 1);
+  lval* spec = v->cell[1];
+  LASSERT(v, (spec->type == LVAL_SEXPR || spec->type == LVAL_QEXPR) && spec->count == 2
+          && spec->cell[0]->type == LVAL_SYM,
+    "Function '%s' passed incorrect binding. Expected (name %s).",
+    form, counting ? "count" : "values");
+
+  lval* src = lval_eval(e, lval_pop(spec, 1));
+  lval* err = NULL;
+  if (src->type == LVAL_ERR) {
+    err = src;
+  } else if (counting ? src->type != LVAL_NUM
+                      : src->type != LVAL_QEXPR && src->type != LVAL_SEQ) {
+    err = lval_err("Function '%s' passed incorrect type for %s. Got %s, Expected %s.",
+                   form, counting ? "count" : "values", ltype_name(src->type),
+                   ltype_name(counting ? LVAL_NUM : LVAL_QEXPR));
+    lval_del(src);
+  }
+  if (err) {
+    lval_del(v);
+    return err;
+  }
+
+  /* A count n runs over the range from 0 to n, which needs no allocation */
+  lseq count = { .kind = LSEQ_RANGE, .start = 0, .step = 1 };
+  lval counted = { .type = LVAL_SEQ, .seq = &count };
+  if (counting) {
+    count.end = src->num;
+    lval_del(src);
+    src = &counted;
+  }
+
+  lval_del(lval_pop(v, 0));
+  spec = lval_pop(v, 0);
+  lval* x = lval_eval_loop(e, spec->cell[0]->sym, src, v);
+  lval_del(spec);
+  if (!counting) lval_del(src);
+  lval_del(v);
+  return x;
+}
+
+/**
+ * Special form: (dotimes (name count) body...) evaluates the body with
+ * name bound to 0, 1, ... up to count - 1, and returns ().
+ */
+static lval* special_dotimes(lenv* e, lval* v) {
+  return lval_eval_for(e, v, "dotimes", 1);
+}
+
+/**
+ * Special form: (for-each (name values) body...) evaluates the body with
+ * name bound to each element of a list or sequence, and returns ().
+ */
+static lval* special_for_each(lenv* e, lval* v) {
+  return lval_eval_for(e, v, "for-each", 0);
+}
+
+/**
+ * Special form: (begin expr...) evaluates the expressions in order and
+ * returns the last. (do expr...) is the same; unlike the prelude's do it
+ * builds no argument list.
+ */
+static lval* special_begin(lenv* e, lval* v) {
+  lval_del(lval_pop(v, 0));
+  return lval_eval_seq(e, v);
+}
+
+/**
+ * Special form: (lambda (formals...) body...), also accepting {formals}
+ * and a {body} as \ does. Several body expressions are evaluated in order.
+ */
+static lval* special_lambda(lenv* e, lval* v) {
+  LASSERT(v, v->count >= 3,
+    "Function 'lambda' passed incorrect number of arguments. Got %i, Expected at least %i.",
+    v->count - 1, 2);
+  LASSERT(v, v->cell[1]->type == LVAL_SEXPR || v->cell[1]->type == LVAL_QEXPR,
+    "Function 'lambda' passed incorrect type for formals. Got %s, Expected %s.",
+    ltype_name(v->cell[1]->type), ltype_name(LVAL_SEXPR));
+  lval* formals = lval_pop(v, 1);
+  lval_del(lval_pop(v, 0));
+  lval* body = lval_body(lval_body_seq(v));
+  return lval_optimize(e, lval_make_lambda(e, "lambda", formals, body));
+}
+
+/**
+ * Special form: (define name value) binds a global variable to a value;
+ * (define (name formals...) body...) binds it to a function.
+ */
+static lval* special_define(lenv* e, lval* v) {
+  LASSERT(v, !lenv_root(e)->frozen,
+          "Function 'define' cannot define globals inside pmap, pfilter or preduce.");
+  lval* target = v->cell[1];
+
+  lval* name;
+  lval* x;
+  if (target->type == LVAL_SYM) {
+    LASSERT_FORM_NUM("define", v, 2);
+    name = lval_pop(v, 1);
+    x = lval_eval(e, lval_take(v, 1));
+  } else if (target->type == LVAL_SEXPR && target->count > 0
+             && target->cell[0]->type == LVAL_SYM) {
+    LASSERT(v, v->count >= 3,
+      "Function 'define' passed incorrect number of arguments. Got %i, Expected at least %i.",
+      v->count - 1, 2);
+    lval* formals = lval_pop(v, 1);
+    lval_del(lval_pop(v, 0));
+    lval* body = lval_body(lval_body_seq(v));
+    name = lval_pop(formals, 0);
+    x = lval_optimize(e, lval_make_lambda(e, "define", formals, body));
+    if (x->type == LVAL_FUN) ljit_attach(x, e, name->sym);
+  } else {
+    lval* err = lval_err("Function 'define' cannot define %s.", ltype_name(target->type));
+    lval_del(v);
+    return err;
+  }
+
+  if (x->type == LVAL_ERR) {
+    lval_del(name);
+    return x;
+  }
+  lenv_def(e, name, x);
+  lval_del(name);
+  lval_del(x);
+  return lval_sexpr();
+}
+
+/**
+ * Special form: (quote x) returns x unevaluated, with (...) as {...}.
+ */
+static lval* special_quote(lenv* e, lval* v) {
+  LASSERT_FORM_NUM("quote", v, 1);
+  lval* x = lval_take(v, 1);
+  if (x->type == LVAL_SEXPR) x->type = LVAL_QEXPR;
+  return x;
+}
+
+/* Special forms by name; a bit per entry marks it rebound (lspecial_rebound) */
+static const struct {
+  char* name;
+  lspecial form;
+} lspecial_forms[] = {
+  { "if", special_if }, { "cond", special_cond }, { "case", special_case },
+  { "select", special_select }, { "let", special_let }, { "let*", special_let_seq },
+  { "letrec", special_letrec }, { "lambda", special_lambda }, { "begin", special_begin },
+  { "do", special_begin }, { "define", special_define }, { "dotimes", special_dotimes },
+  { "for-each", special_for_each }, { "quote", special_quote },
+};
+
+/**
+ * Find the entry of the special form named by a symbol.
+ * @return Its index in lspecial_forms, or -1.
+ */
+static int lspecial_index(char* sym) {
+  for (size_t i = 0; i < sizeof(lspecial_forms) / sizeof(lspecial_forms[0]); i++) {
+    char* name = lspecial_forms[i].name;
+    if (name[0] == sym[0] && strcmp(name, sym) == 0) return i;
+  }
+  return -1;
+}
+
+/**
+ * Find the special form named by a symbol.
+ * @param sym The symbol.
+ * @return The form, or NULL if the symbol names none.
+ */
+lspecial lspecial_find(char* sym) {
+  int i = lspecial_index(sym);
+  return i < 0 ? NULL : lspecial_forms[i].form;
+}
+
+/**
+ * Find the special form a symbol heading an expression stands for. Like
+ * any other name, the name of a special form can be bound by a scope or
+ * rebound at the root; the expression is then an ordinary call.
+ * @param e The environment the expression is evaluated in.
+ * @param sym The head symbol.
+ * @return The form, or NULL if the symbol is not a special form here.
+ */
+lspecial lspecial_get(lenv* e, char* sym) {
+  int i = lspecial_index(sym);
+  if (i < 0) return NULL;
+  lctx* c = lctx_current();
+  if (__atomic_load_n(&c->specials_rebound, __ATOMIC_RELAXED) & 1u << i) return NULL;
+  if (lenv_shadowed(e, sym)) return NULL;
+  return lspecial_forms[i].form;
+}
+
+/**
+ * Note that a name was bound again at the root of the current context.
+ * A special form of that name stops being one, as the name now stands
+ * for the new value; the first binding of a name, such as the prelude's
+ * definition of do, leaves the form in place.
+ * @param sym The name.
+ */
+void lspecial_rebound(char* sym) {
+  int i = lspecial_index(sym);
+  lctx* c = lctx_current();
+  if (i >= 0 && c) __atomic_or_fetch(&c->specials_rebound, 1u << i, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,203 @@
+// File: stats.c
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Every thread counts into a slot of its own, so counting costs no more
+ * than a TLS load and an add, however many threads run. Reading sums the
+ * slots of the running threads and the counts of the threads that have
+ * exited. A slot's counters are only written by its thread, with relaxed
+ * stores that readers on other threads load atomically.
+ *
+ * live is the sum over threads, so an lval freed by another thread than
+ * the one that allocated it is still counted right. peak is kept by each
+ * thread for its own live count (one thread cannot see the others'
+ * without the shared counter this avoids): the reported peak is the
+ * highest of those and of the current live total, which is exact as long
+ * as one thread does the allocating.
+ */
+
+/* One thread's counters, in the list of running threads */
+typedef struct lstats_slot {
+  lstats counts;
+  struct lstats_slot* next;
+} lstats_slot;
+
+__thread lstats* lstats_mine __attribute__((tls_model("initial-exec")));
+
+static pthread_mutex_t lstats_lock = PTHREAD_MUTEX_INITIALIZER;
+static lstats_slot* lstats_slots;     // Slots of running threads
+static lstats lstats_retired;         // Sums of exited threads
+static pthread_key_t lstats_key;
+static pthread_once_t lstats_key_once = PTHREAD_ONCE_INIT;
+
+/* Counter names, as used by the stats builtin, in struct order */
+static const struct {
+  char* name;
+  size_t offset;
+} lstats_fields[] = {
+  { "allocs", offsetof(lstats, allocs) },
+  { "frees", offsetof(lstats, frees) },
+  { "live", offsetof(lstats, live) },
+  { "peak", offsetof(lstats, peak) },
+  { "copies", offsetof(lstats, copies) },
+  { "copy-bytes", offsetof(lstats, copy_bytes) },
+  { "lookups", offsetof(lstats, lookups) },
+  { "lookup-depth", offsetof(lstats, lookup_depth) },
+  { "cache-hits", offsetof(lstats, cache_hits) },
+  { "cache-misses", offsetof(lstats, cache_misses) },
+  { "calls", offsetof(lstats, calls) },
+  { "fast-hits", offsetof(lstats, fast_hits) },
+  { "fast-misses", offsetof(lstats, fast_misses) },
+};
+
+#define LSTATS_FIELDS (sizeof(lstats_fields) / sizeof(lstats_fields[0]))
+
+/**
+ * Get the address of a counter by its index in lstats_fields.
+ */
+static long* lstats_at(lstats* s, size_t i) {
+  return (long*)((char*)s + lstats_fields[i].offset);
+}
+
+/**
+ * Read a counter by its index in lstats_fields.
+ */
+static long lstats_field(lstats* s, size_t i) {
+  return *lstats_at(s, i);
+}
+
+/**
+ * Add one thread's counters into a total; peak takes the highest.
+ */
+static void lstats_sum(lstats* total, lstats* s) {
+  for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+    long x = __atomic_load_n(lstats_at(s, i), __ATOMIC_RELAXED);
+    long* t = lstats_at(total, i);
+    if (lstats_at(s, i) == &s->peak) {
+      if (x > *t) *t = x;
+    } else {
+      *t += x;
+    }
+  }
+}
+
+/**
+ * Retire the slot of an exiting thread, keeping its counts.
+ * @param p The slot.
+ */
+static void lstats_retire(void* p) {
+  lstats_slot* slot = p;
+  pthread_mutex_lock(&lstats_lock);
+  lstats_slot** at = &lstats_slots;
+  while (*at != slot) at = &(*at)->next;
+  *at = slot->next;
+  lstats_sum(&lstats_retired, &slot->counts);
+  pthread_mutex_unlock(&lstats_lock);
+  lstats_mine = NULL;
+  free(slot);
+}
+
+/**
+ * Create the key that retires slots.
+ */
+static void lstats_key_create(void) {
+  pthread_key_create(&lstats_key, lstats_retire);
+}
+
+/**
+ * Give the calling thread its counters. Used by LSTATS_MINE on the
+ * thread's first count.
+ * @return The thread's counters.
+ */
+lstats* lstats_register(void) {
+  lstats_slot* slot = calloc(1, sizeof(lstats_slot));
+  pthread_once(&lstats_key_once, lstats_key_create);
+  pthread_setspecific(lstats_key, slot);
+
+  pthread_mutex_lock(&lstats_lock);
+  slot->next = lstats_slots;
+  lstats_slots = slot;
+  pthread_mutex_unlock(&lstats_lock);
+
+  lstats_mine = &slot->counts;
+  return lstats_mine;
+}
+
+/**
+ * Take a snapshot of the counters, summed over every thread.
+ * @param out Receives the counters.
+ */
+void lstats_get(lstats* out) {
+  memset(out, 0, sizeof(lstats));
+  pthread_mutex_lock(&lstats_lock);
+  lstats_sum(out, &lstats_retired);
+  for (lstats_slot* slot = lstats_slots; slot; slot = slot->next) {
+    lstats_sum(out, &slot->counts);
+  }
+  pthread_mutex_unlock(&lstats_lock);
+  if (out->live > out->peak) out->peak = out->live;
+}
+
+/**
+ * Print the counters, one "name value" line each.
+ * @param f The stream.
+ */
+void lstats_print(FILE* f) {
+  lstats s;
+  lstats_get(&s);
+  for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+    fprintf(f, "%-14s %li\n", lstats_fields[i].name, lstats_field(&s, i));
+  }
+}
+
+/**
+ * Find a counter by name.
+ * @return Its index in lstats_fields, or -1.
+ */
+static int lstats_find(char* name) {
+  for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+    if (strcmp(name, lstats_fields[i].name) == 0) return i;
+  }
+  return -1;
+}
+
+/**
+ * Builtin: Get interpreter counters as {name value} pairs.
+ * Takes a list of counter names; an empty list selects all of them.
+ */
+lval* builtin_stats(lenv* e, lval* a) {
+  LASSERT_NUM("stats", a, 1);
+  LASSERT_TYPE("stats", a, 0, LVAL_QEXPR);
+
+  lval* names = a->cell[0];
+  for (int i = 0; i < names->count; i++) {
+    LASSERT(a, names->cell[i]->type == LVAL_SYM,
+      "Function 'stats' expects counter names. Got %s.",
+      ltype_name(names->cell[i]->type));
+    LASSERT(a, lstats_find(names->cell[i]->sym) >= 0,
+      "Function 'stats' has no counter '%s'.", names->cell[i]->sym);
+  }
+
+  lstats s;
+  lstats_get(&s);
+
+  lval* x = lval_qexpr();
+  for (size_t i = 0; i < LSTATS_FIELDS; i++) {
+    int wanted = names->count == 0;
+    for (int j = 0; j < names->count; j++) {
+      if (lstats_find(names->cell[j]->sym) == (int)i) wanted = 1;
+    }
+    if (!wanted) continue;
+    lval* pair = lval_qexpr();
+    lval_add(pair, lval_sym(lstats_fields[i].name));
+    lval_add(pair, lval_num(lstats_field(&s, i)));
+    lval_add(x, pair);
+  }
+
+  lval_del(a);
+  return x;
+}
@@ -0,0 +1,179 @@
+// File: str.c
+#include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * Find the first occurrence of a pattern in a byte string.
+ * @param s The string.
+ * @param n Length of the string.
+ * @param pat The pattern.
+ * @param m Length of the pattern (must be non-zero).
+ * @param from Offset to start searching at.
+ * @return Offset of the match, or -1 if there is none.
+ */
+long lstr_find(const char* s, size_t n, const char* pat, size_t m, size_t from) {
+  while (from + m <= n) {
+    const char* hit = memchr(s + from, pat[0], n - from - m + 1);
+    if (!hit) return -1;
+    from = hit - s;
+    if (memcmp(hit, pat, m) == 0) return from;
+    from++;
+  }
+  return -1;
+}
+
+/**
+ * Builtin: Length of a string in bytes.
+ */
+lval* builtin_str_len(lenv* e, lval* a) {
+  LASSERT_NUM("str-len", a, 1);
+  LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+  lval* x = lval_num(a->cell[0]->len);
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Concatenate strings.
+ * The total length is computed first so the result is allocated once.
+ */
+lval* builtin_str_cat(lenv* e, lval* a) {
+  size_t total = 0;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("str-cat", a, i, LVAL_STR);
+    total += a->cell[i]->len;
+  }
+
+  lval* x = lval_str_alloc(total);
+  char* p = x->str;
+  for (int i = 0; i < a->count; i++) {
+    memcpy(p, a->cell[i]->str, a->cell[i]->len);
+    p += a->cell[i]->len;
+  }
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Substring from a start offset, optionally limited in length.
+ */
+lval* builtin_substr(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'substr' passed incorrect number of arguments. Got %i, Expected 2 or 3.",
+          a->count);
+  LASSERT_TYPE("substr", a, 0, LVAL_STR);
+  LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+  if (a->count == 3) LASSERT_TYPE("substr", a, 2, LVAL_NUM);
+
+  lval* s = a->cell[0];
+  long start = a->cell[1]->num;
+  long n = a->count == 3 ? a->cell[2]->num : (long)s->len - start;
+  LASSERT(a, start >= 0 && (size_t)start <= s->len,
+          "Function 'substr' start %li out of range for string of length %li.",
+          start, (long)s->len);
+  LASSERT(a, n >= 0 && (size_t)n <= s->len - start,
+          "Function 'substr' length %li out of range from start %li.", n, start);
+
+  lval* x = lval_str_n(s->str + start, n);
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Split a string on a separator.
+ * An empty separator splits the string into single characters.
+ */
+lval* builtin_str_split(lenv* e, lval* a) {
+  LASSERT_NUM("str-split", a, 2);
+  LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+
+  lval* s = a->cell[0];
+  lval* sep = a->cell[1];
+  lval* x = lval_qexpr();
+
+  if (sep->len == 0) {
+    for (size_t i = 0; i < s->len; i++) {
+      x = lval_add(x, lval_str_n(s->str + i, 1));
+    }
+    lval_del(a);
+    return x;
+  }
+
+  size_t start = 0;
+  long hit;
+  while ((hit = lstr_find(s->str, s->len, sep->str, sep->len, start)) != -1) {
+    x = lval_add(x, lval_str_n(s->str + start, hit - start));
+    start = hit + sep->len;
+  }
+  x = lval_add(x, lval_str_n(s->str + start, s->len - start));
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Join a list of strings with a separator.
+ */
+lval* builtin_str_join(lenv* e, lval* a) {
+  LASSERT_NUM("str-join", a, 2);
+  LASSERT_TYPE("str-join", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-join", a, 1, LVAL_QEXPR);
+
+  lval* sep = a->cell[0];
+  lval* l = a->cell[1];
+  size_t total = 0;
+  for (int i = 0; i < l->count; i++) {
+    LASSERT(a, l->cell[i]->type == LVAL_STR,
+            "Function 'str-join' passed incorrect type for list element %i. Got %s, Expected %s.",
+            i, ltype_name(l->cell[i]->type), ltype_name(LVAL_STR));
+    total += l->cell[i]->len + (i ? sep->len : 0);
+  }
+
+  lval* x = lval_str_alloc(total);
+  char* p = x->str;
+  for (int i = 0; i < l->count; i++) {
+    if (i) {
+      memcpy(p, sep->str, sep->len);
+      p += sep->len;
+    }
+    memcpy(p, l->cell[i]->str, l->cell[i]->len);
+    p += l->cell[i]->len;
+  }
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Parse a string as a number.
+ */
+lval* builtin_str_to_num(lenv* e, lval* a) {
+  LASSERT_NUM("str->num", a, 1);
+  LASSERT_TYPE("str->num", a, 0, LVAL_STR);
+
+  lval* s = a->cell[0];
+  char* end;
+  errno = 0;
+  long x = strtol(s->str, &end, 10);
+  LASSERT(a, s->len > 0 && end == s->str + s->len && errno != ERANGE,
+          "Function 'str->num' could not convert \"%s\" to a number.", s->str);
+  lval_del(a);
+  return lval_num(x);
+}
+
+/**
+ * Builtin: Render a number as a string.
+ */
+lval* builtin_num_to_str(lenv* e, lval* a) {
+  LASSERT_NUM("num->str", a, 1);
+  LASSERT_TYPE("num->str", a, 0, LVAL_NUM);
+
+  char digits[24];
+  lbuf b;
+  lbuf_init(&b, digits, sizeof(digits), NULL);
+  lbuf_num(&b, a->cell[0]->num);
+  lval_del(a);
+  return lval_str_n(digits, b.len);
+}
@@ -0,0 +1,276 @@
+// File: task.c
+#define _XOPEN_SOURCE 700
+#include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of the stack tasks run on */
+#define LSCHED_STACK (8 << 20)
+
+/* Bytes kept below the frame of a suspending task, covering its locals */
+#define LTASK_MARGIN 256
+
+/*
+ * Tasks are coroutines on the interpreter's own thread. They all run on
+ * one shared stack: when a task suspends, the used part of the stack is
+ * copied out, and it is copied back before the task resumes. A suspended
+ * task therefore costs only the few kilobytes its call chain actually
+ * uses, so hundreds of thousands of them fit in memory at once.
+ */
+
+/**
+ * Get the scheduler of the current context, creating it on first use.
+ * @return The scheduler.
+ */
+static lsched* lsched_get(void) {
+  lctx* c = lctx_current();
+  if (!c->sched) {
+    lsched* s = malloc(sizeof(lsched));
+    s->stack_size = LSCHED_STACK;
+    s->stack = malloc(s->stack_size);
+    s->current = NULL;
+    s->head = NULL;
+    s->tail = NULL;
+    s->count = 0;
+    s->spawned = 0;
+    s->owner = pthread_self();
+    c->sched = s;
+  }
+  return c->sched;
+}
+
+/**
+ * Check whether tasks may be used from the calling thread: not from a
+ * pool worker, which shares its caller's context, nor from any thread
+ * other than the one that created the scheduler. Checked before the
+ * scheduler is created, so a worker can never create it.
+ */
+static int lsched_usable(void) {
+  if (lpool_in_worker()) return 0;
+  lsched* s = lctx_current()->sched;
+  return !s || pthread_equal(pthread_self(), s->owner);
+}
+
+/**
+ * Check that tasks are used from the thread that owns the scheduler.
+ */
+#define LASSERT_SCHED(func, args) \
+  LASSERT(args, lsched_usable(), \
+    "Function '%s' cannot be used from a parallel worker.", func)
+
+/**
+ * Check that a task is not suspended while its thread runs a parallel job.
+ */
+#define LASSERT_RESUMABLE(func, args) \
+  LASSERT(args, !lpool_in_job(), \
+    "Function '%s' cannot suspend inside pmap, pfilter or preduce.", func)
+
+/**
+ * Drop a reference to a task, freeing it when unused.
+ * @param t The task.
+ */
+void ltask_release(ltask* t) {
+  if (LREF_DEC(t) > 0) return;
+  if (t->fn) lval_del(t->fn);
+  if (t->args) lval_del(t->args);
+  if (t->result) lval_del(t->result);
+  lfree(t->saved);
+  lfree(t);
+}
+
+/**
+ * Add a task to the back of the run queue.
+ */
+static void lsched_push(lsched* s, ltask* t) {
+  t->next = NULL;
+  if (s->tail) s->tail->next = t; else s->head = t;
+  s->tail = t;
+  s->count++;
+}
+
+/**
+ * Take the task at the front of the run queue.
+ */
+static ltask* lsched_pop(lsched* s) {
+  ltask* t = s->head;
+  s->head = t->next;
+  if (!s->head) s->tail = NULL;
+  s->count--;
+  return t;
+}
+
+/**
+ * Entry point of every task, running on the shared stack.
+ * Returning switches back to the scheduler through uc_link.
+ */
+static void ltask_main(void) {
+  lctx* c = lctx_current();
+  ltask* t = c->sched->current;
+
+  lval* f = t->fn;
+  lval* args = t->args;
+  t->fn = NULL;
+  t->args = NULL;
+  t->result = lval_call(c->env, f, args);
+  lval_del(f);
+  t->done = 1;
+}
+
+/**
+ * Suspend the running task and switch back to the scheduler.
+ * Kept out of line so the frame address marks the bottom of the task's
+ * call chain; the scheduler saves the stack from there up.
+ */
+__attribute__((noinline))
+static void ltask_suspend(lsched* s, ltask* t) {
+  char* sp = (char*)__builtin_frame_address(0) - LTASK_MARGIN;
+  t->sp = sp > s->stack ? sp : s->stack;
+  swapcontext(&t->uc, &s->root);
+}
+
+/**
+ * Run a task until it finishes or suspends.
+ * Must be called from the root, off the shared stack.
+ * @param s The scheduler.
+ * @param t The task.
+ */
+static void lsched_step(lsched* s, ltask* t) {
+  s->current = t;
+  if (!t->started) {
+    t->started = 1;
+    getcontext(&t->uc);
+    t->uc.uc_stack.ss_sp = s->stack;
+    t->uc.uc_stack.ss_size = s->stack_size;
+    t->uc.uc_link = &s->root;
+    makecontext(&t->uc, ltask_main, 0);
+  } else {
+    memcpy(t->sp, t->saved, t->saved_len);
+  }
+  /* Tasks share the thread's profiler stack; undo whatever they left on it */
+  int depth = lprof_depth();
+  swapcontext(&s->root, &t->uc);
+  lprof_set_depth(depth);
+  s->current = NULL;
+
+  if (t->done) {
+    lfree(t->saved);
+    t->saved = NULL;
+    t->saved_len = t->saved_cap = 0;
+    return;
+  }
+
+  /* Save the used part of the stack; it grows down from the top */
+  t->saved_len = s->stack + s->stack_size - t->sp;
+  if (t->saved_len > t->saved_cap) {
+    t->saved_cap = t->saved_len;
+    t->saved = lrealloc(t->saved, t->saved_cap);
+  }
+  memcpy(t->saved, t->sp, t->saved_len);
+}
+
+/**
+ * Run the task at the front of the queue for one step, requeueing it
+ * unless it finished.
+ */
+static void lsched_turn(lsched* s) {
+  ltask* t = lsched_pop(s);
+  lsched_step(s, t);
+  if (t->done) ltask_release(t); else lsched_push(s, t);
+}
+
+/**
+ * Run every queued task to completion.
+ * @param s The scheduler.
+ */
+void lsched_run(lsched* s) {
+  while (s->head) lsched_turn(s);
+}
+
+/**
+ * Delete a scheduler. Its run queue must be empty.
+ * @param s The scheduler.
+ */
+void lsched_del(lsched* s) {
+  free(s->stack);
+  free(s);
+}
+
+/**
+ * Builtin: Start calling a function with arguments as a task.
+ * The task runs in the global environment when the caller awaits or yields.
+ */
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "Function 'spawn' passed no arguments.");
+  LASSERT_TYPE("spawn", a, 0, LVAL_FUN);
+
+  LASSERT_SCHED("spawn", a);
+  lsched* s = lsched_get();
+  ltask* t = lalloc(sizeof(ltask));
+  t->refs = 2;
+  t->id = ++s->spawned;
+  t->started = 0;
+  t->done = 0;
+  t->fn = lval_pop(a, 0);
+  t->args = a;
+  t->result = NULL;
+  t->waiting = NULL;
+  t->sp = NULL;
+  t->saved = NULL;
+  t->saved_len = 0;
+  t->saved_cap = 0;
+  lsched_push(s, t);
+  return lval_task(t);
+}
+
+/**
+ * Builtin: Wait for a task to finish and return its result.
+ * At the top level the scheduler runs other tasks meanwhile; inside a
+ * task, the task suspends until the awaited one is done. Awaiting a task
+ * that is, directly or through others, awaiting the caller is an error.
+ */
+lval* builtin_await(lenv* e, lval* a) {
+  LASSERT_NUM("await", a, 1);
+  LASSERT_TYPE("await", a, 0, LVAL_TASK);
+
+  LASSERT_RESUMABLE("await", a);
+  LASSERT_SCHED("await", a);
+  lsched* s = lsched_get();
+  ltask* t = a->cell[0]->task;
+  LASSERT(a, t != s->current, "Function 'await' passed the task running it.");
+
+  if (s->current) {
+    /* Tasks awaiting each other in a cycle would never be resumed */
+    for (ltask* w = t; w; w = w->waiting) {
+      LASSERT(a, w != s->current, "Function 'await' passed a task that is awaiting this one.");
+    }
+    ltask* self = s->current;
+    self->waiting = t;
+    while (!t->done) ltask_suspend(s, self);
+    self->waiting = NULL;
+  } else {
+    while (!t->done) lsched_turn(s);
+  }
+
+  lval* x = lval_copy(t->result);
+  lval_del(a);
+  return x;
+}
+
+/**
+ * Builtin: Let other tasks run, then return the argument.
+ * Inside a task this suspends the task; at the top level every queued
+ * task runs for one step.
+ */
+lval* builtin_yield(lenv* e, lval* a) {
+  LASSERT_NUM("yield", a, 1);
+
+  LASSERT_RESUMABLE("yield", a);
+  LASSERT_SCHED("yield", a);
+  lsched* s = lsched_get();
+  if (s->current) {
+    ltask_suspend(s, s->current);
+  } else {
+    for (long n = s->count; n > 0; n--) lsched_turn(s);
+  }
+  return lval_take(a, 0);
+}
@@ -0,0 +1,183 @@
+// File: api_test.c
+// Tests of the embedding interface (src/lispy.h), run by `make test`.
+#include "lispy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Number of contexts evaluating at the same time */
+#define THREADS 3
+
+static int failures;
+
+/**
+ * Record a failed check.
+ */
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/**
+ * Check that a value is a number, then free it.
+ */
+static void check_num(lispy* c, lispy_val* v, long expected, int line) {
+  if (lispy_type(v) != LISPY_NUM || lispy_to_num(v) != expected) {
+    char* s = lispy_to_string(v);
+    fprintf(stderr, "%s:%d: expected %ld, got %s\n", __FILE__, line, expected, s);
+    free(s);
+    failures++;
+  }
+  lispy_val_free(c, v);
+}
+
+#define CHECK_NUM(c, v, expected) check_num(c, v, expected, __LINE__)
+
+/**
+ * Native builtin: sum of its number arguments, evaluating a nested
+ * expression through the current context.
+ */
+static lispy_val* native_sum(lispy_env* env, lispy_val* args) {
+  (void)env;
+  lispy* c = lispy_current();
+  long sum = 0;
+  for (int i = 0; i < lispy_count(args); i++) {
+    sum += lispy_to_num(lispy_item(args, i));
+  }
+  lispy_val_free(c, args);
+
+  lispy_val* one = lispy_eval(c, "(- 2 1)");
+  sum += lispy_to_num(one);
+  lispy_val_free(c, one);
+  return lispy_num(c, sum);
+}
+
+/**
+ * Fast path of native_sum for two numbers.
+ */
+static int native_sum_fast(long x, long y, long* out) {
+  *out = x + y + 1;
+  return 1;
+}
+
+/* Blocks held from the counting allocator */
+static long counted_blocks;
+
+/**
+ * Allocator hooks that count the blocks they hand out.
+ */
+static void* counted_alloc(size_t size) {
+  counted_blocks++;
+  return malloc(size);
+}
+
+static void* counted_realloc(void* ptr, size_t size) {
+  if (!ptr) counted_blocks++;
+  return realloc(ptr, size);
+}
+
+static void counted_free(void* ptr) {
+  if (ptr) counted_blocks--;
+  free(ptr);
+}
+
+/* Results of the contexts run by the threads */
+static long thread_results[THREADS];
+
+/**
+ * Evaluate in a context of its own; run by several threads at once.
+ */
+static void* run_context(void* arg) {
+  long n = (long)(size_t)arg;
+  lispy* c = lispy_new();
+  lispy_val_free(c, lispy_eval(c, "(def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))"));
+
+  lispy_val* args[1] = { lispy_num(c, 15 + n) };
+  lispy_val* r = lispy_call(c, "fib", 1, args);
+  thread_results[n] = lispy_type(r) == LISPY_NUM ? lispy_to_num(r) : -1;
+  lispy_val_free(c, r);
+  lispy_free(c);
+  return NULL;
+}
+
+int main(void) {
+  lispy* c = lispy_new();
+  lispy_val_free(c, lispy_load(c, "../lib/library.lspy"));
+
+  /* Evaluation, definitions and calls */
+  CHECK_NUM(c, lispy_eval(c, "(+ 1 2) (* 6 7)"), 42);
+  lispy_def(c, "limit-value", lispy_num(c, 10));
+  lispy_val_free(c, lispy_eval(c, "(fun {rule x} {> x limit-value})"));
+  lispy_val* args[1] = { lispy_num(c, 42) };
+  CHECK_NUM(c, lispy_call(c, "rule", 1, args), 1);
+  CHECK_NUM(c, lispy_get(c, "limit-value"), 10);
+
+  lispy_val* err = lispy_eval(c, "(/ 1 0)");
+  CHECK(lispy_type(err) == LISPY_ERR);
+  lispy_val_free(c, err);
+
+  /* Values */
+  lispy_val* s = lispy_str_n(c, "a\0b", 3);
+  size_t len = 0;
+  CHECK(memcmp(lispy_to_str(s, &len), "a\0b", 3) == 0 && len == 3);
+  lispy_val_free(c, s);
+
+  lispy_val* l = lispy_push(c, lispy_push(c, lispy_list(c), lispy_num(c, 1)), lispy_str(c, "x"));
+  CHECK(lispy_type(l) == LISPY_QEXPR && lispy_count(l) == 2);
+  char* text = lispy_to_string(l);
+  CHECK(strcmp(text, "{1 \"x\"}") == 0);
+  free(text);
+  lispy_val_free(c, l);
+
+  /* Native builtins, with and without a fast path */
+  lispy_register(c, "native-sum", native_sum);
+  CHECK_NUM(c, lispy_eval(c, "(native-sum 1 2 3)"), 7);
+  lispy_register_fast(c, "native-add", native_sum, native_sum_fast);
+  CHECK_NUM(c, lispy_eval(c, "(native-add 1 2)"), 4);
+
+  /* Limits */
+  lispy_limit(c, 1000, 0);
+  err = lispy_eval(c, "(fib 25)");
+  CHECK(lispy_type(err) == LISPY_ERR);
+  lispy_val_free(c, err);
+  lispy_limit(c, 0, 0);
+
+  lispy_quota(c, 100000);
+  err = lispy_eval(c, "(len (realize (range 100000)))");
+  CHECK(lispy_type(err) == LISPY_ERR);
+  lispy_val_free(c, err);
+  lispy_quota(c, 0);
+  CHECK(lispy_memory(c) > 0);
+
+  lispy_free(c);
+
+  /* Custom allocator; blocks go back to the context they came from */
+  lispy* a = lispy_new_with_allocator(counted_alloc, counted_realloc, counted_free);
+  CHECK(counted_blocks > 0);
+  lispy_val* v = lispy_eval(a, "(list 1 2 3)");
+  long used = lispy_memory(a);
+  lispy* b = lispy_new();
+  lispy_val_free(b, v);
+  CHECK(lispy_memory(a) < used);
+  lispy_free(b);
+  lispy_free(a);
+  CHECK(counted_blocks == 0);
+
+  /* Independent contexts on several threads */
+  pthread_t threads[THREADS];
+  for (long i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, run_context, (void*)(size_t)i);
+  }
+  for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+  CHECK(thread_results[0] == 610 && thread_results[1] == 987 && thread_results[2] == 1597);
+
+  if (failures) {
+    fprintf(stderr, "%i check(s) failed\n", failures);
+    return 1;
+  }
+  printf("api_test: all checks passed\n");
+  return 0;
+}
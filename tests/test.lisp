@@ -14,5 +14,161 @@
 ; Conditional and logic
 (print (if (> 5 3) {true} {false}))  ; Expected: 1 (true)
 
+; Rendering values to strings
+(print (to-string (list 1 "a\n" (+ 2 3))))  ; Expected: "{1 \"a\\n\" 5}"
+
+; Strings
+(print (str-len "a\0b"))  ; Expected: 3
+(print (str-cat "foo" "-" "bar"))  ; Expected: "foo-bar"
+(print (substr "hello world" 6 5))  ; Expected: "world"
+(print (str-join "+" (str-split "1,2,3" ",")))  ; Expected: "1+2+3"
+(print (+ (str->num "40") 2) (num->str 7))  ; Expected: 42 "7"
+
+; Ropes and string builders
+(print (rope-slice (rope "hello, " "world") 7 5))  ; Expected: "world"
+(def {deep} (foldl (\ {r i} {rope r (num->str i) "-abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklm"}) "" (realize (range 300))))
+(print (rope-len deep) (rope-slice deep 20521 7))  ; Expected: 20590 "299-abc"
+(def {sb} (string-builder "n="))
+(append! sb 1 "," 2)
+(print (rope->str sb))  ; Expected: "n=1,2"
+
+; File I/O
+(def {out} (open "/tmp/lispy-test.txt" "w"))
+(write out "first\n" 2 "\nthird")
+(close out)
+(def {in} (open "/tmp/lispy-test.txt"))
+(print (read-line in) (read-line in) (read-all in))  ; Expected: "first" "2" "third"
+(close in)
+(for-each-line "/tmp/lispy-test.txt" (\ {l} {print (str-len l)}))  ; Expected: 5 1 5
+(def {in} (open "/tmp/lispy-test.txt"))
+(print (for-each-line in (\ {l} {close in})))  ; Expected: Error: Function 'for-each-line' had file "/tmp/lispy-test.txt" closed while reading it.
+
+; Regular expressions
+(print (re-match "[0-9]+" "2024"))  ; Expected: 1
+(print (re-find-all "[0-9]+" "a1 b22 c333"))  ; Expected: {"1" "22" "333"}
+(print (re-split ", *" "a, b,c"))  ; Expected: {"a" "b" "c"}
+(print (re-match "a.b" "a\0b"))  ; Expected: 1
+(print (re-find-all "[0-9]+" "1\02"))  ; Expected: {"1" "2"}
+(print (len (re-find-all "." "a\0b")) (re-find-all "a.b" "xa\0by"))  ; Expected: 3 {"a\0b"}
+
+; Parallel functions
+(print (pmap (\ {x} {* x x}) {1 2 3 4 5}))  ; Expected: {1 4 9 16 25}
+(print (pfilter (\ {x} {> x 2}) {1 2 3 4 5}))  ; Expected: {3 4 5}
+(print (preduce + 0 {1 2 3 4 5 6 7 8 9 10}))  ; Expected: 55
+(print (pmap (\ {x} {/ 1 x}) {1 0 2}))  ; Expected: Error: Division By Zero.
+(def {pm-sb} (string-builder "a"))
+(print (pmap (\ {x} {x}) (list 1 pm-sb)))  ; Expected: Error: Function 'pmap' cannot share a string builder between threads.
+(print (pmap (\ {x} {pm-sb}) {1}))  ; Expected: Error: 'pm-sb' is a string builder and cannot be used inside pmap, pfilter or preduce.
+(print (pfilter (\ {x} {def {pm-x} x}) {1}))  ; Expected: Error: Function 'def' cannot define globals inside pmap, pfilter or preduce.
+
+; Fast-call builtins
+(print (foldl * 1 {1 2 3 4}) (- 5) (+ 1 2 3))  ; Expected: 24 -5 6
+(print (/ 1 0))  ; Expected: Error: Division By Zero.
+
+; Tasks
+(fun {worker n} {do (yield n) (* n 10)})
+(def {ta} (spawn worker 1))
+(def {tb} (spawn worker 2))
+(print (await tb) (await ta))  ; Expected: 20 10
+(print ta)  ; Expected: <task 1 done>
+(print (await (spawn (\ {t} {+ 1 (await t)}) (spawn worker 3))))  ; Expected: 31
+(print (await (spawn (\ {x} {/ x 0}) 5)))  ; Expected: Error: Division By Zero.
+(print (await (spawn (\ {x} {pmap (\ {y} {yield y}) {x}}) 1)))  ; Expected: Error: Function 'yield' cannot suspend inside pmap, pfilter or preduce.
+(def {tc} (spawn (\ {x} {await td}) 0))
+(def {td} (spawn (\ {x} {await tc}) 0))
+(print (await tc))  ; Expected: Error: Function 'await' passed a task that is awaiting this one.
+
+; Interpreter counters
+(print (len (stats {})))  ; Expected: 13
+(print (head (fst (stats {calls}))))  ; Expected: {calls}
+(print (> (snd (fst (stats {allocs}))) 0))  ; Expected: 1
+(print (stats {bogus}))  ; Expected: Error: Function 'stats' has no counter 'bogus'.
+(print (- 100 1 2 3) (/ 100 5 2) (* 2 3 4))  ; Expected: 94 10 24
+(print (< 1 2 3))  ; Expected: Error: Function '<' passed incorrect number of arguments. Got 3, Expected 2.
+(print (> (snd (fst (stats {fast-hits}))) 0))  ; Expected: 1
+
+; Evaluation limits
+(print (limit 1000 0 {fib 20}))  ; Expected: Error: Evaluation ran out of fuel.
+(print (limit 0 20 {dotimes (i 9223372036854775807) i}))  ; Expected: Error: Evaluation exceeded its deadline.
+(print (limit 100000 1000 {fib 5}))  ; Expected: 5
+
+; Memory quotas
+(fun {grow n l} {if (== n 0) {l} {grow (- n 1) (join l {0})}})
+(print (quota 100000 {len (grow 10000 {})}))  ; Expected: Error: Evaluation exceeded its memory quota.
+(print (quota 100000 {len (grow 10 {})}))  ; Expected: 10
+(def {qb} (string-builder ""))
+(print (quota 20000 {dotimes (i 100000) (append! qb "0123456789")}))  ; Expected: Error: Evaluation exceeded its memory quota.
+
+; Special forms
+(print (if (> 2 1) 10 (error "not evaluated")))  ; Expected: 10
+(print (if 1 (list 1 2) 0) (if 1 (tail {1 2 3}) 0))  ; Expected: {1 2} {2 3}
+(fun {shadow-if if} {if 1 2 3})
+(print (shadow-if (\ {a b c} {+ a b c})) (if 1 2 3))  ; Expected: 6 2
+(print (cond ((== 1 2) 10) ((== 1 1) 20 30)))  ; Expected: 30
+(print (let ((x 2) (y 3)) (* x y)))  ; Expected: 6
+(define (square x) (* x x))
+(print ((lambda (x) (square (+ x 1))) 4) (quote (1 x)))  ; Expected: 25 {1 x}
+(print (let* ((a 2) (b (* a 3))) (+ a b)))  ; Expected: 8
+(print (letrec ((ev (lambda (n) (if (== n 0) 1 (od (- n 1))))) (od (lambda (n) (if (== n 0) 0 (ev (- n 1)))))) (ev 10)))  ; Expected: 1
+(print (begin (def {q} 5) (+ q 1)) (do 1 2 3))  ; Expected: 6 3
+(print (select {(== 1 2) 10} {otherwise 20}) (case 2 {1 10} {2 20}))  ; Expected: 20 20
+
+; Definition-time optimization
+(fun {secs h} {* h (* 60 60)})
+(print secs (secs 2))  ; Expected: (\ {h} {* h 3600}) 7200
+(fun {none-first l} {not (fst l)})
+(print none-first (none-first {0 1}))  ; Expected: (\ {l} {not (fst l)}) 1
+(fun {sub2 b a} {flip - b a})
+(print (sub2 10 3))  ; Expected: -7
+(fun {item-of l} {fst l})
+(fun {twice-item l} {* 2 (item-of l)})
+(fun {item-of l} {snd l})
+(print (twice-item {1 5}))  ; Expected: 10
+(fun {fold6 x} {+ x (* 2 3)})
+(fun {fold6-with *} {fold6 1})
+(print (fold6-with +))  ; Expected: 6
+(def {times} *)
+(def {*} -)
+(print (fold6 1) secs)  ; Expected: 0 (\ {h} {* h 3600})
+(def {*} times)
+(print (secs 2))  ; Expected: 7200
+
+; Compiled functions see a caller's bindings under dynamic scope
+(def {jn} 1)
+(fun {jadd x} {+ x jn})
+(fun {callit jn} {jadd 1})
+(print (do (dotimes (i 150) (callit 100)) (callit 100)))  ; Expected: 101
+(fun {jinc x} {+ x 1})
+(fun {jcall +} {jinc 1})
+(print (do (dotimes (i 150) (jinc 1)) (jcall -)))  ; Expected: 0
+(fun {jdec x} {- x 1})
+(fun {jcall2 -} {jdec 5})
+(print (jcall2 +))  ; Expected: 6
+
+; Lexical scope
+(print (lexical 1))  ; Expected: 0
+(fun {adder n} {\ {x} {+ x n}})
+(def {add5} (adder 5))
+(def {n} 100)
+(print (add5 1))  ; Expected: 6
+(print (pmap add5 {1 2}))  ; Expected: Error: Function 'pmap' cannot share a lexical closure between threads.
+(print (pmap (\ {x} {\ {y} {+ x y}}) {1}))  ; Expected: Error: Parallel function returned a lexical closure, which cannot outlive the call.
+(print (pmap (\ {x} {+ x n}) {1 2}))  ; Expected: {101 102}
+(print (letrec ((f (lambda (k) (if (== k 0) 0 (+ 1 (f (- k 1))))))) (f 5)))  ; Expected: 5
+(print (lexical 0) (add5 1))  ; Expected: 1 6
+
+; Lazy sequences
+(print (realize (range 2 10 3)) (take 2 {1 2 3}))  ; Expected: {2 5 8} {1 2}
+(print (realize (take 4 (lazy-filter (\ {x} {> x 10}) (lazy-map (\ {x} {* x x}) (iterate (\ {x} {+ x 1}) 0))))))  ; Expected: {16 25 36 49}
+(print (range 1 2 0))  ; Expected: Error: Function 'range' passed a step of 0.
+
+; Loops
+(def {total} 0)
+(dotimes (i 5) (def {total} (+ total i)))
+(for-each (x (range 10 20 5)) (def {total} (+ total x)))
+(for-each (x {100 200}) (def {total} (+ total x)))
+(print total)  ; Expected: 335
+(print (dotimes (i "x") 1))  ; Expected: Error: Function 'dotimes' passed incorrect type for count. Got String, Expected Number.
+
 ; Error case (invalid input)
 ; (print (fib -1))  ; Should raise an error
\ No newline at end of file